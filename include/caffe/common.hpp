@@ -159,6 +159,13 @@ class Caffe {
   inline static void set_solver_count(int val) { Get().solver_count_ = val; }
   inline static bool root_solver() { return Get().root_solver_; }
   inline static void set_root_solver(bool val) { Get().root_solver_ = val; }
+  // Gives a thread that runs CPU work for another one the settings of that
+  // thread. If the thread has no context yet, the one made here holds no
+  // CUDA stream or cuBLAS and cuRAND handles, which CPU work does not use.
+  static void InitCpuWorker(Brew mode, int solver_count, bool root_solver);
+  // Swaps the random generator of this thread with *rng, to run a piece of
+  // work with its own seeded generator, whichever thread it runs on.
+  static void SwapRngStream(shared_ptr<RNG>* rng);
 
  protected:
 #ifndef CPU_ONLY
@@ -175,6 +182,8 @@ class Caffe {
  private:
   // The private constructor to avoid duplicate instantiation.
   Caffe();
+  // The context of a CPU worker thread, see InitCpuWorker().
+  Caffe(Brew mode, int solver_count, bool root_solver);
 
   DISABLE_COPY_AND_ASSIGN(Caffe);
 };
@@ -0,0 +1,71 @@
+#ifndef CAFFE_INFERENCE_NETS_HPP_
+#define CAFFE_INFERENCE_NETS_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Execution contexts of one Net that share a single, read-only copy
+ *        of its weights, to serve concurrent inference requests.
+ *
+ * Every context is a Net of its own, with its own layers and activations,
+ * whose parameters share the memory of the first context. So thread i can
+ * run Forward on context(i) while the other threads run theirs, taking no
+ * locks, and N threads hold the weights once instead of N times.
+ *
+ * The weights are made resident in the memory of the mode the contexts are
+ * built in, so that reading them no longer changes their state; every
+ * thread must set the same Caffe mode (and device) before running Forward,
+ * and nothing may write the weights while the contexts run.
+ *
+ * With plan_arena, the activations of each context are placed in one
+ * buffer, where blobs that are never used at the same time in the forward
+ * pass share memory. Such a context must then run its layers in index
+ * order (no Net::set_branch_threads).
+ */
+template <typename Dtype>
+class InferenceNets {
+ public:
+  /**
+   * @param param the net to run, normally in the TEST phase
+   * @param trained_file the weights to load, or "" to keep the initial ones
+   * @param num_contexts the number of threads that may run at once
+   * @param plan_arena whether to place the activations in one buffer
+   */
+  InferenceNets(const NetParameter& param, const string& trained_file,
+      int num_contexts, bool plan_arena = true);
+
+  inline int num_contexts() const { return contexts_.size(); }
+  /// @brief The context that the i-th thread runs Forward on.
+  inline Net<Dtype>* context(int i) {
+    CHECK_GE(i, 0);
+    CHECK_LT(i, contexts_.size());
+    return contexts_[i].get();
+  }
+  /// @brief The bytes of activations of each context, with and without
+  ///        the arena.
+  inline size_t arena_bytes() const { return arena_bytes_; }
+  inline size_t activation_bytes() const { return activation_bytes_; }
+
+ protected:
+  /// @brief Places the activations of a context in the given arena blob.
+  void PlanArena(Net<Dtype>* net, Blob<Dtype>* arena);
+
+  vector<shared_ptr<Net<Dtype> > > contexts_;
+  vector<shared_ptr<Blob<Dtype> > > arenas_;
+  size_t arena_bytes_;
+  size_t activation_bytes_;
+
+  DISABLE_COPY_AND_ASSIGN(InferenceNets);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_INFERENCE_NETS_HPP_
@@ -49,6 +49,8 @@ template <typename Dtype>
 class Batch {
  public:
   Blob<Dtype> data_, label_;
+  // The tops after the label, for layers with more than two
+  vector<shared_ptr<Blob<Dtype> > > extra_;
 };
 
 template <typename Dtype>
@@ -7,8 +7,11 @@
 #include <vector>
 
 #include "caffe/blob.hpp"
+#include "caffe/internal_thread.hpp"
 #include "caffe/layer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 
 namespace caffe {
 
@@ -18,10 +21,15 @@ namespace caffe {
 /**
  * @brief Write blobs to disk as HDF5 files.
  *
+ * Each Forward copies its bottoms into a free batch and queues it for a
+ * writer thread, which appends the rows to chunked, extendible "data" and
+ * "label" datasets. Forward only waits for the disk when queue_size batches
+ * are pending; the queue is flushed when the layer is destroyed.
+ *
  * TODO(dox): thorough documentation for Forward and proto params.
  */
 template <typename Dtype>
-class HDF5OutputLayer : public Layer<Dtype> {
+class HDF5OutputLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5OutputLayer(const LayerParameter& param)
       : Layer<Dtype>(param), file_opened_(false) {}
@@ -50,13 +58,18 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  virtual void SaveBlobs();
+  // Returns a free batch shaped for the bottoms, waiting for the writer if
+  // all are queued.
+  virtual Batch<Dtype>* NextBatch(const vector<Blob<Dtype>*>& bottom);
+  virtual void SaveBlobs(const Batch<Dtype>& batch);
+  virtual void InternalThreadEntry();
 
   bool file_opened_;
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  vector<shared_ptr<Batch<Dtype> > > batches_;
+  BlockingQueue<Batch<Dtype>*> batch_free_;
+  BlockingQueue<Batch<Dtype>*> batch_full_;
 };
 
 }  // namespace caffe
@@ -107,7 +107,8 @@ class SoftmaxWithLossLayer : public LossLayer<Dtype> {
   virtual Dtype get_normalizer(
       LossParameter_NormalizationMode normalization_mode, int valid_count);
 
-  /// The internal SoftmaxLayer used to map predictions to a distribution.
+  /// The internal SoftmaxLayer used to map predictions to a distribution
+  /// on the GPU; Forward_cpu computes the softmax inline with the loss.
   shared_ptr<Layer<Dtype> > softmax_layer_;
   /// prob stores the output probability predictions from the SoftmaxLayer.
   Blob<Dtype> prob_;
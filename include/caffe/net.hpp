@@ -1,6 +1,8 @@
 #ifndef CAFFE_NET_HPP_
 #define CAFFE_NET_HPP_
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+
 #include <map>
 #include <set>
 #include <string>
@@ -14,6 +16,29 @@
 
 namespace caffe {
 
+/**
+ * @brief A blob whose data and/or diff can live in a slice of the memory of
+ *        another (base) blob, so that the layer joining them copies nothing.
+ */
+struct BlobSlice {
+  int blob_id;
+  int base_id;
+  int offset;  // in values, from the start of the base blob
+  bool data;
+  bool diff;
+  BlobSlice(int b, int base, int o, bool da, bool di) :
+      blob_id(b), base_id(base), offset(o), data(da), diff(di) {}
+};
+
+/// @brief One run of a layer, for the timeline of a Net.
+struct LayerRun {
+  int layer_id;
+  bool backward;
+  int thread;
+  double start_us;  // since the net was initialized
+  double end_us;
+};
+
 /**
  * @brief Connects Layer%s together into a directed acyclic graph (DAG)
  *        specified by a NetParameter.
@@ -74,6 +99,27 @@ class Net {
   void BackwardFrom(int start);
   void BackwardTo(int end);
 
+  /**
+   * @brief Runs the independent layers of a pass (e.g., the branches of an
+   *        Inception module, or the streams of a two-stream net) concurrently
+   *        on up to num_threads threads, in CPU mode. 1 runs the layers one
+   *        by one in index order.
+   *
+   * A layer starts once every earlier layer of the pass that writes the
+   * blobs it uses, or uses the blobs it writes, has finished; so for
+   * deterministic layers the results are the same, bit for bit, as in index
+   * order. The layers run as OpenMP tasks, so this needs USE_OPENMP; the
+   * parallel loops within a layer run on one thread unless nested
+   * parallelism is enabled (OMP_MAX_ACTIVE_LEVELS).
+   */
+  void set_branch_threads(int num_threads);
+  inline int branch_threads() const { return branch_threads_; }
+  /// @brief Records the start and end of every layer run from now on.
+  inline void set_record_timeline(bool record) { record_timeline_ = record; }
+  /// @brief Writes the recorded layer runs as a Chrome trace (to view in
+  ///        chrome://tracing), and clears them.
+  void WriteTimeline(const string& filename);
+
   /**
    * @brief Reshape all layers from bottom to top.
    *
@@ -98,6 +144,18 @@ class Net {
    * called manually.
    */
   void ShareWeights();
+  /**
+   * @brief Finds the bottoms of Concat layers that can be written by their
+   *        producers straight into their slot of the top, which is the case
+   *        when the concat axis has only singleton axes before it, so every
+   *        bottom is one contiguous slice of the top.
+   *
+   * Note: this is called by Net::Init. The slices are only planned here;
+   * the memory manager that places the blobs (the PS solver) binds them,
+   * and ConcatLayer skips the copies of the bottoms it finds in place.
+   */
+  void PlanBlobSlices();
+  inline const vector<BlobSlice>& blob_slices() const { return blob_slices_; }
 
   /**
    * @brief For an already initialized net, implicitly copies (i.e., using no
@@ -242,6 +300,16 @@ class Net {
   void AppendParam(const NetParameter& param, const int layer_id,
                    const int param_id);
 
+  /// @brief Find the layers each layer waits for in each pass.
+  void FindLayerDeps();
+  /// @brief Run the given layers of a pass as their dependencies allow.
+  void RunBranches(const vector<int>& layer_ids, bool backward,
+      vector<Dtype>* losses);
+  void RunLayerTask(int layer_id, bool backward, vector<int>* pending,
+      const vector<vector<int> >* dependents, vector<Dtype>* losses);
+  /// @brief Run one layer, recording it in the timeline.
+  Dtype RunLayer(int layer_id, bool backward);
+
   /// @brief Helper for displaying debug info in Forward about input Blobs.
   void InputDebugInfo(const int layer_id);
   /// @brief Helper for displaying debug info in Forward.
@@ -307,6 +375,23 @@ class Net {
   vector<bool> has_params_decay_;
   /// The bytes of memory used by this net
   size_t memory_used_;
+  /// The blobs that can live in slices of other blobs, in layer order
+  vector<BlobSlice> blob_slices_;
+  /// The earlier layers each layer waits for in the forward pass, and the
+  /// later ones in the backward pass
+  vector<vector<int> > forward_deps_;
+  vector<vector<int> > backward_deps_;
+  int branch_threads_;
+  /// The settings of the thread that runs a pass on branch threads, and a
+  /// seed per layer of the pass, drawn in layer order, so that a random
+  /// layer does not depend on the thread it runs on
+  Caffe::Brew branch_mode_;
+  int branch_solver_count_;
+  bool branch_root_solver_;
+  vector<unsigned int> branch_seeds_;
+  bool record_timeline_;
+  vector<LayerRun> timeline_;
+  boost::posix_time::ptime timeline_start_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
   /// The root net that actually holds the shared layers in data parallelism
@@ -20,6 +20,9 @@ class NesterovSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void RegularizeAndComputeUpdateValue(int param_id, Dtype rate) {
+    this->FusedUpdateValue(param_id, rate, true);
+  }
 
   DISABLE_COPY_AND_ASSIGN(NesterovSolver);
 };
@@ -35,6 +38,7 @@ class AdaGradSolver : public SGDSolver<Dtype> {
   virtual inline const char* type() const { return "AdaGrad"; }
 
  protected:
+  virtual inline bool fused_update() const { return false; }
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
@@ -56,6 +60,7 @@ class RMSPropSolver : public SGDSolver<Dtype> {
   virtual inline const char* type() const { return "RMSProp"; }
 
  protected:
+  virtual inline bool fused_update() const { return false; }
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
@@ -80,6 +85,7 @@ class AdaDeltaSolver : public SGDSolver<Dtype> {
   virtual inline const char* type() const { return "AdaDelta"; }
 
  protected:
+  virtual inline bool fused_update() const { return false; }
   void AdaDeltaPreSolve();
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
 
@@ -105,6 +111,7 @@ class AdamSolver : public SGDSolver<Dtype> {
   virtual inline const char* type() const { return "Adam"; }
 
  protected:
+  virtual inline bool fused_update() const { return false; }
   void AdamPreSolve();
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
 
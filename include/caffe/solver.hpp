@@ -8,6 +8,9 @@
 
 #include "caffe/net.hpp"
 #include "caffe/solver_factory.hpp"
+#include "caffe/util/access_simulator.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/gradient_compression.hpp"
 
 #include "geeps.hpp"
 
@@ -23,10 +26,28 @@ struct PsConfig {
   string snapshot_name;
   int keep_momentum;
   int debug;
+  string compression;
+  string layer_compression;
+  string staleness_policy;
+  int staleness_momentum;
+  int distributed_test;
+  string table_partition;
+  int num_ps_tables;
+  string table_layout_file;
+  int accumulate_gradients;
+  string sync_mode;
+  int plan_only;  /* prepare the access plan without starting GeePS */
+  string recompute;
+  size_t recompute_budget;
   GeePsConfig geeps_config;
   PsConfig() : slack(0), batches_per_clock(1),
       multi_table(1), layers_per_table(1),
-      snapshot_name(""), keep_momentum(1) {}
+      snapshot_name(""), keep_momentum(1),
+      compression("none"), layer_compression(""),
+      staleness_policy("none"), staleness_momentum(0),
+      distributed_test(0), table_partition("layers"), num_ps_tables(0),
+      table_layout_file(""), accumulate_gradients(0), sync_mode("stream"),
+      plan_only(0), recompute("none"), recompute_budget(0) {}
 };
 
 struct RowAccessInfo {
@@ -64,6 +85,10 @@ struct LayerHandles {
   int write_handle;
   int history_access_handle;
   int history_postaccess_handle;
+  int residual_access_handle;
+  int residual_postaccess_handle;
+  int accum_access_handle;
+  int accum_postaccess_handle;
   vector<int> imbs_to_access_fw;
   vector<int> imbs_to_release_fw;
   vector<int> imb_diffs_to_access_fw;
@@ -82,6 +107,10 @@ struct LayerInfo {
   size_t table_id;
   vector<size_t> row_ids;
   vector<size_t> history_data_row_ids;
+  size_t history_slot_vals;
+  vector<size_t> residual_row_ids;
+  CompressionConfig compression;
+  vector<size_t> accum_row_ids;
   size_t num_vals;
   vector<ParamInfo> param_infos;
   IntSet imbs_used_fw;
@@ -96,9 +125,15 @@ struct LayerInfo {
   vector<ImbInfo> imbs_to_release_bw;
   vector<ImbInfo> imb_diffs_to_access_bw;
   vector<ImbInfo> imb_diffs_to_release_bw;
+  /* Layers whose tops are not kept from the forward pass, but recomputed
+   * from their bottoms before the backward pass of this layer */
+  vector<int> layers_to_recompute;
   size_t param_size;
   size_t imb_size;
   vector<LayerHandles> layer_handles;
+  /* The forward accesses of the test pass, recorded after the clock and
+   * made again for every test batch, see Solver::CheckTestReplay() */
+  LayerHandles test_handles;
   double fw_read_time;
   double fw_compute_time;
   double fw_write_time;
@@ -108,6 +143,11 @@ struct LayerInfo {
   double test_time;
   double snapshot_model_time;
   double snapshot_solverstate_time;
+  double compression_ratio;
+  double residual_norm;
+  int num_compressed_updates;
+  int fw_staleness;
+  int bw_staleness;
 };
 
 /**
@@ -151,6 +191,12 @@ class Solver {
   void InitTestNets();
   void InitPs();
   void PrepareAccessInfo();
+  void PlanRecompute();
+  // The GPU memory accesses of one clock, in the order of the virtual
+  // iteration, for simulating the plan offline (see PsConfig::plan_only).
+  // With test nets, the clock ends with one batch of the test pass.
+  void PlanAccesses(vector<PlannedAccess> *plan) const;
+  void BalanceTables();
   void InitSnapshot();
   void InitNetParameterSnapshot();
 
@@ -173,7 +219,7 @@ class Solver {
   // function that produces a SolverState protocol buffer that needs to be
   // written to disk together with the learned net.
   void Snapshot();
-  virtual ~Solver() {}
+  virtual ~Solver();
   inline const SolverParameter& param() const { return param_; }
   inline shared_ptr<Net<Dtype> > net() { return net_; }
   inline const vector<shared_ptr<Net<Dtype> > >& test_nets() {
@@ -217,6 +263,36 @@ class Solver {
   virtual void RestoreSolverStateFromHDF5(const string& state_file) = 0;
   virtual void RestoreSolverStateFromBinaryProto(const string& state_file) = 0;
   void DisplayOutputBlobs(const int net_id);
+  int ReadStaleness(const float *params_vals, const LayerInfo& layer_info,
+      bool test);
+  int UpdatesPerClock() const;
+  float CountedUpdate(int batch_id) const;
+  void AccumulateTestOutputs(
+      const shared_ptr<Net<Dtype> >& test_net, Dtype batch_loss);
+  void LogTestScores(const int test_net_id, const vector<Dtype>& test_score,
+      Dtype loss, int num_batches);
+  // Makes the accesses of the test pass twice with no compute, as the test
+  // batches do, to check at init that GeePS can replay the accesses
+  // recorded after the clock.
+  void CheckTestReplay();
+  // Ends a clock, exchanging the test scores once per clock.
+  void EndClock();
+  // A clock that makes the accesses of a clock without training, to let
+  // the test scores in flight reach the logs at the end.
+  void DrainClock();
+  void StartTestScoreExchange();
+  void FinishTestScoreExchange();
+  void ReportTestScores(const vector<float>& score_sums);
+  Dtype StalenessScale(int staleness) const;
+  // Time the stages of the PS loop. With sync_mode "stream" the stream is
+  // synchronized at the end of every stage, with "events" the stages are
+  // timed with events and only WaitForStream() synchronizes. The sync mode
+  // only changes how the times are collected: GeePS reuses a buffer as soon
+  // as it is given back, so WaitForStream() still blocks before every
+  // release, and the layers do not overlap with the PS accesses.
+  void StartStage();
+  void StopStage(double *seconds);
+  void WaitForStream();
   void UpdateSmoothedLoss(Dtype loss, int start_iter, int average_loss);
 
   SolverParameter param_;
@@ -226,9 +302,62 @@ class Solver {
 
   vector<RowAccessInfo> imb_data_infos_;
   vector<RowAccessInfo> imb_diff_infos_;
+  // The blob whose memory each intermediate blob shares (itself if it
+  // does not share); the accesses to a view are made to that blob.
+  vector<int> imb_data_roots_;
+  vector<int> imb_diff_roots_;
+  // The blobs that live in slices of each intermediate blob, with their
+  // offsets; they are bound to its buffer together with it.
+  vector<vector<pair<int, int> > > imb_data_slices_;
+  vector<vector<pair<int, int> > > imb_diff_slices_;
   int num_tables_;
   vector<LayerInfo> layer_infos_;
+  // The blobs that the test pass still holds after its last layer, as the
+  // training pass keeps them for its backward pass, and their releases.
+  vector<ImbInfo> test_imbs_to_release_;
+  vector<ImbInfo> test_imb_diffs_to_release_;
+  LayerHandles test_end_handles_;
+  int num_history_slots_;
   vector<Blob<Dtype>*> test_net_output_blobs_;
+  // The number of clocks this worker has finished, and a histogram of
+  // the staleness (in clocks) of the parameter data it has read.
+  int ps_clock_;
+  vector<int> staleness_counts_;
+  // Scales the momentum of the current update to make up for staleness.
+  Dtype momentum_scale_;
+  // Whether this clock measures the compression stats, which is only done
+  // on the clock before they are logged, as measuring waits for the GPU.
+  bool sample_ps_stats_;
+  // GPU memory for the thresholds and scales of the update compression.
+  Blob<Dtype> compression_scratch_;
+  shared_ptr<StreamStageTimer> stage_timer_;
+  cudaStream_t counter_stream_;
+  // The update counters hold the clock of the data modulo this many clocks.
+  int update_counter_period_;
+  // Sums of the test net outputs and losses over the test batches so far.
+  vector<Dtype> test_scores_;
+  Dtype test_loss_;
+  int num_test_batches_;
+  // Distributed testing: the test sums of all workers are added up in
+  // the test score table, which every worker reads and updates once per
+  // clock. Sums queued in test_score_update_ are sent at the next clock,
+  // and reported once that clock is within the read slack. The copies to
+  // and from the table are queued on the Caffe stream, in
+  // test_score_sending_ and test_score_sums_.
+  size_t test_score_table_id_;
+  vector<size_t> test_score_row_ids_;
+  vector<int> test_score_offsets_;
+  int num_test_score_vals_;
+  LayerHandles test_score_handles_;
+  vector<float> test_score_update_;
+  vector<float> test_score_reported_;
+  vector<float> test_score_sending_;
+  vector<float> test_score_sums_;
+  int test_score_report_clock_;
+  bool test_score_reading_;
+  // The iterations of the queued test and of the test being reported.
+  int test_score_iter_;
+  int test_score_report_iter_;
 
   NetParameter snapshot_net_param_protobuf_;
   SolverState snapshot_solver_state_protobuf_;
@@ -274,6 +403,7 @@ class SGDSolver : public Solver<Dtype> {
       : Solver<Dtype>(param, ps_config) { PreSolve(); }
 
   const vector<shared_ptr<Blob<Dtype> > >& history() { return history_; }
+  virtual inline const char* type() const { return "SGD"; }
 
  protected:
   void PreSolve();
@@ -284,18 +414,35 @@ class SGDSolver : public Solver<Dtype> {
   virtual void InitSolverStateSnapshot();
   virtual void Normalize(int param_id);
   virtual void Regularize(int param_id);
+  // The PS adds the update to the parameter data instead of subtracting
+  // it, so this and every overriding solver scale it by the negated local
+  // learning rate.
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  // Does the work of Regularize and ComputeUpdateValue, in a single pass
+  // over the parameter when fused_update() allows it, and leaves the
+  // stream unsynchronized.
+  virtual void RegularizeAndComputeUpdateValue(int param_id, Dtype rate);
+  void FusedUpdateValue(int param_id, Dtype rate, bool nesterov);
+  // Whether ComputeUpdateValue is the momentum update that FusedUpdateValue
+  // computes. Solvers with their own update rule return false.
+  virtual inline bool fused_update() const { return true; }
   virtual void ClipGradients();
   virtual void SnapshotSolverState(const string& model_filename);
   virtual void SnapshotSolverStateToBinaryProto(const string& model_filename);
   virtual void SnapshotSolverStateToHDF5(const string& model_filename);
   virtual void RestoreSolverStateFromHDF5(const string& state_file);
   virtual void RestoreSolverStateFromBinaryProto(const string& state_file);
+  // Scratch buffers for the update of one parameter, reshaped to it.
+  Blob<Dtype>* update_buffer(int param_id);
+  Blob<Dtype>* temp_buffer(int param_id);
   // history maintains the historical momentum data.
   // update maintains update related data and is not needed in snapshots.
   // temp maintains other information that might be needed in computation
   //   of gradients/updates and is not needed in snapshots
-  vector<shared_ptr<Blob<Dtype> > > history_, update_, temp_;
+  // update and temp are shared by all parameters and sized to the largest
+  //   one, their memory is allocated on first use.
+  vector<shared_ptr<Blob<Dtype> > > history_;
+  shared_ptr<Blob<Dtype> > update_, temp_;
 
   DISABLE_COPY_AND_ASSIGN(SGDSolver);
 };
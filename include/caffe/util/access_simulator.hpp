@@ -0,0 +1,53 @@
+#ifndef CAFFE_UTIL_ACCESS_SIMULATOR_HPP_
+#define CAFFE_UTIL_ACCESS_SIMULATOR_HPP_
+
+#include <string>
+#include <vector>
+
+namespace caffe {
+
+/* One step of the access sequence that a clock makes to the GPU memory
+ * managed by the parameter server. An access makes a buffer resident until
+ * its release; a compute step marks where a layer runs, so that its
+ * resident set can be reported. */
+struct PlannedAccess {
+  enum Type { ACCESS, RELEASE, COMPUTE };
+  Type type;
+  std::string name;  /* buffer name, or layer name for COMPUTE */
+  size_t bytes;
+  bool fetch;  /* ACCESS: the data in the buffer is read */
+  bool keep;   /* RELEASE: the data in the buffer is used again */
+  PlannedAccess(Type t, const std::string& n, size_t b = 0,
+      bool f = false, bool k = false) :
+      type(t), name(n), bytes(b), fetch(f), keep(k) {}
+};
+
+struct AccessPlanStats {
+  /* The bytes of the buffers in use at once, the least memory the
+   * plan can run in */
+  size_t peak_live_bytes;
+  /* The bytes in GPU memory, including the kept buffers cached there */
+  size_t peak_resident_bytes;
+  /* The bytes moved between CPU and GPU memory in one clock,
+   * once the memory has reached its steady state */
+  size_t swap_in_bytes;
+  size_t swap_out_bytes;
+  /* The live bytes at every COMPUTE step, in plan order */
+  std::vector<std::string> compute_names;
+  std::vector<size_t> compute_live_bytes;
+  AccessPlanStats() : peak_live_bytes(0), peak_resident_bytes(0),
+      swap_in_bytes(0), swap_out_bytes(0) {}
+};
+
+/* Replays the access plan of one clock twice against a GPU memory of the
+ * given capacity. Kept buffers stay cached in GPU memory until the space
+ * is needed, the cached buffer used farthest in the future being evicted
+ * first, as the plan of every clock is known in advance. An evicted buffer
+ * is swapped out if its next access reads it, and swapped in at that
+ * access. The swap volume is counted on the second clock. */
+void SimulateAccessPlan(const std::vector<PlannedAccess>& plan,
+    size_t capacity, AccessPlanStats* stats);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ACCESS_SIMULATOR_HPP_
@@ -3,6 +3,9 @@
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <deque>
+#include <vector>
+
 #include "caffe/util/device_alternate.hpp"
 
 namespace caffe {
@@ -47,6 +50,48 @@ class CPUTimer : public Timer {
   virtual float MicroSeconds();
 };
 
+/**
+ * @brief Times the stages of the work enqueued on the Caffe stream
+ *        without blocking the host.
+ *
+ * Start() and Stop() record events on the stream, and the time between
+ * them is added to the counter passed to Stop() once the stage has run.
+ * Collect() adds the times of the stages that have completed, and
+ * Synchronize() waits for the stream and adds them all. In CPU mode the
+ * work is done when it is enqueued, so host time stamps stand in for the
+ * events and the stages complete at Stop().
+ */
+class StreamStageTimer {
+ public:
+  StreamStageTimer();
+  ~StreamStageTimer();
+  void Start();
+  void Stop(double* seconds);
+  void Collect();
+  void Synchronize();
+
+  inline int num_pending() const { return pending_.size(); }
+
+ protected:
+  struct Stage {
+#ifndef CPU_ONLY
+    cudaEvent_t start_gpu;
+    cudaEvent_t stop_gpu;
+#endif
+    boost::posix_time::ptime start_cpu;
+    boost::posix_time::ptime stop_cpu;
+    double* seconds;
+  };
+  /* Adds the time of a completed stage and recycles its events */
+  void Retire(Stage* stage);
+
+  bool gpu_;
+  bool running_;
+  Stage current_;
+  std::deque<Stage> pending_;
+  std::vector<Stage> free_;
+};
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_BENCHMARK_H_
@@ -0,0 +1,72 @@
+#ifndef CAFFE_UTIL_GRADIENT_COMPRESSION_HPP_
+#define CAFFE_UTIL_GRADIENT_COMPRESSION_HPP_
+
+#include <string>
+#include <vector>
+
+namespace caffe {
+
+/* Lossy sparsification or quantization of the updates that a worker sends
+ * to the parameter server. The part of an update that is dropped is kept in
+ * a residual buffer and added to the next update of the same values (error
+ * feedback), so it delays gradient mass instead of losing it.
+ *
+ * This does not reduce PS traffic: GeePS rows are dense floats, so the
+ * compressed update is still sent as a dense buffer, only with fewer
+ * distinct values. It is there to study the effect of these encodings on
+ * convergence until GeePS can send sparse or quantized rows. On the GPU
+ * the thresholds and scales stay in device memory, so it adds work to the
+ * stream but does not make the host wait. */
+enum CompressionMethod {
+  COMPRESSION_NONE,
+  COMPRESSION_THRESHOLD,  /* send the values with |u| >= threshold */
+  COMPRESSION_TOPK,       /* send about a "ratio" fraction of largest |u| */
+  COMPRESSION_INT8,       /* 8-bit linear quantization scaled by max |u| */
+  COMPRESSION_SIGN        /* 1-bit quantization scaled by mean |u| */
+};
+
+struct CompressionConfig {
+  CompressionMethod method;
+  float ratio;
+  float threshold;
+  CompressionConfig() : method(COMPRESSION_NONE), ratio(0.01), threshold(0) {}
+};
+
+/* Parses "none", "threshold:<t>", "topk:<ratio>", "int8" or "sign" */
+CompressionConfig ParseCompressionConfig(const std::string& spec);
+
+/* Parses the default method and the per-layer overrides, given as
+ * "<layer>=<method>[,<layer>=<method>...]", into one config per layer. */
+void ParseLayerCompressionConfigs(const std::string& default_spec,
+    const std::string& layer_specs,
+    const std::vector<std::string>& layer_names,
+    std::vector<CompressionConfig>* configs);
+
+/* Chooses the top-k threshold from a strided sample of |u|,
+ * the sample is reordered in place. */
+template <typename Dtype>
+Dtype compression_topk_threshold(std::vector<Dtype>* abs_sample,
+    const float ratio);
+
+/* Compresses the n values of update in place: update becomes the values
+ * to send, and residual becomes what is left for the next update.
+ * Returns the size that an encoded update would have relative to the dense
+ * one, counting a 32-bit index for each value kept by the sparse methods;
+ * the update actually sent is still dense. */
+template <typename Dtype>
+Dtype compress_update_cpu(const CompressionConfig& config, const int n,
+    Dtype* update, Dtype* residual);
+
+/* The GPU memory, in values, that compress_update_gpu needs for scratch */
+const int COMPRESSION_SCRATCH_SIZE = 257;
+
+/* The GPU version leaves the work queued on the Caffe stream. Counting the
+ * values kept waits for it, so without measure the threshold and top-k
+ * methods return 0 instead. */
+template <typename Dtype>
+Dtype compress_update_gpu(const CompressionConfig& config, const int n,
+    Dtype* update, Dtype* residual, Dtype* scratch, bool measure = true);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_GRADIENT_COMPRESSION_HPP_
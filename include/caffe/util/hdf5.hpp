@@ -2,14 +2,22 @@
 #define CAFFE_UTIL_HDF5_H_
 
 #include <string>
+#include <vector>
 
 #include "hdf5.h"
 #include "hdf5_hl.h"
 
 #include "caffe/blob.hpp"
 
+namespace boost { class mutex; }
+
 namespace caffe {
 
+// Serializes the HDF5 calls, since the HDF5 library is usually built without
+// thread safety and layers call it from background threads. Every sequence
+// of HDF5 calls, including opening and closing files, holds it.
+boost::mutex& hdf5_mutex();
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -20,6 +28,22 @@ void hdf5_load_nd_dataset(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
     Blob<Dtype>* blob);
 
+// Returns the dimensions of a dataset without reading it.
+std::vector<hsize_t> hdf5_get_dataset_dims(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim);
+
+// Reads rows [first_row, first_row + num_rows) along the first axis of a
+// dataset into data, which must hold num_rows rows.
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(hid_t file_id, const char* dataset_name_,
+    hsize_t first_row, hsize_t num_rows, Dtype* data);
+
+// Appends the rows of blob along the first axis of a dataset, creating it
+// chunked and extendible (with the rows of blob per chunk) if needed.
+template <typename Dtype>
+void hdf5_append_nd_dataset(hid_t file_id, const string& dataset_name,
+    const Blob<Dtype>& blob);
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob,
@@ -142,6 +142,15 @@ DEFINE_CAFFE_CPU_UNARY_FUNC(fabs, y[i] = std::fabs(x[i]));
 template <typename Dtype>
 void caffe_cpu_scale(const int n, const Dtype alpha, const Dtype *x, Dtype* y);
 
+// Conversion between fp32 and IEEE 754 half precision values, which are
+// stored as their uint16_t bit patterns. Rounds to nearest even; uses the
+// F16C instructions when the compiler targets them. The PS tables stay fp32,
+// as GeePS rows are float and its servers add updates as floats; these are
+// for writing features as fp16 (the raw_fp16 type of extract_features).
+void caffe_cpu_float2half(const int n, const float* x, uint16_t* y);
+
+void caffe_cpu_half2float(const int n, const uint16_t* x, float* y);
+
 #ifndef CPU_ONLY  // GPU
 
 // Decaf gpu gemm provides an interface that is almost the same as the cpu
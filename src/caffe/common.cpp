@@ -19,6 +19,20 @@ Caffe& Caffe::Get() {
   return *(thread_instance_.get());
 }
 
+void Caffe::InitCpuWorker(Brew mode, int solver_count, bool root_solver) {
+  if (!thread_instance_.get()) {
+    thread_instance_.reset(new Caffe(mode, solver_count, root_solver));
+    return;
+  }
+  set_mode(mode);
+  set_solver_count(solver_count);
+  set_root_solver(root_solver);
+}
+
+void Caffe::SwapRngStream(shared_ptr<RNG>* rng) {
+  Get().random_generator_.swap(*rng);
+}
+
 // random seeding
 int64_t cluster_seedgen(void) {
   int64_t s, seed, pid;
@@ -55,6 +69,10 @@ Caffe::Caffe()
     : random_generator_(), mode_(Caffe::CPU),
       solver_count_(1), root_solver_(true) { }
 
+Caffe::Caffe(Brew mode, int solver_count, bool root_solver)
+    : random_generator_(), mode_(mode),
+      solver_count_(solver_count), root_solver_(root_solver) { }
+
 Caffe::~Caffe() { }
 
 void Caffe::set_random_seed(const unsigned int seed) {
@@ -117,6 +135,11 @@ Caffe::Caffe()
   CURAND_CHECK(curandSetStream(curand_generator_, cuda_stream_));
 }
 
+Caffe::Caffe(Brew mode, int solver_count, bool root_solver)
+    : cuda_stream_(NULL), cublas_handle_(NULL), curand_generator_(NULL),
+      random_generator_(), mode_(mode),
+      solver_count_(solver_count), root_solver_(root_solver) { }
+
 Caffe::~Caffe() {
   if (cublas_handle_) CUBLAS_CHECK(cublasDestroy(cublas_handle_));
   if (curand_generator_) {
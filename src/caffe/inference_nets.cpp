@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/inference_nets.hpp"
+#include "caffe/syncedmem.hpp"
+
+namespace caffe {
+
+// Offsets in the arena are kept at multiples of this many values.
+static const size_t kArenaAlign = 16;
+
+template <typename Dtype>
+InferenceNets<Dtype>::InferenceNets(const NetParameter& param,
+    const string& trained_file, int num_contexts, bool plan_arena)
+    : arena_bytes_(0), activation_bytes_(0) {
+  CHECK_GT(num_contexts, 0);
+  NetParameter test_param(param);
+  test_param.mutable_state()->set_phase(TEST);
+  contexts_.push_back(shared_ptr<Net<Dtype> >(new Net<Dtype>(test_param)));
+  if (!trained_file.empty()) {
+    contexts_[0]->CopyTrainedLayersFrom(trained_file);
+  }
+  // Make the weights resident where the contexts read them, so that the
+  // concurrent reads never need to copy or change their head.
+  const vector<shared_ptr<Blob<Dtype> > >& params = contexts_[0]->params();
+  for (int i = 0; i < params.size(); ++i) {
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      params[i]->cpu_data();
+      break;
+    case Caffe::GPU:
+      params[i]->gpu_data();
+      break;
+    }
+  }
+  for (int i = 1; i < num_contexts; ++i) {
+    contexts_.push_back(shared_ptr<Net<Dtype> >(new Net<Dtype>(test_param)));
+    contexts_[i]->ShareTrainedLayersWith(contexts_[0].get());
+  }
+  if (plan_arena) {
+    for (int i = 0; i < num_contexts; ++i) {
+      arenas_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+      PlanArena(contexts_[i].get(), arenas_[i].get());
+    }
+    LOG(INFO) << "Activations of each of the " << num_contexts
+        << " contexts take " << arena_bytes_ << " bytes instead of "
+        << activation_bytes_;
+  }
+}
+
+template <typename Dtype>
+void InferenceNets<Dtype>::PlanArena(Net<Dtype>* net, Blob<Dtype>* arena) {
+  // Blobs that share memory (in-place layers and views) form one group,
+  // live from the first layer that writes it to the last that reads it.
+  const int num_layers = net->layers().size();
+  std::map<SyncedMemory*, int> group_ids;
+  vector<SyncedMemory*> memories;
+  vector<Blob<Dtype>*> group_blobs;
+  vector<int> first;
+  vector<int> last;
+  // The net inputs are live before the first layer and the outputs after
+  // the last one.
+  for (int i = -1; i <= num_layers; ++i) {
+    vector<Blob<Dtype>*> blobs;
+    if (i < 0) {
+      blobs = net->input_blobs();
+    } else if (i == num_layers) {
+      blobs = net->output_blobs();
+    } else {
+      blobs = net->bottom_vecs()[i];
+      blobs.insert(blobs.end(), net->top_vecs()[i].begin(),
+          net->top_vecs()[i].end());
+    }
+    for (int j = 0; j < blobs.size(); ++j) {
+      Blob<Dtype>* blob = blobs[j];
+      SyncedMemory* memory = blob->data().get();
+      if (memory == NULL) {
+        continue;
+      }
+      std::map<SyncedMemory*, int>::iterator it = group_ids.find(memory);
+      if (it == group_ids.end()) {
+        it = group_ids.insert(std::make_pair(memory, memories.size())).first;
+        memories.push_back(memory);
+        group_blobs.push_back(blob);
+        first.push_back(i);
+        last.push_back(i);
+      }
+      last[it->second] = i;
+    }
+  }
+
+  // Place the largest groups first, each at the lowest offset that does not
+  // overlap a placed group whose lifetime overlaps its own. Groups already
+  // holding values (e.g. filled at setup) keep their own memory.
+  vector<std::pair<size_t, int> > order;
+  vector<size_t> counts(memories.size());
+  for (int g = 0; g < memories.size(); ++g) {
+    counts[g] = (memories[g]->size() + sizeof(Dtype) - 1) / sizeof(Dtype);
+    counts[g] = (counts[g] + kArenaAlign - 1) / kArenaAlign * kArenaAlign;
+    if (memories[g]->head() == SyncedMemory::UNINITIALIZED && counts[g]) {
+      order.push_back(std::make_pair(counts[g], g));
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+      std::greater<std::pair<size_t, int> >());
+  vector<size_t> offsets(memories.size());
+  vector<int> placed;
+  size_t total = 0;
+  size_t unplanned = 0;
+  for (int k = 0; k < order.size(); ++k) {
+    const int g = order[k].second;
+    vector<std::pair<size_t, size_t> > taken;
+    for (int p = 0; p < placed.size(); ++p) {
+      const int h = placed[p];
+      if (first[h] <= last[g] && first[g] <= last[h]) {
+        taken.push_back(std::make_pair(offsets[h], offsets[h] + counts[h]));
+      }
+    }
+    std::sort(taken.begin(), taken.end());
+    size_t offset = 0;
+    for (int t = 0; t < taken.size(); ++t) {
+      if (taken[t].first >= offset + counts[g]) {
+        break;
+      }
+      offset = std::max(offset, taken[t].second);
+    }
+    offsets[g] = offset;
+    placed.push_back(g);
+    total = std::max(total, offset + counts[g]);
+    unplanned += counts[g];
+  }
+  arena_bytes_ = total * sizeof(Dtype);
+  activation_bytes_ = unplanned * sizeof(Dtype);
+  if (!total) {
+    return;
+  }
+
+  vector<int> shape(1, total);
+  arena->Reshape(shape);
+  Dtype* base = NULL;
+  switch (Caffe::mode()) {
+  case Caffe::CPU:
+    base = arena->mutable_cpu_data();
+    break;
+  case Caffe::GPU:
+    base = arena->mutable_gpu_data();
+    break;
+  }
+  for (int p = 0; p < placed.size(); ++p) {
+    const int g = placed[p];
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      group_blobs[g]->set_cpu_data(base + offsets[g]);
+      break;
+    case Caffe::GPU:
+      group_blobs[g]->set_gpu_data(base + offsets[g], true);
+      break;
+    }
+  }
+}
+
+INSTANTIATE_CLASS(InferenceNets);
+
+}  // namespace caffe
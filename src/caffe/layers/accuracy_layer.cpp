@@ -1,5 +1,3 @@
-#include <functional>
-#include <utility>
 #include <vector>
 
 #include "caffe/layers/accuracy_layer.hpp"
@@ -44,21 +42,48 @@ void AccuracyLayer<Dtype>::Reshape(
   }
 }
 
+// Returns the rank of class `label` among the num_labels scores, which are
+// laid out with the given stride. A class outranks the label if its score is
+// greater, or equal and its index is higher, which is the order that
+// std::partial_sort with std::greater<std::pair<Dtype, int> > produces. Both
+// loops are branch-free so that the compiler can vectorize them.
+template <typename Dtype>
+static inline int LabelRank(const Dtype* scores, const int num_labels,
+    const int stride, const int label) {
+  const Dtype label_score = scores[label * stride];
+  int rank = 0;
+  for (int k = 0; k < label; ++k) {
+    rank += (scores[k * stride] > label_score);
+  }
+  for (int k = label + 1; k < num_labels; ++k) {
+    rank += (scores[k * stride] >= label_score);
+  }
+  return rank;
+}
+
 template <typename Dtype>
 void AccuracyLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  Dtype accuracy = 0;
   const Dtype* bottom_data = bottom[0]->cpu_data();
   const Dtype* bottom_label = bottom[1]->cpu_data();
   const int dim = bottom[0]->count() / outer_num_;
   const int num_labels = bottom[0]->shape(label_axis_);
-  vector<Dtype> maxval(top_k_+1);
-  vector<int> max_id(top_k_+1);
+  Dtype* nums_buffer = NULL;
+  Dtype* accuracies = NULL;
   if (top.size() > 1) {
-    caffe_set(nums_buffer_.count(), Dtype(0), nums_buffer_.mutable_cpu_data());
-    caffe_set(top[1]->count(), Dtype(0), top[1]->mutable_cpu_data());
+    nums_buffer = nums_buffer_.mutable_cpu_data();
+    accuracies = top[1]->mutable_cpu_data();
+    caffe_set(nums_buffer_.count(), Dtype(0), nums_buffer);
+    caffe_set(top[1]->count(), Dtype(0), accuracies);
   }
+  // Instead of sorting the scores of every sample, count the classes that
+  // outrank the true label; the prediction is correct iff fewer than top_k_
+  // classes do. This needs no per-sample allocation and a single pass.
+  int accuracy = 0;
   int count = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for reduction(+: accuracy, count)
+#endif
   for (int i = 0; i < outer_num_; ++i) {
     for (int j = 0; j < inner_num_; ++j) {
       const int label_value =
@@ -66,24 +91,23 @@ void AccuracyLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       if (has_ignore_label_ && label_value == ignore_label_) {
         continue;
       }
-      if (top.size() > 1) ++nums_buffer_.mutable_cpu_data()[label_value];
       DCHECK_GE(label_value, 0);
       DCHECK_LT(label_value, num_labels);
-      // Top-k accuracy
-      std::vector<std::pair<Dtype, int> > bottom_data_vector;
-      for (int k = 0; k < num_labels; ++k) {
-        bottom_data_vector.push_back(std::make_pair(
-            bottom_data[i * dim + k * inner_num_ + j], k));
+      const bool correct = LabelRank(bottom_data + i * dim + j, num_labels,
+          inner_num_, label_value) < top_k_;
+      if (correct) {
+        ++accuracy;
       }
-      std::partial_sort(
-          bottom_data_vector.begin(), bottom_data_vector.begin() + top_k_,
-          bottom_data_vector.end(), std::greater<std::pair<Dtype, int> >());
-      // check if true label is in top k predictions
-      for (int k = 0; k < top_k_; k++) {
-        if (bottom_data_vector[k].second == label_value) {
-          ++accuracy;
-          if (top.size() > 1) ++top[1]->mutable_cpu_data()[label_value];
-          break;
+      if (nums_buffer) {
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+        nums_buffer[label_value] += 1;
+        if (correct) {
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+          accuracies[label_value] += 1;
         }
       }
       ++count;
@@ -91,12 +115,10 @@ void AccuracyLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   }
 
   // LOG(INFO) << "Accuracy: " << accuracy;
-  top[0]->mutable_cpu_data()[0] = accuracy / count;
+  top[0]->mutable_cpu_data()[0] = Dtype(accuracy) / count;
   if (top.size() > 1) {
     for (int i = 0; i < top[1]->count(); ++i) {
-      top[1]->mutable_cpu_data()[i] =
-          nums_buffer_.cpu_data()[i] == 0 ? 0
-          : top[1]->cpu_data()[i] / nums_buffer_.cpu_data()[i];
+      accuracies[i] = nums_buffer[i] == 0 ? 0 : accuracies[i] / nums_buffer[i];
     }
   }
   // Accuracy layer should not be used as a loss function.
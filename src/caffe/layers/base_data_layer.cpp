@@ -55,6 +55,9 @@ void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
     if (this->output_labels_) {
       prefetch_[i].label_.mutable_cpu_data();
     }
+    for (int j = 0; j < prefetch_[i].extra_.size(); ++j) {
+      prefetch_[i].extra_[j]->mutable_cpu_data();
+    }
   }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
@@ -63,6 +66,9 @@ void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
       if (this->output_labels_) {
         prefetch_[i].label_.mutable_gpu_data();
       }
+      for (int j = 0; j < prefetch_[i].extra_.size(); ++j) {
+        prefetch_[i].extra_[j]->mutable_gpu_data();
+      }
     }
   }
 #endif
@@ -120,6 +126,11 @@ void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     caffe_copy(batch->label_.count(), batch->label_.cpu_data(),
         top[1]->mutable_cpu_data());
   }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    top[i + 2]->ReshapeLike(*batch->extra_[i]);
+    caffe_copy(batch->extra_[i]->count(), batch->extra_[i]->cpu_data(),
+        top[i + 2]->mutable_cpu_data());
+  }
 
   prefetch_free_.push(batch);
 }
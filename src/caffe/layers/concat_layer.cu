@@ -35,6 +35,12 @@ void ConcatLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->gpu_data();
     const int bottom_concat_axis = bottom[i]->shape(concat_axis_);
+    if (bottom_data == top_data + offset_concat_axis * concat_input_size_ &&
+        num_concats_ == 1) {
+      // Already written in place (see Net::PlanBlobSlices)
+      offset_concat_axis += bottom_concat_axis;
+      continue;
+    }
     const int bottom_concat_size = bottom_concat_axis * concat_input_size_;
     const int nthreads = bottom_concat_size * num_concats_;
     Concat<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
@@ -59,6 +65,11 @@ void ConcatLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     const int bottom_concat_axis = bottom[i]->shape(concat_axis_);
     if (propagate_down[i]) {
       Dtype* bottom_diff = bottom[i]->mutable_gpu_diff();
+      if (bottom_diff == top_diff + offset_concat_axis * concat_input_size_ &&
+          num_concats_ == 1) {
+        offset_concat_axis += bottom_concat_axis;
+        continue;
+      }
       const int bottom_concat_size = bottom_concat_axis * concat_input_size_;
       const int nthreads = bottom_concat_size * num_concats_;
       Concat<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
@@ -1,11 +1,5 @@
-/*
-TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
-*/
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -15,65 +9,135 @@ TODO:
 #include "stdint.h"
 
 #include "caffe/layers/hdf5_data_layer.hpp"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/hdf5.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
+// The blob of a batch that feeds the i-th top.
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+static Blob<Dtype>* BatchTop(Batch<Dtype>* batch, int i) {
+  if (i == 0) {
+    return &batch->data_;
+  } else if (i == 1) {
+    return &batch->label_;
+  }
+  return batch->extra_[i - 2].get();
+}
+
+template <typename Dtype>
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  this->StopInternalThread();
+  if (file_id_ >= 0) {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    H5Fclose(file_id_);
+  }
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
+void HDF5DataLayer<Dtype>::OpenHDF5File(const char* filename) {
+  DLOG(INFO) << "Opening HDF5 file: " << filename;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  if (file_id_ >= 0) {
+    herr_t status = H5Fclose(file_id_);
+    CHECK_GE(status, 0) << "Failed to close HDF5 file";
+  }
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (file_id_ < 0) {
     LOG(FATAL) << "Failed opening HDF5 file: " << filename;
   }
 
-  int top_size = this->layer_param_.top_size();
+  // Only the shapes are read here; a window holds no rows until loaded.
+  const int top_size = this->layer_param_.top_size();
   hdf_blobs_.resize(top_size);
-
   const int MIN_DATA_DIM = 1;
   const int MAX_DATA_DIM = INT_MAX;
-
   for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+    std::vector<hsize_t> dims = hdf5_get_dataset_dims(file_id_,
+        this->layer_param_.top(i).c_str(), MIN_DATA_DIM, MAX_DATA_DIM);
+    if (i == 0) {
+      file_rows_ = dims[0];
+    } else {
+      CHECK_EQ(dims[0], file_rows_);
+    }
+    vector<int> shape(dims.begin(), dims.end());
+    shape[0] = 0;
+    if (!hdf_blobs_[i]) {
+      hdf_blobs_[i].reset(new Blob<Dtype>());
+    }
+    hdf_blobs_[i]->Reshape(shape);
   }
+  CHECK_GT(file_rows_, 0) << "No data in HDF5 file: " << filename;
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
+  window_starts_.clear();
+  for (hsize_t row = 0; row < file_rows_; row += window_size_) {
+    window_starts_.push_back(row);
+  }
+  if (this->layer_param_.hdf5_data_param().shuffle()) {
+    shuffle(window_starts_.begin(), window_starts_.end());
+  }
+  current_window_ = 0;
+  current_row_ = 0;
+}
 
-  // MinTopBlobs==1 guarantees at least one top blob
-  CHECK_GE(hdf_blobs_[0]->num_axes(), 1) << "Input must have at least 1 axis.";
-  const int num = hdf_blobs_[0]->shape(0);
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->shape(0), num);
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::LoadHDF5Window() {
+  const bool do_shuffle = this->layer_param_.hdf5_data_param().shuffle();
+  if (current_window_ == window_starts_.size()) {
+    if (num_files_ > 1) {
+      ++current_file_;
+      if (current_file_ == num_files_) {
+        current_file_ = 0;
+        if (do_shuffle) {
+          shuffle(file_permutation_.begin(), file_permutation_.end());
+        }
+        DLOG(INFO) << "Looping around to first file.";
+      }
+      OpenHDF5File(hdf_filenames_[file_permutation_[current_file_]].c_str());
+    } else {
+      current_window_ = 0;
+      if (do_shuffle) {
+        shuffle(window_starts_.begin(), window_starts_.end());
+      }
+    }
+  }
+  const hsize_t start = window_starts_[current_window_++];
+  const hsize_t rows = std::min(window_size_, file_rows_ - start);
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  for (int i = 0; i < hdf_blobs_.size(); ++i) {
+    vector<int> shape = hdf_blobs_[i]->shape();
+    shape[0] = rows;
+    hdf_blobs_[i]->Reshape(shape);
+    CHECK_EQ(hdf_blobs_[i]->count(1),
+        BatchTop(&this->prefetch_[0], i)->count(1))
+        << "Rows of " << this->layer_param_.top(i) << " change shape";
+    hdf5_load_nd_dataset_rows(file_id_, this->layer_param_.top(i).c_str(),
+        start, rows, hdf_blobs_[i]->mutable_cpu_data());
   }
   // Default to identity permutation.
-  data_permutation_.clear();
-  data_permutation_.resize(hdf_blobs_[0]->shape(0));
-  for (int i = 0; i < hdf_blobs_[0]->shape(0); i++)
+  data_permutation_.resize(rows);
+  for (int i = 0; i < rows; ++i) {
     data_permutation_[i] = i;
-
-  // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0)
-               << " rows (shuffled)";
-  } else {
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0) << " rows";
   }
+  if (do_shuffle) {
+    shuffle(data_permutation_.begin(), data_permutation_.end());
+  }
+  current_row_ = 0;
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+void HDF5DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
       this->type() << " does not transform data.";
+  // On a repeated SetUp, stop prefetching and restart from the first file.
+  this->StopInternalThread();
+  Batch<Dtype>* batch;
+  while (this->prefetch_full_.try_pop(&batch)) {
+    this->prefetch_free_.push(batch);
+  }
   // Read the source to parse the filenames.
   const string& source = this->layer_param_.hdf5_data_param().source();
   LOG(INFO) << "Loading list of HDF5 filenames from: " << source;
@@ -102,64 +166,57 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   }
 
   // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(file_permutation_.begin(), file_permutation_.end());
+  const HDF5DataParameter& param = this->layer_param_.hdf5_data_param();
+  if (param.shuffle()) {
+    shuffle(file_permutation_.begin(), file_permutation_.end());
   }
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[file_permutation_[current_file_]].c_str());
-  current_row_ = 0;
+  // Open the first HDF5 file; its rows are read by the prefetch thread.
+  const int batch_size = param.batch_size();
+  window_size_ = param.shuffle() ? param.shuffle_window() : batch_size;
+  CHECK_GT(window_size_, 0);
+  OpenHDF5File(hdf_filenames_[file_permutation_[current_file_]].c_str());
 
   // Reshape blobs.
-  const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
   const int top_size = this->layer_param_.top_size();
-  vector<int> top_shape;
+  for (int j = 0; j < this->PREFETCH_COUNT; ++j) {
+    while (this->prefetch_[j].extra_.size() < std::max(top_size - 2, 0)) {
+      this->prefetch_[j].extra_.push_back(
+          shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    }
+  }
   for (int i = 0; i < top_size; ++i) {
-    top_shape.resize(hdf_blobs_[i]->num_axes());
+    vector<int> top_shape = hdf_blobs_[i]->shape();
     top_shape[0] = batch_size;
-    for (int j = 1; j < top_shape.size(); ++j) {
-      top_shape[j] = hdf_blobs_[i]->shape(j);
-    }
     top[i]->Reshape(top_shape);
+    for (int j = 0; j < this->PREFETCH_COUNT; ++j) {
+      BatchTop(&this->prefetch_[j], i)->Reshape(top_shape);
+    }
   }
 }
 
+// This function is called on prefetch thread
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+  CPUTimer batch_timer;
+  batch_timer.Start();
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
   for (int i = 0; i < batch_size; ++i, ++current_row_) {
     if (current_row_ == hdf_blobs_[0]->shape(0)) {
-      if (num_files_ > 1) {
-        ++current_file_;
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          if (this->layer_param_.hdf5_data_param().shuffle()) {
-            std::random_shuffle(file_permutation_.begin(),
-                                file_permutation_.end());
-          }
-          DLOG(INFO) << "Looping around to first file.";
-        }
-        LoadHDF5FileData(
-            hdf_filenames_[file_permutation_[current_file_]].c_str());
-      }
-      current_row_ = 0;
-      if (this->layer_param_.hdf5_data_param().shuffle())
-        std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
+      LoadHDF5Window();
     }
     for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->shape(0);
+      Blob<Dtype>* top = BatchTop(batch, j);
+      int data_dim = top->count() / top->shape(0);
       caffe_copy(data_dim,
           &hdf_blobs_[j]->cpu_data()[data_permutation_[current_row_]
-            * data_dim], &top[j]->mutable_cpu_data()[i * data_dim]);
+            * data_dim], &top->mutable_cpu_data()[i * data_dim]);
     }
   }
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
 }
 
-#ifdef CPU_ONLY
-STUB_GPU_FORWARD(HDF5DataLayer, Forward);
-#endif
-
 INSTANTIATE_CLASS(HDF5DataLayer);
 REGISTER_LAYER_CLASS(HDF5Data);
 
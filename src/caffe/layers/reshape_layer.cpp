@@ -86,10 +86,10 @@ void ReshapeLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   top[0]->Reshape(top_shape);
   CHECK_EQ(top[0]->count(), bottom[0]->count())
       << "output count must match input count";
-  /* GeePS does not allow intermediate blobs to share data,
-   * so we add the forward/backward methods to copy the data and diff */
-  // top[0]->ShareData(*bottom[0]);
-  // top[0]->ShareDiff(*bottom[0]);
+  /* The solver accesses a shared blob through the blob it shares, so the
+   * top can be a view of the bottom */
+  top[0]->ShareData(*bottom[0]);
+  top[0]->ShareDiff(*bottom[0]);
 }
 
 INSTANTIATE_CLASS(ReshapeLayer);
@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <cfloat>
+#include <cmath>
 #include <vector>
 
 #include "caffe/layers/softmax_loss_layer.hpp"
@@ -91,23 +92,46 @@ Dtype SoftmaxWithLossLayer<Dtype>::get_normalizer(
 template <typename Dtype>
 void SoftmaxWithLossLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // The forward pass computes the softmax prob values.
-  softmax_layer_->Forward(softmax_bottom_vec_, softmax_top_vec_);
-  const Dtype* prob_data = prob_.cpu_data();
+  // The CPU path fuses the softmax with the loss instead of running the
+  // internal SoftmaxLayer. Each (i, j) column takes three branch-free sweeps
+  // that the compiler can vectorize: the max, the exponentials (stored in
+  // prob) with their sum, and the normalization, which also picks up the
+  // loss of the labeled class.
+  const Dtype* bottom_data = bottom[0]->cpu_data();
   const Dtype* label = bottom[1]->cpu_data();
-  int dim = prob_.count() / outer_num_;
+  Dtype* prob_data = prob_.mutable_cpu_data();
+  const int channels = bottom[0]->shape(softmax_axis_);
+  const int dim = prob_.count() / outer_num_;
   int count = 0;
   Dtype loss = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for reduction(+: loss, count)
+#endif
   for (int i = 0; i < outer_num_; ++i) {
     for (int j = 0; j < inner_num_; j++) {
+      const Dtype* x = bottom_data + i * dim + j;
+      Dtype* prob = prob_data + i * dim + j;
+      Dtype max_val = x[0];
+      for (int c = 1; c < channels; ++c) {
+        max_val = std::max(max_val, x[c * inner_num_]);
+      }
+      Dtype sum = 0;
+      for (int c = 0; c < channels; ++c) {
+        const Dtype e = std::exp(x[c * inner_num_] - max_val);
+        prob[c * inner_num_] = e;
+        sum += e;
+      }
+      const Dtype scale = Dtype(1) / sum;
+      for (int c = 0; c < channels; ++c) {
+        prob[c * inner_num_] *= scale;
+      }
       const int label_value = static_cast<int>(label[i * inner_num_ + j]);
       if (has_ignore_label_ && label_value == ignore_label_) {
         continue;
       }
       DCHECK_GE(label_value, 0);
-      DCHECK_LT(label_value, prob_.shape(softmax_axis_));
-      loss -= log(std::max(prob_data[i * dim + label_value * inner_num_ + j],
-                           Dtype(FLT_MIN)));
+      DCHECK_LT(label_value, channels);
+      loss -= log(std::max(prob[label_value * inner_num_], Dtype(FLT_MIN)));
       ++count;
     }
   }
@@ -127,27 +151,41 @@ void SoftmaxWithLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   if (propagate_down[0]) {
     Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
     const Dtype* prob_data = prob_.cpu_data();
-    caffe_copy(prob_.count(), prob_data, bottom_diff);
     const Dtype* label = bottom[1]->cpu_data();
-    int dim = prob_.count() / outer_num_;
-    int count = 0;
+    const int channels = bottom[0]->shape(softmax_axis_);
+    const int dim = prob_.count() / outer_num_;
+    // The normalizer only depends on the labels, so count the valid ones
+    // first and then write the scaled (prob - one-hot) gradient in one pass.
+    int count = outer_num_ * inner_num_;
+    if (has_ignore_label_) {
+      for (int i = 0; i < outer_num_ * inner_num_; ++i) {
+        if (static_cast<int>(label[i]) == ignore_label_) {
+          --count;
+        }
+      }
+    }
+    const Dtype loss_weight = top[0]->cpu_diff()[0] /
+                              get_normalizer(normalization_, count);
+#ifdef USE_OPENMP
+#pragma omp parallel for
+#endif
     for (int i = 0; i < outer_num_; ++i) {
       for (int j = 0; j < inner_num_; ++j) {
+        const Dtype* prob = prob_data + i * dim + j;
+        Dtype* diff = bottom_diff + i * dim + j;
         const int label_value = static_cast<int>(label[i * inner_num_ + j]);
         if (has_ignore_label_ && label_value == ignore_label_) {
-          for (int c = 0; c < bottom[0]->shape(softmax_axis_); ++c) {
-            bottom_diff[i * dim + c * inner_num_ + j] = 0;
+          for (int c = 0; c < channels; ++c) {
+            diff[c * inner_num_] = 0;
           }
         } else {
-          bottom_diff[i * dim + label_value * inner_num_ + j] -= 1;
-          ++count;
+          for (int c = 0; c < channels; ++c) {
+            diff[c * inner_num_] = loss_weight * prob[c * inner_num_];
+          }
+          diff[label_value * inner_num_] -= loss_weight;
         }
       }
     }
-    // Scale gradient
-    Dtype loss_weight = top[0]->cpu_diff()[0] /
-                        get_normalizer(normalization_, count);
-    caffe_scal(prob_.count(), loss_weight, bottom_diff);
   }
 }
 
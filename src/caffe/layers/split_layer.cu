@@ -5,16 +5,6 @@
 
 namespace caffe {
 
-template <typename Dtype>
-void SplitLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
-  for (int i = 0; i < top.size(); ++i) {
-    /* Cui: copy instead of share, because the bottom data could be released */
-    caffe_copy(count_, bottom[0]->gpu_data(), top[i]->mutable_gpu_data());
-    // top[i]->ShareData(*bottom[0]);
-  }
-}
-
 template <typename Dtype>
 void SplitLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
@@ -34,6 +24,6 @@ void SplitLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
 }
 
 
-INSTANTIATE_LAYER_GPU_FUNCS(SplitLayer);
+INSTANTIATE_LAYER_GPU_BACKWARD(SplitLayer);
 
 }  // namespace caffe
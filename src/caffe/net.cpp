@@ -1,4 +1,6 @@
+#include <boost/thread.hpp>
 #include <algorithm>
+#include <fstream>
 #include <map>
 #include <set>
 #include <string>
@@ -6,6 +8,9 @@
 #include <vector>
 
 #include "hdf5.h"
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
 
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
@@ -67,6 +72,10 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
         << "Exactly one input_shape must be specified per input.";
   }
   memory_used_ = 0;
+  branch_threads_ = 1;
+  record_timeline_ = false;
+  timeline_.clear();
+  timeline_start_ = boost::posix_time::microsec_clock::local_time();
   // set the input blobs
   for (int input_id = 0; input_id < param.input_size(); ++input_id) {
     const int layer_id = -1;  // inputs have fake layer ID -1
@@ -292,6 +301,8 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     layer_names_index_[layer_names_[layer_id]] = layer_id;
   }
   ShareWeights();
+  PlanBlobSlices();
+  FindLayerDeps();
   debug_info_ = param.debug_info();
   LOG_IF(INFO, Caffe::root_solver()) << "Network initialization done.";
 }
@@ -589,9 +600,22 @@ Dtype Net<Dtype>::ForwardFromTo(int start, int end) {
       InputDebugInfo(i);
     }
   }
+  if (branch_threads_ > 1 && !debug_info_ && Caffe::mode() == Caffe::CPU) {
+    vector<int> layer_ids;
+    for (int i = start; i <= end; ++i) {
+      layer_ids.push_back(i);
+    }
+    vector<Dtype> losses(layers_.size(), 0);
+    RunBranches(layer_ids, false, &losses);
+    // Sum in index order, as the serial pass does
+    for (int i = start; i <= end; ++i) {
+      loss += losses[i];
+    }
+    return loss;
+  }
   for (int i = start; i <= end; ++i) {
     // LOG(ERROR) << "Forwarding " << layer_names_[i];
-    Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
+    Dtype layer_loss = RunLayer(i, false);
     loss += layer_loss;
     if (debug_info_) { ForwardDebugInfo(i); }
   }
@@ -654,15 +678,236 @@ template <typename Dtype>
 void Net<Dtype>::BackwardFromTo(int start, int end) {
   CHECK_GE(end, 0);
   CHECK_LT(start, layers_.size());
+  if (branch_threads_ > 1 && !debug_info_ && Caffe::mode() == Caffe::CPU) {
+    vector<int> layer_ids;
+    for (int i = start; i >= end; --i) {
+      if (layer_need_backward_[i]) {
+        layer_ids.push_back(i);
+      }
+    }
+    RunBranches(layer_ids, true, NULL);
+    return;
+  }
   for (int i = start; i >= end; --i) {
     if (layer_need_backward_[i]) {
-      layers_[i]->Backward(
-          top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
+      RunLayer(i, true);
       if (debug_info_) { BackwardDebugInfo(i); }
     }
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::set_branch_threads(int num_threads) {
+  CHECK_GE(num_threads, 1);
+#ifndef USE_OPENMP
+  LOG_IF(WARNING, num_threads > 1)
+      << "Built without USE_OPENMP, layers will run one by one";
+  num_threads = 1;
+#endif
+  branch_threads_ = num_threads;
+}
+
+// Whether a layer that reads and writes the first two sets of memory must
+// run in order with one that reads and writes the other two.
+static bool MemoryConflict(const set<const SyncedMemory*>& reads_a,
+    const set<const SyncedMemory*>& writes_a,
+    const set<const SyncedMemory*>& reads_b,
+    const set<const SyncedMemory*>& writes_b) {
+  for (set<const SyncedMemory*>::const_iterator it = writes_a.begin();
+       it != writes_a.end(); ++it) {
+    if (reads_b.count(*it) || writes_b.count(*it)) { return true; }
+  }
+  for (set<const SyncedMemory*>::const_iterator it = reads_a.begin();
+       it != reads_a.end(); ++it) {
+    if (writes_b.count(*it)) { return true; }
+  }
+  return false;
+}
+
+template <typename Dtype>
+void Net<Dtype>::FindLayerDeps() {
+  // The memory each layer reads and writes in each pass, found through the
+  // memory objects, so that blobs sharing memory (views, shared weights)
+  // are ordered too. Tops are written whole in the forward pass, and the
+  // parameters are taken as written too, as some layers (BatchNorm) update
+  // them there.
+  const int num_layers = layers_.size();
+  vector<set<const SyncedMemory*> > fw_reads(num_layers);
+  vector<set<const SyncedMemory*> > fw_writes(num_layers);
+  vector<set<const SyncedMemory*> > bw_reads(num_layers);
+  vector<set<const SyncedMemory*> > bw_writes(num_layers);
+  for (int i = 0; i < num_layers; ++i) {
+    for (int j = 0; j < bottom_vecs_[i].size(); ++j) {
+      const Blob<Dtype>& bottom = *bottom_vecs_[i][j];
+      if (!bottom.count()) { continue; }
+      fw_reads[i].insert(bottom.data().get());
+      bw_reads[i].insert(bottom.data().get());
+      bw_writes[i].insert(bottom.diff().get());
+    }
+    for (int j = 0; j < top_vecs_[i].size(); ++j) {
+      const Blob<Dtype>& top = *top_vecs_[i][j];
+      if (!top.count()) { continue; }
+      fw_writes[i].insert(top.data().get());
+      fw_writes[i].insert(top.diff().get());
+      bw_reads[i].insert(top.data().get());
+      bw_reads[i].insert(top.diff().get());
+    }
+    for (int j = 0; j < layers_[i]->blobs().size(); ++j) {
+      const Blob<Dtype>& param = *layers_[i]->blobs()[j];
+      fw_writes[i].insert(param.data().get());
+      bw_reads[i].insert(param.data().get());
+      bw_writes[i].insert(param.diff().get());
+    }
+  }
+  forward_deps_.assign(num_layers, vector<int>());
+  backward_deps_.assign(num_layers, vector<int>());
+  for (int i = 0; i < num_layers; ++i) {
+    for (int j = i + 1; j < num_layers; ++j) {
+      if (MemoryConflict(fw_reads[i], fw_writes[i],
+                         fw_reads[j], fw_writes[j])) {
+        forward_deps_[j].push_back(i);
+      }
+      if (MemoryConflict(bw_reads[j], bw_writes[j],
+                         bw_reads[i], bw_writes[i])) {
+        backward_deps_[i].push_back(j);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+Dtype Net<Dtype>::RunLayer(int layer_id, bool backward) {
+  boost::posix_time::ptime start;
+  if (record_timeline_) {
+    start = boost::posix_time::microsec_clock::local_time();
+  }
+  Dtype loss = 0;
+  if (backward) {
+    layers_[layer_id]->Backward(top_vecs_[layer_id],
+        bottom_need_backward_[layer_id], bottom_vecs_[layer_id]);
+  } else {
+    loss = layers_[layer_id]->Forward(bottom_vecs_[layer_id],
+        top_vecs_[layer_id]);
+  }
+  if (record_timeline_) {
+    LayerRun run;
+    run.layer_id = layer_id;
+    run.backward = backward;
+#ifdef USE_OPENMP
+    run.thread = omp_get_thread_num();
+#else
+    run.thread = 0;
+#endif
+    run.start_us = (start - timeline_start_).total_microseconds();
+    run.end_us = (boost::posix_time::microsec_clock::local_time()
+        - timeline_start_).total_microseconds();
+#ifdef USE_OPENMP
+#pragma omp critical(net_timeline)
+#endif
+    timeline_.push_back(run);
+  }
+  return loss;
+}
+
+template <typename Dtype>
+void Net<Dtype>::RunBranches(const vector<int>& layer_ids, bool backward,
+    vector<Dtype>* losses) {
+#ifdef USE_OPENMP
+  const vector<vector<int> >& deps = backward ? backward_deps_ : forward_deps_;
+  vector<bool> in_pass(layers_.size(), false);
+  for (int i = 0; i < layer_ids.size(); ++i) {
+    in_pass[layer_ids[i]] = true;
+  }
+  // The number of layers each layer still waits for, and the layers
+  // waiting for it
+  vector<int> pending(layers_.size(), 0);
+  vector<vector<int> > dependents(layers_.size());
+  vector<int> ready;
+  for (int i = 0; i < layer_ids.size(); ++i) {
+    const int layer_id = layer_ids[i];
+    for (int j = 0; j < deps[layer_id].size(); ++j) {
+      if (in_pass[deps[layer_id][j]]) {
+        dependents[deps[layer_id][j]].push_back(layer_id);
+        ++pending[layer_id];
+      }
+    }
+    if (!pending[layer_id]) {
+      ready.push_back(layer_id);
+    }
+  }
+  // Caffe::Get() is per thread, so the branch threads get the settings of
+  // this one, and every layer a generator of its own
+  branch_mode_ = Caffe::mode();
+  branch_solver_count_ = Caffe::solver_count();
+  branch_root_solver_ = Caffe::root_solver();
+  branch_seeds_.resize(layers_.size());
+  for (int i = 0; i < layer_ids.size(); ++i) {
+    branch_seeds_[layer_ids[i]] = caffe_rng_rand();
+  }
+#pragma omp parallel num_threads(branch_threads_)
+#pragma omp single
+  for (int i = 0; i < ready.size(); ++i) {
+    const int layer_id = ready[i];
+#pragma omp task
+    RunLayerTask(layer_id, backward, &pending, &dependents, losses);
+  }
+#else
+  NOT_IMPLEMENTED;
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::RunLayerTask(int layer_id, bool backward,
+    vector<int>* pending, const vector<vector<int> >* dependents,
+    vector<Dtype>* losses) {
+#ifdef USE_OPENMP
+  // See the outputs of the layers this one waited for
+#pragma omp flush
+  Caffe::InitCpuWorker(branch_mode_, branch_solver_count_,
+      branch_root_solver_);
+  shared_ptr<Caffe::RNG> rng(new Caffe::RNG(branch_seeds_[layer_id]));
+  Caffe::SwapRngStream(&rng);
+  const Dtype loss = RunLayer(layer_id, backward);
+  Caffe::SwapRngStream(&rng);
+  if (losses) {
+    (*losses)[layer_id] = loss;
+  }
+  // Publish the outputs of this layer before releasing its dependents
+#pragma omp flush
+  const vector<int>& next = (*dependents)[layer_id];
+  for (int i = 0; i < next.size(); ++i) {
+    const int next_id = next[i];
+    int left;
+#pragma omp atomic capture
+    left = --(*pending)[next_id];
+    if (!left) {
+#pragma omp task
+      RunLayerTask(next_id, backward, pending, dependents, losses);
+    }
+  }
+#else
+  NOT_IMPLEMENTED;
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::WriteTimeline(const string& filename) {
+  std::ofstream out(filename.c_str());
+  CHECK(out) << "Failed to open timeline file " << filename;
+  out << "[\n";
+  for (int i = 0; i < timeline_.size(); ++i) {
+    const LayerRun& run = timeline_[i];
+    out << "{\"name\": \"" << layer_names_[run.layer_id]
+        << "\", \"cat\": \"" << (run.backward ? "backward" : "forward")
+        << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << run.thread
+        << ", \"ts\": " << run.start_us
+        << ", \"dur\": " << run.end_us - run.start_us << "}"
+        << (i + 1 < timeline_.size() ? ",\n" : "\n");
+  }
+  out << "]\n";
+  timeline_.clear();
+}
+
 template <typename Dtype>
 void Net<Dtype>::InputDebugInfo(const int input_id) {
   const Blob<Dtype>& blob = *net_input_blobs_[input_id];
@@ -878,6 +1123,7 @@ void Net<Dtype>::CopyTrainedLayersFromBinaryProto(
 
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFromHDF5(const string trained_filename) {
+  boost::mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fopen(trained_filename.c_str(), H5F_ACC_RDONLY,
                            H5P_DEFAULT);
   CHECK_GE(file_hid, 0) << "Couldn't open " << trained_filename;
@@ -944,6 +1190,7 @@ void Net<Dtype>::ToProto(
 
 template <typename Dtype>
 void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
+  boost::mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
       H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
@@ -1027,6 +1274,79 @@ void Net<Dtype>::ClearParamDiffs() {
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::PlanBlobSlices() {
+  blob_slices_.clear();
+  // A bottom can only move into the top if no other layer reads it and it
+  // shares its memory with no other blob. Layers that work on it in place
+  // are part of its producer, as long as they run before the Concat.
+  vector<int> num_readers(blobs_.size(), 0);
+  vector<int> last_in_place(blobs_.size(), -1);
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    const vector<int>& top_ids = top_id_vecs_[layer_id];
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = bottom_id_vecs_[layer_id][i];
+      if (std::find(top_ids.begin(), top_ids.end(), blob_id) !=
+          top_ids.end()) {
+        last_in_place[blob_id] = layer_id;
+      } else {
+        ++num_readers[blob_id];
+      }
+    }
+  }
+  map<const SyncedMemory*, int> data_users;
+  map<const SyncedMemory*, int> diff_users;
+  for (int blob_id = 0; blob_id < blobs_.size(); ++blob_id) {
+    if (blobs_[blob_id]->count()) {
+      ++data_users[blobs_[blob_id]->data().get()];
+      ++diff_users[blobs_[blob_id]->diff().get()];
+    }
+  }
+  const set<int> net_inputs(net_input_blob_indices_.begin(),
+      net_input_blob_indices_.end());
+  size_t bytes_saved = 0;
+  int copies_saved = 0;
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    if (layer_types_[layer_id] != "Concat" ||
+        bottom_id_vecs_[layer_id].size() < 2) {
+      continue;
+    }
+    const ConcatParameter& concat_param =
+        layers_[layer_id]->layer_param().concat_param();
+    const Blob<Dtype>& top = *top_vecs_[layer_id][0];
+    const int concat_axis = concat_param.has_concat_dim() ?
+        static_cast<int>(concat_param.concat_dim()) :
+        top.CanonicalAxisIndex(concat_param.axis());
+    if (top.count(0, concat_axis) != 1) {
+      // The bottoms would be strided slices of the top, which a Blob
+      // cannot express.
+      continue;
+    }
+    const int top_id = top_id_vecs_[layer_id][0];
+    int offset = 0;
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = bottom_id_vecs_[layer_id][i];
+      const Blob<Dtype>& blob = *blobs_[blob_id];
+      const bool own = num_readers[blob_id] == 1 &&
+          last_in_place[blob_id] < layer_id && blob.count();
+      const bool data = own && !net_inputs.count(blob_id) &&
+          data_users[blob.data().get()] == 1;
+      const bool diff = own && bottom_need_backward_[layer_id][i] &&
+          diff_users[blob.diff().get()] == 1;
+      if (data || diff) {
+        blob_slices_.push_back(
+            BlobSlice(blob_id, top_id, offset, data, diff));
+        bytes_saved += (data + diff) * blob.count() * sizeof(Dtype);
+        copies_saved += data + diff;
+      }
+      offset += blob.count();
+    }
+  }
+  LOG_IF(INFO, Caffe::root_solver() && blob_slices_.size())
+      << "Concat bottoms placed in their tops can save " << copies_saved
+      << " copies per iteration and " << bytes_saved << " bytes of buffers";
+}
+
 template <typename Dtype>
 void Net<Dtype>::ShareWeights() {
   for (int i = 0; i < params_.size(); ++i) {
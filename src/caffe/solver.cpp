@@ -1,10 +1,14 @@
 #include <cstdio>
 
 #include <algorithm>
+#include <fstream>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
 #include <boost/format.hpp>
 
 #include <tbb/tick_count.h>
@@ -12,6 +16,7 @@
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
+#include "caffe/util/gradient_compression.hpp"
 #include "caffe/util/hdf5.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
@@ -26,6 +31,16 @@ using boost::make_shared;
 
 namespace caffe {
 
+/* The number of state blobs that a solver type keeps in history_ for each
+ * parameter, see the PreSolve functions of the solvers. All of them are
+ * stored in the PS local store. */
+static int SolverHistorySlots(const string& solver_type) {
+  if (solver_type == "Adam" || solver_type == "AdaDelta") {
+    return 2;
+  }
+  return 1;
+}
+
 template<typename Dtype>
 void Solver<Dtype>::SetActionFunction(ActionCallback func) {
   action_request_function_ = func;
@@ -63,6 +78,13 @@ Solver<Dtype>::Solver(const string& param_file, const Solver* root_solver)
   Init(param);
 }
 
+template <typename Dtype>
+Solver<Dtype>::~Solver() {
+  if (counter_stream_) {
+    CUDA_CHECK(cudaStreamDestroy(counter_stream_));
+  }
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Init(const SolverParameter& param) {
   LOG(INFO) << "Initializing solver from parameters: " << std::endl
@@ -78,6 +100,22 @@ void Solver<Dtype>::Init(const SolverParameter& param) {
   LOG(INFO) << "Solver scaffolding done.";
   iter_ = 0;
   current_step_ = 0;
+  num_history_slots_ = SolverHistorySlots(param_.type());
+  ps_clock_ = 0;
+  num_test_score_vals_ = 0;
+  test_score_report_clock_ = -1;
+  test_score_reading_ = false;
+  test_score_iter_ = 0;
+  test_score_report_iter_ = 0;
+  momentum_scale_ = 1;
+  sample_ps_stats_ = false;
+  StalenessScale(0);  /* Checks the staleness policy */
+  CHECK(ps_config_.sync_mode == "stream" || ps_config_.sync_mode == "events")
+      << "Unknown sync mode: " << ps_config_.sync_mode;
+  stage_timer_.reset(new StreamStageTimer());
+  counter_stream_ = NULL;
+  /* Covers the clocks that the workers can be apart, either way */
+  update_counter_period_ = std::max(64, 4 * (ps_config_.slack + 2));
 
   /* Initialize parameter server */
   InitPs();
@@ -197,6 +235,230 @@ void Solver<Dtype>::InitTestNets() {
   }
 }
 
+/* The forward FLOPs per top value of the layers that are cheap enough to
+ * recompute in the backward pass, or 0 if the layer is not. A layer is
+ * recomputed only if running its forward pass again gives the same top,
+ * so BatchNorm (running statistics) and Dropout (random mask) are not. */
+static float RecomputeFlopsPerValue(const Layer<float>& layer) {
+  const string type = layer.type();
+  if (type == "ReLU" || type == "Sigmoid" || type == "TanH") {
+    return 1;
+  } else if (type == "Eltwise") {
+    return layer.layer_param().bottom_size();
+  } else if (type == "LRN") {
+    return 2 * layer.layer_param().lrn_param().local_size() + 2;
+  } else if (type == "Pooling") {
+    const PoolingParameter& pool_param = layer.layer_param().pooling_param();
+    if (pool_param.global_pooling()) {
+      return 0;
+    }
+    if (pool_param.has_kernel_size()) {
+      return pool_param.kernel_size() * pool_param.kernel_size();
+    }
+    return pool_param.kernel_h() * pool_param.kernel_w();
+  }
+  return 0;
+}
+
+/* A layer whose top may be recomputed, ordered by the FLOPs it costs per
+ * byte it frees, then by the bytes it frees (larger first) */
+struct RecomputeCandidate {
+  int layer_id;
+  size_t freed_bytes;
+  double flops;
+  bool operator<(const RecomputeCandidate& other) const {
+    /* Cross-multiplied, so that empty tops need no division */
+    const double cost = flops * other.freed_bytes;
+    const double other_cost = other.flops * freed_bytes;
+    if (cost != other_cost) {
+      return cost < other_cost;
+    }
+    return freed_bytes > other.freed_bytes;
+  }
+};
+
+/* Finds, for every blob, the first blob that shares its data (and diff)
+ * memory. Reshape and Flatten tops share the data and diff of their
+ * bottom, and Split tops share its data. */
+static void FindSharedBlobs(const vector<shared_ptr<Blob<float> > >& imbs,
+    vector<int>* data_roots, vector<int>* diff_roots) {
+  std::map<const SyncedMemory*, int> data_owners;
+  std::map<const SyncedMemory*, int> diff_owners;
+  data_roots->resize(imbs.size());
+  diff_roots->resize(imbs.size());
+  for (int i = 0; i < imbs.size(); i++) {
+    if (!imbs[i]->count()) {
+      (*data_roots)[i] = i;
+      (*diff_roots)[i] = i;
+      continue;
+    }
+    (*data_roots)[i] = data_owners.insert(
+        std::make_pair(imbs[i]->data().get(), i)).first->second;
+    (*diff_roots)[i] = diff_owners.insert(
+        std::make_pair(imbs[i]->diff().get(), i)).first->second;
+  }
+}
+
+#if defined(LOCAL_DATA_IN_PS)
+/* Points the blobs that live in slices of an intermediate blob to their
+ * slices of its buffer, or detaches them from it if the buffer is NULL */
+static void BindImbSlices(const vector<shared_ptr<Blob<float> > >& imbs,
+    const vector<pair<int, int> >& slices, bool diff, float *buffer) {
+  for (int i = 0; i < slices.size(); i++) {
+    Blob<float>& imb = *imbs[slices[i].first];
+    float *slice = buffer ? buffer + slices[i].second : NULL;
+    if (diff) {
+      if (!buffer) {
+        /* Make sure everything is copied to GPU memory */
+        imb.gpu_diff();
+      }
+      imb.set_gpu_diff(slice, true);
+    } else {
+      if (!buffer) {
+        imb.gpu_data();
+      }
+      imb.set_gpu_data(slice, true);
+    }
+  }
+}
+#endif
+
+/* Marks a blob as used by a layer. A blob used twice by one layer
+ * (in place, or through a view) is fetched or kept if either use
+ * needs it. */
+static void UseBlob(IntSet *imbs_used, int imb_id, FetchKeep fetch_keep) {
+  IntSet::iterator it = imbs_used->find(imb_id);
+  if (it == imbs_used->end()) {
+    (*imbs_used)[imb_id] = fetch_keep;
+  } else {
+    it->second.fetch |= fetch_keep.fetch;
+    it->second.keep |= fetch_keep.keep;
+  }
+}
+
+template <>
+void Solver<float>::PlanRecompute() {
+  /* Instead of keeping the top of a cheap layer from the forward pass to
+   * the backward pass, keep only its bottoms (which its backward pass uses
+   * anyway) and recompute the top before the first backward pass that
+   * uses it. The candidates are taken greedily in increasing order of
+   * recomputed FLOPs per freed byte, and the larger top first among equal
+   * costs. With a recompute_budget (0 for no limit), a candidate that
+   * would exceed the bytes left is skipped and smaller ones after it may
+   * still fit. */
+  if (ps_config_.recompute == "none") {
+    return;
+  }
+  CHECK_EQ(ps_config_.recompute, "cheap")
+      << "Unknown recompute policy: " << ps_config_.recompute;
+#if !defined(LOCAL_DATA_IN_PS)
+  LOG(WARNING) << "Intermediate blobs are not managed by the PS, "
+      << "recompute has no effect";
+  return;
+#endif
+  vector<shared_ptr<Layer<float> > >& layers = this->net_->layers_;
+  vector<string>& layer_names = this->net_->layer_names_;
+  vector<bool>& layer_need_backward = this->net_->layer_need_backward_;
+  vector<vector<int> >& bottom_id_vecs = this->net_->bottom_id_vecs_;
+  vector<vector<int> >& top_id_vecs = this->net_->top_id_vecs_;
+  vector<shared_ptr<Blob<float> > >& imbs = this->net_->blobs_;
+  vector<int>& net_output_blob_indices = this->net_->net_output_blob_indices_;
+  std::set<int> net_outputs(
+      net_output_blob_indices.begin(), net_output_blob_indices.end());
+
+  /* Candidates: single-top, not in-place, deterministic cheap layers,
+   * whose top is used in the backward pass */
+  vector<RecomputeCandidate> candidates;
+  vector<int> recompute_at(layers.size(), -1);
+  for (int layer_id = 0; layer_id < layers.size(); layer_id++) {
+    const float flops_per_value = RecomputeFlopsPerValue(*layers[layer_id]);
+    if (!flops_per_value || top_id_vecs[layer_id].size() != 1) {
+      continue;
+    }
+    const int top_id = top_id_vecs[layer_id][0];
+    vector<int>& bottom_ids = bottom_id_vecs[layer_id];
+    if (net_outputs.count(top_id) || imb_data_roots_[top_id] != top_id ||
+        std::find(bottom_ids.begin(), bottom_ids.end(), top_id)
+            != bottom_ids.end()) {
+      continue;
+    }
+    /* The first backward pass that uses the top */
+    for (int user_id = layers.size() - 1; user_id >= 0; user_id--) {
+      if (layer_need_backward[user_id] &&
+          layer_infos_[user_id].imbs_used_bw.count(top_id)) {
+        recompute_at[layer_id] = user_id;
+        break;
+      }
+    }
+    if (recompute_at[layer_id] < 0) {
+      continue;
+    }
+    RecomputeCandidate candidate;
+    candidate.layer_id = layer_id;
+    candidate.freed_bytes = imbs[top_id]->count() * sizeof(float);
+    candidate.flops =
+        static_cast<double>(flops_per_value) * imbs[top_id]->count();
+    candidates.push_back(candidate);
+  }
+  std::stable_sort(candidates.begin(), candidates.end());
+
+  vector<bool> recomputed_blob(imbs.size(), false);
+  vector<bool> checkpoint_blob(imbs.size(), false);
+  size_t saved_bytes = 0;
+  double extra_flops = 0;
+  for (int i = 0; i < candidates.size(); i++) {
+    const int layer_id = candidates[i].layer_id;
+    const int top_id = top_id_vecs[layer_id][0];
+    const size_t top_bytes = candidates[i].freed_bytes;
+    if (ps_config_.recompute_budget &&
+        saved_bytes + top_bytes > ps_config_.recompute_budget) {
+      continue;
+    }
+    vector<int>& bottom_ids = bottom_id_vecs[layer_id];
+    /* The bottoms are the checkpoints, so they are not recomputed */
+    bool bottom_recomputed = false;
+    for (int j = 0; j < bottom_ids.size(); j++) {
+      bottom_recomputed |= recomputed_blob[imb_data_roots_[bottom_ids[j]]];
+    }
+    /* Nor is a top that is the checkpoint of a chosen layer: that layer
+     * may be recomputed before this one, at an earlier backward pass */
+    if (bottom_recomputed || checkpoint_blob[top_id]) {
+      continue;
+    }
+    recomputed_blob[top_id] = true;
+    for (int j = 0; j < bottom_ids.size(); j++) {
+      checkpoint_blob[imb_data_roots_[bottom_ids[j]]] = true;
+    }
+    /* Do not keep the top after its last forward use. It is still kept
+     * between earlier uses, which need not be adjacent layers. */
+    for (int j = layer_infos_.size() - 1; j >= 0; j--) {
+      IntSet& imbs_used_fw = layer_infos_[j].imbs_used_fw;
+      if (imbs_used_fw.count(top_id)) {
+        imbs_used_fw[top_id].keep = false;
+        break;
+      }
+    }
+    /* Recompute it at its first backward use, from the fetched bottoms */
+    const int user_id = recompute_at[layer_id];
+    LayerInfo& user_info = layer_infos_[user_id];
+    user_info.imbs_used_bw[top_id] = FetchKeep(false, true);
+    for (int j = 0; j < bottom_ids.size(); j++) {
+      UseBlob(&user_info.imbs_used_bw, imb_data_roots_[bottom_ids[j]],
+          FetchKeep(true, false));
+    }
+    user_info.layers_to_recompute.push_back(layer_id);
+    const double flops = candidates[i].flops;
+    saved_bytes += top_bytes;
+    extra_flops += flops;
+    LOG(INFO) << "Recompute layer " << layer_names[layer_id]
+        << " before the backward pass of " << layer_names[user_id]
+        << ": saves " << top_bytes << " bytes for "
+        << flops << " FLOPs per batch";
+  }
+  LOG(INFO) << "Recompute saves " << saved_bytes << " bytes of kept "
+      << "activations for " << extra_flops << " extra FLOPs per batch";
+}
+
 template <>
 void Solver<float>::PrepareAccessInfo() {
   vector<shared_ptr<Layer<float> > >& layers = this->net_->layers_;
@@ -213,6 +475,9 @@ void Solver<float>::PrepareAccessInfo() {
   int row_id = 0;
   int local_store_row_id = 0;
   int global_param_id = 0;
+  vector<CompressionConfig> compression_configs;
+  ParseLayerCompressionConfigs(ps_config_.compression,
+      ps_config_.layer_compression, layer_names, &compression_configs);
 
   /* Decide row keys for model parameters */
   for (int layer_id = 0; layer_id < layers.size(); layer_id++) {
@@ -237,16 +502,40 @@ void Solver<float>::PrepareAccessInfo() {
         layer_info.param_infos[param_id].global_param_id = global_param_id++;
         layer_info.num_vals += param->count();
       }
-      int num_rows = (layer_info.num_vals + ROW_DATA_SIZE - 1) / ROW_DATA_SIZE;
+      /* A PS layer has one more value after its parameters, which counts
+       * the updates applied to it and tells the data clock at reads */
+      int num_ps_vals = layer_info.num_vals + (layer_info.local_param ? 0 : 1);
+      int num_rows = (num_ps_vals + ROW_DATA_SIZE - 1) / ROW_DATA_SIZE;
       for (int i = 0; i < num_rows; i++) {
         if (!layer_info.local_param) {
           layer_info.row_ids.push_back(row_id++);
         } else {
           layer_info.row_ids.push_back(local_store_row_id++);
         }
+      }
+      /* The solver state slots of the layer are stored one after another
+       * in its history rows */
+      layer_info.history_slot_vals = num_rows * ROW_DATA_SIZE;
+      for (int i = 0; i < num_rows * num_history_slots_; i++) {
         layer_info.history_data_row_ids.push_back(local_store_row_id++);
       }
       if (!layer_info.local_param) {
+        /* The residual of a compressed layer's updates is kept in
+         * the local store, next to its updates history */
+        layer_info.compression = compression_configs[layer_id];
+        if (layer_info.compression.method != COMPRESSION_NONE) {
+          for (int i = 0; i < num_rows; i++) {
+            layer_info.residual_row_ids.push_back(local_store_row_id++);
+          }
+        }
+        /* The gradients of all but the last batch of a clock are summed
+         * in the local store, and sent with the last batch */
+        if (ps_config_.accumulate_gradients &&
+            ps_config_.batches_per_clock > 1) {
+          for (int i = 0; i < num_rows; i++) {
+            layer_info.accum_row_ids.push_back(local_store_row_id++);
+          }
+        }
         layer_info.table_id = table_id;
         layer_count++;
         if (ps_config_.multi_table &&
@@ -268,17 +557,86 @@ void Solver<float>::PrepareAccessInfo() {
     layer_info.test_time = 0;
     layer_info.snapshot_model_time = 0;
     layer_info.snapshot_solverstate_time = 0;
+    layer_info.compression_ratio = 0;
+    layer_info.residual_norm = 0;
+    layer_info.num_compressed_updates = 0;
+    layer_info.fw_staleness = 0;
+    layer_info.bw_staleness = 0;
   }
   CHECK_EQ(total_num_params, params.size());
   num_tables_ = row_id == 0 ? table_id : table_id + 1;
+  if (ps_config_.table_partition == "bytes") {
+    BalanceTables();
+  } else {
+    CHECK_EQ(ps_config_.table_partition, "layers")
+        << "Unknown table partition: " << ps_config_.table_partition;
+  }
 
-  /* Decide row keys for intermediate data blobs */
+  /* Decide row keys for the test scores. For each test net, the table has
+   * the number of batches, the loss, and the sum of every output value. */
+  if (ps_config_.distributed_test) {
+    num_test_score_vals_ = 0;
+    for (int i = 0; i < test_nets_.size(); i++) {
+      test_score_offsets_.push_back(num_test_score_vals_);
+      num_test_score_vals_ += 2;
+      const vector<Blob<float>*>& outputs = test_nets_[i]->output_blobs();
+      for (int j = 0; j < outputs.size(); j++) {
+        num_test_score_vals_ += outputs[j]->count();
+      }
+    }
+    int num_rows = (num_test_score_vals_ + ROW_DATA_SIZE - 1) / ROW_DATA_SIZE;
+    for (int i = 0; i < num_rows; i++) {
+      test_score_row_ids_.push_back(i);
+    }
+    test_score_table_id_ = num_tables_++;
+    test_score_reported_.assign(num_test_score_vals_, 0);
+  }
+
+  /* A blob that shares the memory of another one is a view of it.
+   * It has no rows of its own, and is accessed and released through the
+   * blob it views, which stays in memory while any of its views is used,
+   * so a layer that only makes views costs nothing. */
   vector<shared_ptr<Blob<float> > >& imbs = this->net_->blobs_;
+  FindSharedBlobs(imbs, &imb_data_roots_, &imb_diff_roots_);
+  /* So is a Concat bottom that lives in a slice of the top, which is
+   * bound to its slice of the top's buffer. The later slices are resolved
+   * first, as the top of a Concat can be a slice of a later one. */
+  const vector<BlobSlice>& blob_slices = this->net_->blob_slices();
+  vector<int> data_offsets(imbs.size(), 0);
+  vector<int> diff_offsets(imbs.size(), 0);
+  for (int i = blob_slices.size() - 1; i >= 0; i--) {
+    const BlobSlice& slice = blob_slices[i];
+    if (slice.data) {
+      imb_data_roots_[slice.blob_id] = imb_data_roots_[slice.base_id];
+      data_offsets[slice.blob_id] = data_offsets[slice.base_id] + slice.offset;
+    }
+    if (slice.diff) {
+      imb_diff_roots_[slice.blob_id] = imb_diff_roots_[slice.base_id];
+      diff_offsets[slice.blob_id] = diff_offsets[slice.base_id] + slice.offset;
+    }
+  }
+  imb_data_slices_.assign(imbs.size(), vector<pair<int, int> >());
+  imb_diff_slices_.assign(imbs.size(), vector<pair<int, int> >());
+  for (int i = 0; i < blob_slices.size(); i++) {
+    const int blob_id = blob_slices[i].blob_id;
+    if (blob_slices[i].data) {
+      imb_data_slices_[imb_data_roots_[blob_id]].push_back(
+          make_pair(blob_id, data_offsets[blob_id]));
+    }
+    if (blob_slices[i].diff) {
+      imb_diff_slices_[imb_diff_roots_[blob_id]].push_back(
+          make_pair(blob_id, diff_offsets[blob_id]));
+    }
+  }
+  /* Decide row keys for intermediate data blobs */
   imb_data_infos_.resize(imbs.size());
   for (int imb_id = 0; imb_id < imbs.size(); imb_id++) {
     RowAccessInfo& imb_info = imb_data_infos_[imb_id];
     imb_info.num_vals = imbs[imb_id]->count();
     int num_rows = (imb_info.num_vals + ROW_DATA_SIZE - 1) / ROW_DATA_SIZE;
+    if (imb_data_roots_[imb_id] != imb_id) {
+      num_rows = 0;
+    }
     for (int i = 0; i < num_rows; i++) {
       imb_info.row_ids.push_back(local_store_row_id++);
     }
@@ -291,6 +649,9 @@ void Solver<float>::PrepareAccessInfo() {
     RowAccessInfo& imb_info = imb_diff_infos_[imb_id];
     imb_info.num_vals = imbs[imb_id]->count();
     int num_rows = (imb_info.num_vals + ROW_DATA_SIZE - 1) / ROW_DATA_SIZE;
+    if (imb_diff_roots_[imb_id] != imb_id) {
+      num_rows = 0;
+    }
     for (int i = 0; i < num_rows; i++) {
       imb_info.row_ids.push_back(local_store_row_id++);
     }
@@ -302,8 +663,14 @@ void Solver<float>::PrepareAccessInfo() {
   vector<int>& net_output_blob_indices = this->net_->net_output_blob_indices_;
   IntSet net_output_set;
   for (int i = 0; i < net_output_blob_indices.size(); i++) {
-    net_output_set[net_output_blob_indices[i]] = FetchKeep();
-  }
+    /* Output blobs, and the blobs they are views of, are not streamed */
+    net_output_set[imb_data_roots_[net_output_blob_indices[i]]] = FetchKeep();
+    net_output_set[imb_diff_roots_[net_output_blob_indices[i]]] = FetchKeep();
+  }
+  /* The top of a Concat is written by every producer of its slices, so
+   * its buffer is fetched by all but the first: the layers that run in
+   * between may have released it */
+  vector<bool> imb_data_written(imbs.size(), false);
   for (int layer_id = 0; layer_id < layers.size(); layer_id++) {
     LayerInfo& layer_info = layer_infos_[layer_id];
     vector<int>& bottom_imb_ids = this->net_->bottom_id_vecs_[layer_id];
@@ -314,42 +681,49 @@ void Solver<float>::PrepareAccessInfo() {
     IntSet& imb_diffs_used_bw = layer_info.imb_diffs_used_bw;
     for (int i = 0; i < bottom_imb_ids.size(); i++) {
       int blob_id = bottom_imb_ids[i];
-      if (net_output_set.count(blob_id)) {
+      int data_id = imb_data_roots_[blob_id];
+      int diff_id = imb_diff_roots_[blob_id];
+      if (net_output_set.count(data_id) || net_output_set.count(diff_id)) {
         LOG(INFO) << "Blob #" << blob_id << " is an output blob";
         /* Do not stream output blobs */
         continue;
       }
       /* In the forward pass, use (fetch, keep) all bottom data blobs */
-      imbs_used_fw[blob_id] = FetchKeep(true, true);
+      UseBlob(&imbs_used_fw, data_id, FetchKeep(true, true));
       /* In the forward pass, use no bottom diff blobs */
       /* In the backward pass, use (fetch, no keep) all bottom data blobs,
        * except for Data layers */
       if (layer_types[layer_id] == "Data") {
         /* Not used */
       } else {
-        imbs_used_bw[blob_id] = FetchKeep(true, false);
+        UseBlob(&imbs_used_bw, data_id, FetchKeep(true, false));
       }
       /* In the backward pass, use (no fetch, keep) all bottom diff blobs,
        * except for Data layers */
       if (layer_types[layer_id] == "Data") {
         /* Not used */
       } else {
-        imb_diffs_used_bw[blob_id] = FetchKeep(false, true);
+        UseBlob(&imb_diffs_used_bw, diff_id, FetchKeep(false, true));
       }
     }
     for (int i = 0; i < top_imb_ids.size(); i++) {
       int blob_id = top_imb_ids[i];
-      if (net_output_set.count(blob_id)) {
+      int data_id = imb_data_roots_[blob_id];
+      int diff_id = imb_diff_roots_[blob_id];
+      if (net_output_set.count(data_id) || net_output_set.count(diff_id)) {
         /* Do not stream output blobs */
         LOG(INFO) << "Blob #" << blob_id << " is an output blob";
         continue;
       }
-      /* In the forward pass, use (no fetch, keep) all top data blobs */
-      imbs_used_fw[blob_id] = FetchKeep(false, true);
+      /* In the forward pass, use (no fetch, keep) all top data blobs,
+       * unless an earlier layer wrote another part of them */
+      UseBlob(&imbs_used_fw, data_id,
+          FetchKeep(imb_data_written[data_id], true));
+      imb_data_written[data_id] = true;
       /* In the forward pass, use (no fetch, keep) the top diff blobs
        * only in loss layers */
       if (layer_types[layer_id] == "SoftmaxWithLoss") {
-        imb_diffs_used_fw[blob_id] = FetchKeep(false, true);
+        UseBlob(&imb_diffs_used_fw, diff_id, FetchKeep(false, true));
       }
       /* In the backward pass, use (fetch, no keep) the top data blobs
        * only in ReLU, LRN, Pooling, BatchNorm, Dropout,
@@ -361,7 +735,7 @@ void Solver<float>::PrepareAccessInfo() {
           layer_types[layer_id] == "Eltwise" ||
           layer_types[layer_id] == "Dropout" ||
           layer_types[layer_id] == "SoftmaxWithLoss") {
-        imbs_used_bw[blob_id] = FetchKeep(true, false);
+        UseBlob(&imbs_used_bw, data_id, FetchKeep(true, false));
       }
       /* In the backward pass, use (fetch, no keep) all top diff blobs,
        * except for Data layers, top[1] of LRN, Pooling layers, BatchNorm,
@@ -373,11 +747,13 @@ void Solver<float>::PrepareAccessInfo() {
           (layer_types[layer_id] == "Dropout" && i > 0)) {
         /* Do not use */
       } else {
-        imb_diffs_used_bw[blob_id] = FetchKeep(true, false);
+        UseBlob(&imb_diffs_used_bw, diff_id, FetchKeep(true, false));
       }
     }
   }
 
+  PlanRecompute();
+
   /* Decide imbs to accesss/release in forward pass */
   IntSet empty_set;
   for (int layer_id = 0; layer_id < layers.size(); layer_id++) {
@@ -474,6 +850,20 @@ void Solver<float>::PrepareAccessInfo() {
       }
     }
   }
+  /* The test pass runs the forward pass only, with the same accesses,
+   * and then releases the blobs that training keeps for the backward pass */
+  test_imbs_to_release_.clear();
+  test_imb_diffs_to_release_.clear();
+  for (int imb_id = 0; imb_id < imb_data_infos_.size(); imb_id++) {
+    if (imb_data_infos_[imb_id].data_in_mem) {
+      test_imbs_to_release_.push_back(ImbInfo(imb_id, false, false));
+    }
+  }
+  for (int imb_id = 0; imb_id < imb_diff_infos_.size(); imb_id++) {
+    if (imb_diff_infos_[imb_id].data_in_mem) {
+      test_imb_diffs_to_release_.push_back(ImbInfo(imb_id, false, false));
+    }
+  }
   /* Decide imbs to accesss/release in backward pass */
   for (int layer_id = layer_infos_.size() - 1; layer_id >= 0; layer_id--) {
     if (!layer_need_backward[layer_id]) {
@@ -570,6 +960,73 @@ void Solver<float>::PrepareAccessInfo() {
       layer_handles.imb_diffs_to_access_bw.resize(layer_info.imb_diffs_to_access_bw.size());
       layer_handles.imb_diffs_to_release_bw.resize(layer_info.imb_diffs_to_release_bw.size());
     }
+    LayerHandles& test_handles = layer_info.test_handles;
+    test_handles.imbs_to_access_fw.resize(layer_info.imbs_to_access_fw.size());
+    test_handles.imbs_to_release_fw.resize(layer_info.imbs_to_release_fw.size());
+    test_handles.imb_diffs_to_access_fw.resize(layer_info.imb_diffs_to_access_fw.size());
+    test_handles.imb_diffs_to_release_fw.resize(layer_info.imb_diffs_to_release_fw.size());
+  }
+  test_end_handles_.imbs_to_release_fw.resize(test_imbs_to_release_.size());
+  test_end_handles_.imb_diffs_to_release_fw.resize(
+      test_imb_diffs_to_release_.size());
+}
+
+template <typename Dtype>
+void Solver<Dtype>::BalanceTables() {
+  /* Assign the layers to tables, largest first, each to the table
+   * that has the fewest bytes so far. Layers are not split, because
+   * each layer is read and updated with one access. */
+  int num_tables = ps_config_.num_ps_tables > 0 ? ps_config_.num_ps_tables
+      : ps_config_.geeps_config.num_comm_channels;
+  CHECK_GT(num_tables, 0);
+  vector<std::pair<size_t, int> > layer_rows;
+  for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+    LayerInfo& layer_info = layer_infos_[layer_id];
+    if (layer_info.param_infos.size() && !layer_info.local_param) {
+      /* Negated layer ids make equal-sized layers go in schedule order */
+      layer_rows.push_back(
+          std::make_pair(layer_info.row_ids.size(), -layer_id));
+    }
+  }
+  std::sort(layer_rows.rbegin(), layer_rows.rend());
+  vector<size_t> table_rows(num_tables, 0);
+  for (int i = 0; i < layer_rows.size(); i++) {
+    LayerInfo& layer_info = layer_infos_[-layer_rows[i].second];
+    int table_id = std::min_element(table_rows.begin(), table_rows.end())
+        - table_rows.begin();
+    layer_info.table_id = table_id;
+    for (int j = 0; j < layer_info.row_ids.size(); j++) {
+      layer_info.row_ids[j] = table_rows[table_id]++;
+    }
+  }
+  num_tables_ = std::min(num_tables, static_cast<int>(layer_rows.size()));
+
+  /* Print and export the layout */
+  const size_t row_bytes = ROW_DATA_SIZE * sizeof(float);
+  std::ofstream layout_out;
+  if (ps_config_.table_layout_file.size() && ps_config_.worker_id == 0) {
+    layout_out.open(ps_config_.table_layout_file.c_str());
+    CHECK(layout_out) << "Cannot write " << ps_config_.table_layout_file;
+    layout_out << "layer,table,rows,bytes" << endl;
+  }
+  for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+    LayerInfo& layer_info = layer_infos_[layer_id];
+    if (!layer_info.param_infos.size() || layer_info.local_param) {
+      continue;
+    }
+    const size_t num_rows = layer_info.row_ids.size();
+    LOG(INFO) << "Layer " << net_->layer_names()[layer_id]
+        << ": table " << layer_info.table_id
+        << ", " << num_rows * row_bytes << " bytes";
+    if (layout_out.is_open()) {
+      layout_out << net_->layer_names()[layer_id] << ","
+          << layer_info.table_id << "," << num_rows << ","
+          << num_rows * row_bytes << endl;
+    }
+  }
+  for (int table_id = 0; table_id < num_tables_; table_id++) {
+    LOG(INFO) << "Table " << table_id << ": "
+        << table_rows[table_id] * row_bytes << " bytes";
   }
 }
 
@@ -577,8 +1034,16 @@ template <>
 void Solver<float>::InitPs() {
   /* Decide rows to access at each layer */
   PrepareAccessInfo();
+  if (ps_config_.plan_only) {
+    return;
+  }
   vector<bool>& layer_need_backward = this->net_->layer_need_backward_;
 
+  /* The update counters are sums of floats, which stay exact below 2^24 */
+  CHECK_LT(static_cast<double>(update_counter_period_) * UpdatesPerClock()
+      * ps_config_.num_workers, 1 << 24)
+      << "Too many workers and batches per clock for the update counters";
+
   /* Initialize GeePS */
   ps_config_.geeps_config.num_tables = num_tables_;
   CHECK(ps_config_.geeps_config.host_list.size());
@@ -674,16 +1139,39 @@ void Solver<float>::InitPs() {
       LayerInfo& layer_info = layer_infos_[layer_id];
       LayerHandles& layer_handles = layer_info.layer_handles[batch_id];
       /* Read and prewrite model parameters */
+      bool accumulate_only = layer_info.accum_row_ids.size() &&
+          batch_id < ps_config_.batches_per_clock - 1;
       if (layer_info.param_infos.size()) {
         CHECK(!layer_info.local_param);
-        layer_handles.prewrite_handle = ps_->VirtualPreUpdate(
-            layer_info.table_id, layer_info.row_ids);
+        if (!accumulate_only) {
+          layer_handles.prewrite_handle = ps_->VirtualPreUpdate(
+              layer_info.table_id, layer_info.row_ids);
+        } else {
+          layer_handles.prewrite_handle = -1;
+        }
+        if (layer_info.accum_row_ids.size()) {
+          /* The first batch of a clock starts the sum, the last one
+           * only reads it into its update */
+          bool fetch = batch_id > 0;
+          layer_handles.accum_access_handle =
+              ps_->VirtualLocalAccess(layer_info.accum_row_ids, fetch);
+          if (!accumulate_only) {
+            bool keep = false;
+            layer_handles.accum_postaccess_handle =
+                ps_->VirtualPostLocalAccess(
+                    layer_handles.accum_access_handle, keep);
+          }
+        }
         layer_handles.bw_read_handle = ps_->VirtualRead(
             layer_info.table_id, layer_info.row_ids, ps_config_.slack);
         bool fetch = true;
         layer_handles.history_access_handle =
             ps_->VirtualLocalAccess(
                 layer_info.history_data_row_ids, fetch);
+        if (layer_info.residual_row_ids.size()) {
+          layer_handles.residual_access_handle =
+              ps_->VirtualLocalAccess(layer_info.residual_row_ids, fetch);
+        }
       }
 #if defined(LOCAL_DATA_IN_PS)
       /* Access intermediate data blobs */
@@ -737,17 +1225,43 @@ void Solver<float>::InitPs() {
 #endif
       /* Postread and write model parameters */
       if (layer_info.param_infos.size()) {
-        layer_handles.write_handle = ps_->VirtualUpdate(
-            layer_handles.prewrite_handle);
+        if (!accumulate_only) {
+          layer_handles.write_handle = ps_->VirtualUpdate(
+              layer_handles.prewrite_handle);
+        } else {
+          bool keep = true;
+          layer_handles.write_handle = -1;
+          layer_handles.accum_postaccess_handle =
+              ps_->VirtualPostLocalAccess(
+                  layer_handles.accum_access_handle, keep);
+        }
         layer_handles.bw_postread_handle = ps_->VirtualPostRead(
             layer_handles.bw_read_handle);
         bool keep = true;
         layer_handles.history_postaccess_handle =
             ps_->VirtualPostLocalAccess(
                 layer_handles.history_access_handle, keep);
+        if (layer_info.residual_row_ids.size()) {
+          layer_handles.residual_postaccess_handle =
+              ps_->VirtualPostLocalAccess(
+                  layer_handles.residual_access_handle, keep);
+        }
       }
     }
   }
+  if (ps_config_.distributed_test && test_score_row_ids_.size()) {
+    /* The test scores are read and updated once per clock. Both buffers
+     * are taken before the clock waits for the stream, and given back
+     * after it, so that their copies need no wait of their own. */
+    test_score_handles_.read_handle = ps_->VirtualRead(
+        test_score_table_id_, test_score_row_ids_, ps_config_.slack);
+    test_score_handles_.prewrite_handle = ps_->VirtualPreUpdate(
+        test_score_table_id_, test_score_row_ids_);
+    test_score_handles_.postread_handle = ps_->VirtualPostRead(
+        test_score_handles_.read_handle);
+    test_score_handles_.write_handle = ps_->VirtualUpdate(
+        test_score_handles_.prewrite_handle);
+  }
   ps_->VirtualClock();
   /* Report unrepeated accesses.
    * Currently, we assume all accesses after clock are unrepeated accesses. */
@@ -766,10 +1280,379 @@ void Solver<float>::InitPs() {
     layer_handles.write_handle = ps_->VirtualPostLocalAccess(
         layer_handles.prewrite_handle, keep);
   }
+  /* The test pass is not part of a clock either: it reads the parameters
+   * and streams the intermediate blobs through the forward pass, and makes
+   * no updates, so it neither sends to the PS nor advances the clock.
+   * Unlike the initial writes above, it is made once per test batch, so it
+   * needs GeePS to let the accesses recorded after the clock be made again,
+   * between any two clocks. CheckTestReplay() checks that at init. */
+  for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+    LayerInfo& layer_info = layer_infos_[layer_id];
+    LayerHandles& test_handles = layer_info.test_handles;
+    if (layer_info.param_infos.size()) {
+      if (!layer_info.local_param) {
+        test_handles.read_handle = ps_->VirtualRead(
+            layer_info.table_id, layer_info.row_ids, ps_config_.slack);
+      } else {
+        bool fetch = true;
+        test_handles.read_handle = ps_->VirtualLocalAccess(
+            layer_info.row_ids, fetch);
+      }
+    }
+#if defined(LOCAL_DATA_IN_PS)
+    for (int i = 0; i < layer_info.imbs_to_access_fw.size(); i++) {
+      ImbInfo& imb_info = layer_info.imbs_to_access_fw[i];
+      RowAccessInfo& access_info = imb_data_infos_[imb_info.global_imb_id];
+      test_handles.imbs_to_access_fw[i] = ps_->VirtualLocalAccess(
+          access_info.row_ids, imb_info.fetch);
+      access_info.data_handle = test_handles.imbs_to_access_fw[i];
+    }
+    for (int i = 0; i < layer_info.imb_diffs_to_access_fw.size(); i++) {
+      ImbInfo& imb_info = layer_info.imb_diffs_to_access_fw[i];
+      RowAccessInfo& access_info = imb_diff_infos_[imb_info.global_imb_id];
+      test_handles.imb_diffs_to_access_fw[i] = ps_->VirtualLocalAccess(
+          access_info.row_ids, imb_info.fetch);
+      access_info.data_handle = test_handles.imb_diffs_to_access_fw[i];
+    }
+    for (int i = 0; i < layer_info.imbs_to_release_fw.size(); i++) {
+      ImbInfo& imb_info = layer_info.imbs_to_release_fw[i];
+      RowAccessInfo& access_info = imb_data_infos_[imb_info.global_imb_id];
+      CHECK_GE(access_info.data_handle, 0);
+      test_handles.imbs_to_release_fw[i] = ps_->VirtualPostLocalAccess(
+          access_info.data_handle, imb_info.keep);
+      access_info.data_handle = -1;
+    }
+    for (int i = 0; i < layer_info.imb_diffs_to_release_fw.size(); i++) {
+      ImbInfo& imb_info = layer_info.imb_diffs_to_release_fw[i];
+      RowAccessInfo& access_info = imb_diff_infos_[imb_info.global_imb_id];
+      CHECK_GE(access_info.data_handle, 0);
+      test_handles.imb_diffs_to_release_fw[i] = ps_->VirtualPostLocalAccess(
+          access_info.data_handle, imb_info.keep);
+      access_info.data_handle = -1;
+    }
+#endif
+    if (layer_info.param_infos.size()) {
+      if (!layer_info.local_param) {
+        test_handles.postread_handle = ps_->VirtualPostRead(
+            test_handles.read_handle);
+      } else {
+        bool keep = false;
+        test_handles.postread_handle = ps_->VirtualPostLocalAccess(
+            test_handles.read_handle, keep);
+      }
+    }
+  }
+#if defined(LOCAL_DATA_IN_PS)
+  /* Release what training would keep for the backward pass */
+  for (int i = 0; i < test_imbs_to_release_.size(); i++) {
+    RowAccessInfo& access_info =
+        imb_data_infos_[test_imbs_to_release_[i].global_imb_id];
+    CHECK_GE(access_info.data_handle, 0);
+    test_end_handles_.imbs_to_release_fw[i] = ps_->VirtualPostLocalAccess(
+        access_info.data_handle, false);
+    access_info.data_handle = -1;
+  }
+  for (int i = 0; i < test_imb_diffs_to_release_.size(); i++) {
+    RowAccessInfo& access_info =
+        imb_diff_infos_[test_imb_diffs_to_release_[i].global_imb_id];
+    CHECK_GE(access_info.data_handle, 0);
+    test_end_handles_.imb_diffs_to_release_fw[i] =
+        ps_->VirtualPostLocalAccess(access_info.data_handle, false);
+    access_info.data_handle = -1;
+  }
+#endif
   ps_->FinishVirtualIteration();
   LOG(INFO) << "Virtual iteration done";
 }
 
+template <>
+void Solver<float>::PlanAccesses(vector<PlannedAccess> *plan) const {
+  const vector<string>& layer_names = net_->layer_names();
+  const vector<bool>& layer_need_backward = net_->layer_need_backward();
+  const size_t row_bytes = ROW_DATA_SIZE * sizeof(float);
+  plan->clear();
+  /* Follows the order of the virtual iteration in InitPs(): the batches
+   * of the clock, the test scores, then the test pass */
+  for (int batch_id = 0; batch_id < ps_config_.batches_per_clock; batch_id++) {
+    for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+      const LayerInfo& layer_info = layer_infos_[layer_id];
+      const string& name = layer_names[layer_id];
+      const size_t param_bytes = layer_info.row_ids.size() * row_bytes;
+      if (layer_info.param_infos.size()) {
+        plan->push_back(PlannedAccess(
+            PlannedAccess::ACCESS, name + ":params", param_bytes, true));
+      }
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_info.imbs_to_access_fw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imbs_to_access_fw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+            net_->blob_names()[imb_info.global_imb_id] + ":data",
+            imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            imb_info.fetch));
+      }
+      for (int i = 0; i < layer_info.imb_diffs_to_access_fw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imb_diffs_to_access_fw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+            net_->blob_names()[imb_info.global_imb_id] + ":diff",
+            imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            imb_info.fetch));
+      }
+#endif
+      plan->push_back(PlannedAccess(PlannedAccess::COMPUTE, name + ":fw"));
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_info.imbs_to_release_fw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imbs_to_release_fw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            net_->blob_names()[imb_info.global_imb_id] + ":data",
+            imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            false, imb_info.keep));
+      }
+      for (int i = 0; i < layer_info.imb_diffs_to_release_fw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imb_diffs_to_release_fw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            net_->blob_names()[imb_info.global_imb_id] + ":diff",
+            imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            false, imb_info.keep));
+      }
+#endif
+      if (layer_info.param_infos.size()) {
+        /* The parameters are read again at the next clock */
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            name + ":params", param_bytes, false, true));
+      }
+    }
+    for (int layer_id = layer_infos_.size() - 1; layer_id >= 0; layer_id--) {
+      if (!layer_need_backward[layer_id]) {
+        continue;
+      }
+      const LayerInfo& layer_info = layer_infos_[layer_id];
+      const string& name = layer_names[layer_id];
+      const size_t param_bytes = layer_info.row_ids.size() * row_bytes;
+      const size_t history_bytes =
+          layer_info.history_data_row_ids.size() * row_bytes;
+      const size_t residual_bytes =
+          layer_info.residual_row_ids.size() * row_bytes;
+      const size_t accum_bytes = layer_info.accum_row_ids.size() * row_bytes;
+      bool accumulate_only = layer_info.accum_row_ids.size() &&
+          batch_id < ps_config_.batches_per_clock - 1;
+      if (layer_info.param_infos.size()) {
+        if (!accumulate_only) {
+          plan->push_back(PlannedAccess(
+              PlannedAccess::ACCESS, name + ":update", param_bytes, false));
+        }
+        if (accum_bytes) {
+          plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+              name + ":accum", accum_bytes, batch_id > 0));
+          if (!accumulate_only) {
+            plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+                name + ":accum", accum_bytes, false, false));
+          }
+        }
+        plan->push_back(PlannedAccess(
+            PlannedAccess::ACCESS, name + ":params", param_bytes, true));
+        plan->push_back(PlannedAccess(
+            PlannedAccess::ACCESS, name + ":history", history_bytes, true));
+        if (residual_bytes) {
+          plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+              name + ":residual", residual_bytes, true));
+        }
+      }
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_info.imbs_to_access_bw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imbs_to_access_bw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+            net_->blob_names()[imb_info.global_imb_id] + ":data",
+            imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            imb_info.fetch));
+      }
+      for (int i = 0; i < layer_info.imb_diffs_to_access_bw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imb_diffs_to_access_bw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+            net_->blob_names()[imb_info.global_imb_id] + ":diff",
+            imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            imb_info.fetch));
+      }
+#endif
+      plan->push_back(PlannedAccess(PlannedAccess::COMPUTE, name + ":bw"));
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_info.imbs_to_release_bw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imbs_to_release_bw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            net_->blob_names()[imb_info.global_imb_id] + ":data",
+            imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            false, imb_info.keep));
+      }
+      for (int i = 0; i < layer_info.imb_diffs_to_release_bw.size(); i++) {
+        const ImbInfo& imb_info = layer_info.imb_diffs_to_release_bw[i];
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            net_->blob_names()[imb_info.global_imb_id] + ":diff",
+            imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+            false, imb_info.keep));
+      }
+#endif
+      if (layer_info.param_infos.size()) {
+        if (!accumulate_only) {
+          plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+              name + ":update", param_bytes, false, false));
+        }
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            name + ":params", param_bytes, false, true));
+        plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+            name + ":history", history_bytes, false, true));
+        if (residual_bytes) {
+          plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+              name + ":residual", residual_bytes, false, true));
+        }
+        if (accumulate_only) {
+          plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+              name + ":accum", accum_bytes, false, true));
+        }
+      }
+    }
+  }
+  if (ps_config_.distributed_test && test_score_row_ids_.size()) {
+    const size_t score_bytes = test_score_row_ids_.size() * row_bytes;
+    plan->push_back(PlannedAccess(
+        PlannedAccess::ACCESS, "test_scores:read", score_bytes, true));
+    plan->push_back(PlannedAccess(
+        PlannedAccess::ACCESS, "test_scores:update", score_bytes, false));
+    plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+        "test_scores:read", score_bytes, false, true));
+    plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+        "test_scores:update", score_bytes, false, false));
+  }
+  /* After the clock: the initial writes of the local parameters are made
+   * once, and are left out. The test pass is made once per test batch, at
+   * the test intervals only; one batch of it is planned, as if every
+   * clock ended with one. */
+  if (!test_nets_.size()) {
+    return;
+  }
+  for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+    const LayerInfo& layer_info = layer_infos_[layer_id];
+    const string& name = layer_names[layer_id];
+    const size_t param_bytes = layer_info.row_ids.size() * row_bytes;
+    if (layer_info.param_infos.size()) {
+      plan->push_back(PlannedAccess(
+          PlannedAccess::ACCESS, name + ":params", param_bytes, true));
+    }
+#if defined(LOCAL_DATA_IN_PS)
+    for (int i = 0; i < layer_info.imbs_to_access_fw.size(); i++) {
+      const ImbInfo& imb_info = layer_info.imbs_to_access_fw[i];
+      plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+          net_->blob_names()[imb_info.global_imb_id] + ":data",
+          imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+          imb_info.fetch));
+    }
+    for (int i = 0; i < layer_info.imb_diffs_to_access_fw.size(); i++) {
+      const ImbInfo& imb_info = layer_info.imb_diffs_to_access_fw[i];
+      plan->push_back(PlannedAccess(PlannedAccess::ACCESS,
+          net_->blob_names()[imb_info.global_imb_id] + ":diff",
+          imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+          imb_info.fetch));
+    }
+#endif
+    plan->push_back(PlannedAccess(PlannedAccess::COMPUTE, name + ":test"));
+#if defined(LOCAL_DATA_IN_PS)
+    for (int i = 0; i < layer_info.imbs_to_release_fw.size(); i++) {
+      const ImbInfo& imb_info = layer_info.imbs_to_release_fw[i];
+      plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+          net_->blob_names()[imb_info.global_imb_id] + ":data",
+          imb_data_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+          false, imb_info.keep));
+    }
+    for (int i = 0; i < layer_info.imb_diffs_to_release_fw.size(); i++) {
+      const ImbInfo& imb_info = layer_info.imb_diffs_to_release_fw[i];
+      plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+          net_->blob_names()[imb_info.global_imb_id] + ":diff",
+          imb_diff_infos_[imb_info.global_imb_id].row_ids.size() * row_bytes,
+          false, imb_info.keep));
+    }
+#endif
+    if (layer_info.param_infos.size()) {
+      /* Local parameters are not kept after the test pass */
+      plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+          name + ":params", param_bytes, false, !layer_info.local_param));
+    }
+  }
+#if defined(LOCAL_DATA_IN_PS)
+  /* Release what training would keep for the backward pass */
+  for (int i = 0; i < test_imbs_to_release_.size(); i++) {
+    const int imb_id = test_imbs_to_release_[i].global_imb_id;
+    plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+        net_->blob_names()[imb_id] + ":data",
+        imb_data_infos_[imb_id].row_ids.size() * row_bytes, false, false));
+  }
+  for (int i = 0; i < test_imb_diffs_to_release_.size(); i++) {
+    const int imb_id = test_imb_diffs_to_release_[i].global_imb_id;
+    plan->push_back(PlannedAccess(PlannedAccess::RELEASE,
+        net_->blob_names()[imb_id] + ":diff",
+        imb_diff_infos_[imb_id].row_ids.size() * row_bytes, false, false));
+  }
+#endif
+}
+
+template <>
+void Solver<float>::CheckTestReplay() {
+  /* The test pass replays accesses recorded after the clock. Make them
+   * twice, with no compute, so that a GeePS that can not replay them
+   * fails here, and not in the middle of training. */
+  RowData *buffer = NULL;
+  for (int replay = 0; replay < 2; replay++) {
+    for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+      LayerInfo& layer_info = layer_infos_[layer_id];
+      LayerHandles& test_handles = layer_info.test_handles;
+      if (layer_info.param_infos.size()) {
+        buffer = NULL;
+        if (!layer_info.local_param) {
+          ps_->Read(test_handles.read_handle, &buffer);
+        } else {
+          ps_->LocalAccess(test_handles.read_handle, &buffer);
+        }
+        CHECK(buffer) << "GeePS did not replay the test read of layer "
+            << layer_id;
+      }
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < test_handles.imbs_to_access_fw.size(); i++) {
+        buffer = NULL;
+        ps_->LocalAccess(test_handles.imbs_to_access_fw[i], &buffer);
+        CHECK(buffer) << "GeePS did not replay a test access of layer "
+            << layer_id;
+      }
+      for (int i = 0; i < test_handles.imb_diffs_to_access_fw.size(); i++) {
+        buffer = NULL;
+        ps_->LocalAccess(test_handles.imb_diffs_to_access_fw[i], &buffer);
+        CHECK(buffer) << "GeePS did not replay a test access of layer "
+            << layer_id;
+      }
+      for (int i = 0; i < test_handles.imbs_to_release_fw.size(); i++) {
+        ps_->PostLocalAccess(test_handles.imbs_to_release_fw[i]);
+      }
+      for (int i = 0; i < test_handles.imb_diffs_to_release_fw.size(); i++) {
+        ps_->PostLocalAccess(test_handles.imb_diffs_to_release_fw[i]);
+      }
+#endif
+      if (layer_info.param_infos.size()) {
+        if (!layer_info.local_param) {
+          ps_->PostRead(test_handles.postread_handle);
+        } else {
+          ps_->PostLocalAccess(test_handles.postread_handle);
+        }
+      }
+    }
+#if defined(LOCAL_DATA_IN_PS)
+    for (int i = 0; i < test_end_handles_.imbs_to_release_fw.size(); i++) {
+      ps_->PostLocalAccess(test_end_handles_.imbs_to_release_fw[i]);
+    }
+    for (int i = 0; i < test_end_handles_.imb_diffs_to_release_fw.size();
+        i++) {
+      ps_->PostLocalAccess(test_end_handles_.imb_diffs_to_release_fw[i]);
+    }
+#endif
+  }
+  LOG(INFO) << "The test accesses can be replayed";
+}
+
 template <>
 void SGDSolver<float>::InitPsValues() {
   bool print_ = this->ps_config_.debug ? ps_config_.worker_id == 0 : false;
@@ -787,10 +1670,13 @@ void SGDSolver<float>::InitPsValues() {
       LOG(INFO) << "Layer " << layer_names[layer_id];
     }
     LayerInfo& layer_info = layer_infos_[layer_id];
-    LayerHandles& layer_handles = layer_info.layer_handles[0];
     if (!layer_info.param_infos.size()) {
       continue;
     }
+    /* With accumulate_gradients, only the last batch of a clock
+     * updates the PS */
+    LayerHandles& layer_handles = layer_info.local_param ?
+        layer_info.layer_handles[0] : layer_info.layer_handles.back();
     if (layer_info.local_param || ps_config_.worker_id == 0) {
       /* Non-local parameters are stored in PS,
        * so only one worker needs to set it. */
@@ -823,6 +1709,8 @@ void SGDSolver<float>::InitPsValues() {
       }
       /* Write */
       if (!layer_info.local_param) {
+        caffe_gpu_set<float>(1, 0, &params_vals[layer_info.num_vals]);
+        CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
         ps_->Update(layer_handles.write_handle);
       } else {
         ps_->PostLocalAccess(layer_handles.write_handle);
@@ -843,6 +1731,8 @@ void SGDSolver<float>::InitPsValues() {
   if (print_) {
     LOG(INFO) << "Set initial updates history values";
   }
+  const int num_params = this->net_->params().size();
+  CHECK_EQ(history_.size(), num_params * num_history_slots_);
   for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
     LayerInfo& layer_info = layer_infos_[layer_id];
     LayerHandles& layer_handles = layer_info.layer_handles[0];
@@ -856,13 +1746,17 @@ void SGDSolver<float>::InitPsValues() {
     RowData *history_buffer = NULL;
     ps_->LocalAccess(layer_handles.history_access_handle, &history_buffer);
     float *history_vals = reinterpret_cast<float *>(history_buffer);
-    for (int param_id = 0;
-        param_id < layer_info.param_infos.size(); param_id++) {
+    for (int i = 0;
+        i < layer_info.param_infos.size() * num_history_slots_; i++) {
+      int slot = i / layer_info.param_infos.size();
+      int param_id = i % layer_info.param_infos.size();
       int param_val_offset = layer_info.param_infos[param_id].val_offset;
-      float *history_param_vals = &history_vals[param_val_offset];
+      float *history_param_vals =
+          &history_vals[slot * layer_info.history_slot_vals + param_val_offset];
       int global_param_id =
           layer_info.param_infos[param_id].global_param_id;
-      shared_ptr<Blob<float> >& updates_history = history_[global_param_id];
+      shared_ptr<Blob<float> >& updates_history =
+          history_[slot * num_params + global_param_id];
       CHECK(!updates_history->check_gpu_data());
       bool change_head = false;
           /* "false" means that we will keep the head to be CPU_DATA.
@@ -878,11 +1772,164 @@ void SGDSolver<float>::InitPsValues() {
     /* Write */
     CHECK_GT(layer_handles.history_postaccess_handle, 0);
     ps_->PostLocalAccess(layer_handles.history_postaccess_handle);
+    if (layer_info.residual_row_ids.size()) {
+      /* Compression starts with an empty residual */
+      RowData *residual_buffer = NULL;
+      ps_->LocalAccess(layer_handles.residual_access_handle, &residual_buffer);
+      CUDA_CHECK(cudaMemsetAsync(residual_buffer, 0,
+          layer_info.num_vals * sizeof(float), Caffe::cuda_stream()));
+      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+      ps_->PostLocalAccess(layer_handles.residual_postaccess_handle);
+    }
   }
   LOG(INFO) << "Set initial parameter values done";
   ps_->Clock();
   ps_->StartIterations();
   LOG(INFO) << "Iterations started";
+  if (this->test_nets_.size()) {
+    CheckTestReplay();
+  }
+}
+
+template <>
+void Solver<float>::StartTestScoreExchange() {
+  size_t size = num_test_score_vals_ * sizeof(float);
+  cudaStream_t stream = Caffe::cuda_stream();
+  RowData *buffer = NULL;
+  ps_->Read(test_score_handles_.read_handle, &buffer);
+  test_score_reading_ = test_score_report_clock_ >= 0 &&
+      ps_clock_ >= test_score_report_clock_;
+  if (test_score_reading_) {
+    /* The reads of this clock see all updates from
+     * the clock at which the last test scores were sent */
+    test_score_sums_.resize(num_test_score_vals_);
+    CUDA_CHECK(cudaMemcpyAsync(&test_score_sums_[0], buffer, size,
+        cudaMemcpyDefault, stream));
+    test_score_report_clock_ = -1;
+  }
+  ps_->PreUpdate(test_score_handles_.prewrite_handle, &buffer);
+  if (test_score_update_.size() && test_score_report_clock_ < 0) {
+    test_score_sending_.swap(test_score_update_);
+    test_score_update_.clear();
+    CUDA_CHECK(cudaMemcpyAsync(buffer, &test_score_sending_[0], size,
+        cudaMemcpyDefault, stream));
+    test_score_report_clock_ = ps_clock_ + ps_config_.slack + 1;
+    test_score_report_iter_ = test_score_iter_;
+  } else {
+    CUDA_CHECK(cudaMemsetAsync(buffer, 0, size, stream));
+  }
+}
+
+template <>
+void Solver<float>::FinishTestScoreExchange() {
+  /* The copies queued by StartTestScoreExchange are done */
+  ps_->PostRead(test_score_handles_.postread_handle);
+  ps_->Update(test_score_handles_.write_handle);
+  test_score_sending_.clear();
+  if (test_score_reading_) {
+    if (ps_config_.worker_id == 0) {
+      ReportTestScores(test_score_sums_);
+    }
+    test_score_reported_ = test_score_sums_;
+    test_score_reading_ = false;
+  }
+}
+
+template <>
+void Solver<float>::DrainClock() {
+  /* Makes every access of a clock, as GeePS replays them all, but runs no
+   * layer and sends zero updates, which the update counters do not count */
+  RowData *buffer = NULL;
+  for (int batch_id = 0; batch_id < ps_config_.batches_per_clock; batch_id++) {
+    for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
+      LayerInfo& layer_info = layer_infos_[layer_id];
+      LayerHandles& layer_handles = layer_info.layer_handles[batch_id];
+      if (layer_info.param_infos.size()) {
+        if (!layer_info.local_param) {
+          ps_->Read(layer_handles.read_handle, &buffer);
+        } else {
+          ps_->LocalAccess(layer_handles.read_handle, &buffer);
+        }
+      }
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_handles.imbs_to_access_fw.size(); i++) {
+        ps_->LocalAccess(layer_handles.imbs_to_access_fw[i], &buffer);
+      }
+      for (int i = 0; i < layer_handles.imb_diffs_to_access_fw.size(); i++) {
+        ps_->LocalAccess(layer_handles.imb_diffs_to_access_fw[i], &buffer);
+      }
+      for (int i = 0; i < layer_handles.imbs_to_release_fw.size(); i++) {
+        ps_->PostLocalAccess(layer_handles.imbs_to_release_fw[i]);
+      }
+      for (int i = 0; i < layer_handles.imb_diffs_to_release_fw.size(); i++) {
+        ps_->PostLocalAccess(layer_handles.imb_diffs_to_release_fw[i]);
+      }
+#endif
+      if (layer_info.param_infos.size()) {
+        if (!layer_info.local_param) {
+          ps_->PostRead(layer_handles.postread_handle);
+        } else {
+          ps_->PostLocalAccess(layer_handles.postread_handle);
+        }
+      }
+    }
+    for (int layer_id = layer_infos_.size() - 1; layer_id >= 0; layer_id--) {
+      LayerInfo& layer_info = layer_infos_[layer_id];
+      if (!layer_info.layer_need_backward) {
+        continue;
+      }
+      LayerHandles& layer_handles = layer_info.layer_handles[batch_id];
+      bool accumulate_only = layer_info.accum_row_ids.size() &&
+          batch_id < ps_config_.batches_per_clock - 1;
+      if (layer_info.param_infos.size()) {
+        if (!accumulate_only) {
+          ps_->PreUpdate(layer_handles.prewrite_handle, &buffer);
+          CUDA_CHECK(cudaMemsetAsync(buffer, 0,
+              (layer_info.num_vals + 1) * sizeof(float), Caffe::cuda_stream()));
+        }
+        if (layer_info.accum_row_ids.size()) {
+          ps_->LocalAccess(layer_handles.accum_access_handle, &buffer);
+          if (!accumulate_only) {
+            ps_->PostLocalAccess(layer_handles.accum_postaccess_handle);
+          }
+        }
+        ps_->Read(layer_handles.bw_read_handle, &buffer);
+        ps_->LocalAccess(layer_handles.history_access_handle, &buffer);
+        if (layer_info.residual_row_ids.size()) {
+          ps_->LocalAccess(layer_handles.residual_access_handle, &buffer);
+        }
+      }
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < layer_handles.imbs_to_access_bw.size(); i++) {
+        ps_->LocalAccess(layer_handles.imbs_to_access_bw[i], &buffer);
+      }
+      for (int i = 0; i < layer_handles.imb_diffs_to_access_bw.size(); i++) {
+        ps_->LocalAccess(layer_handles.imb_diffs_to_access_bw[i], &buffer);
+      }
+      for (int i = 0; i < layer_handles.imbs_to_release_bw.size(); i++) {
+        ps_->PostLocalAccess(layer_handles.imbs_to_release_bw[i]);
+      }
+      for (int i = 0; i < layer_handles.imb_diffs_to_release_bw.size(); i++) {
+        ps_->PostLocalAccess(layer_handles.imb_diffs_to_release_bw[i]);
+      }
+#endif
+      if (layer_info.param_infos.size()) {
+        if (!accumulate_only) {
+          /* The zeroed buffer goes back to GeePS */
+          WaitForStream();
+          ps_->Update(layer_handles.write_handle);
+        } else {
+          ps_->PostLocalAccess(layer_handles.accum_postaccess_handle);
+        }
+        ps_->PostRead(layer_handles.bw_postread_handle);
+        ps_->PostLocalAccess(layer_handles.history_postaccess_handle);
+        if (layer_info.residual_row_ids.size()) {
+          ps_->PostLocalAccess(layer_handles.residual_postaccess_handle);
+        }
+      }
+    }
+  }
+  EndClock();
 }
 
 template <>
@@ -899,8 +1946,6 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
   /* When we test on the testing network, we will use the layer information
    * that is gathered using training network, so we are assuming
    * the testing network has the same topology as the training network. */
-  tbb::tick_count tick_start;
-
   bool print_ = this->ps_config_.debug ? ps_config_.worker_id == 0 : false;
 
   if (print_) {
@@ -916,7 +1961,9 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
     LOG(INFO) << "Forward";
   }
   float loss = 0;
-  for (int batch_id = 0; batch_id < ps_config_.batches_per_clock; batch_id++) {
+  /* A test runs a single batch through the forward-only test accesses */
+  const int num_batches = test ? 1 : ps_config_.batches_per_clock;
+  for (int batch_id = 0; batch_id < num_batches; batch_id++) {
     for (int layer_id = 0; layer_id < layer_infos_.size(); layer_id++) {
       if (print_) {
         LOG(INFO) << "Layer " << layer_id << ": " << layer_names[layer_id];
@@ -925,9 +1972,10 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
       shared_ptr<Layer<float> >& layer = layers[layer_id];
       CHECK(layer);
       LayerInfo& layer_info = layer_infos_[layer_id];
-      LayerHandles& layer_handles = layer_info.layer_handles[batch_id];
+      LayerHandles& layer_handles = test ? layer_info.test_handles
+          : layer_info.layer_handles[batch_id];
 
-      tick_start = tbb::tick_count::now();
+      StartStage();
       /* Read model parameters */
       if (layer_info.param_infos.size()) {
         if (print_) {
@@ -940,6 +1988,10 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           ps_->LocalAccess(layer_handles.read_handle, &read_buffer);
         }
         float *params_vals = reinterpret_cast<float *>(read_buffer);
+        if (!layer_info.local_param && !test) {
+          layer_info.fw_staleness =
+              ReadStaleness(params_vals, layer_info, test);
+        }
         for (int param_id = 0;
             param_id < layer_info.param_infos.size(); param_id++) {
           int param_val_offset = layer_info.param_infos[param_id].val_offset;
@@ -988,6 +2040,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
             << "layer " << layer_names[layer_id] << " has gpu data "
             << imb_info.global_imb_id;
         imb->set_gpu_data(reinterpret_cast<float *>(read_buffer), true);
+        BindImbSlices(imbs, imb_data_slices_[imb_info.global_imb_id], false,
+            reinterpret_cast<float *>(read_buffer));
       }
       /* Access intermediate diff blobs */
       if (print_) {
@@ -1007,16 +2061,11 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         CHECK(!imb->check_gpu_diff())
             << "layer " << layer_names[layer_id] << " has gpu diff";
         imb->set_gpu_diff(reinterpret_cast<float *>(read_buffer), true);
+        BindImbSlices(imbs, imb_diff_slices_[imb_info.global_imb_id], true,
+            reinterpret_cast<float *>(read_buffer));
       }
 #endif
-      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-      if (!test) {
-        layer_info.fw_read_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      } else {
-        layer_info.test_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      }
+      StopStage(test ? &layer_info.test_time : &layer_info.fw_read_time);
 
       if (print_) {
         vector<int>& bottom_imb_ids = this->net_->bottom_id_vecs_[layer_id];
@@ -1049,20 +2098,15 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
       if (print_) {
         LOG(INFO) << "Forward calculation";
       }
-      tick_start = tbb::tick_count::now();
+      StartStage();
       float layer_loss =
           layer->Forward(bottom_vecs[layer_id], top_vecs[layer_id]);
-      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
       loss += layer_loss;
-      if (!test) {
-        layer_info.fw_compute_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      } else {
-        layer_info.test_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      }
+      StopStage(test ? &layer_info.test_time : &layer_info.fw_compute_time);
 
-      tick_start = tbb::tick_count::now();
+      StartStage();
+      /* GeePS takes the buffers back at the releases */
+      WaitForStream();
       /* We release the intermediate data first, because usually the
        * intermediate data released here was allocated from the last layer,
        * before the allocation of the parameter data of this layer. */
@@ -1079,6 +2123,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           LOG(INFO) << "Release data " << imb_info.global_imb_id;
         }
         shared_ptr<Blob<float> >& imb = imbs[imb_info.global_imb_id];
+        BindImbSlices(imbs, imb_data_slices_[imb_info.global_imb_id], false,
+            NULL);
         imb->gpu_data();
            /* Make sure everything is copied to GPU memory */
         imb->set_gpu_data(NULL, true);
@@ -1096,6 +2142,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           LOG(INFO) << "Release data " << imb_info.global_imb_id;
         }
         shared_ptr<Blob<float> >& imb = imbs[imb_info.global_imb_id];
+        BindImbSlices(imbs, imb_diff_slices_[imb_info.global_imb_id], true,
+            NULL);
         imb->gpu_diff();
            /* Make sure everything is copied to GPU memory */
         imb->set_gpu_diff(NULL, true);
@@ -1120,14 +2168,27 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           ps_->PostLocalAccess(layer_handles.postread_handle);
         }
       }
-      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-      if (!test) {
-        layer_info.fw_write_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      } else {
-        layer_info.test_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
+      StopStage(test ? &layer_info.test_time : &layer_info.fw_write_time);
+    }
+    if (test) {
+#if defined(LOCAL_DATA_IN_PS)
+      for (int i = 0; i < test_imbs_to_release_.size(); i++) {
+        const int imb_id = test_imbs_to_release_[i].global_imb_id;
+        BindImbSlices(imbs, imb_data_slices_[imb_id], false, NULL);
+        imbs[imb_id]->gpu_data();
+        imbs[imb_id]->set_gpu_data(NULL, true);
+        ps_->PostLocalAccess(test_end_handles_.imbs_to_release_fw[i]);
+      }
+      for (int i = 0; i < test_imb_diffs_to_release_.size(); i++) {
+        const int imb_id = test_imb_diffs_to_release_[i].global_imb_id;
+        BindImbSlices(imbs, imb_diff_slices_[imb_id], true, NULL);
+        imbs[imb_id]->gpu_diff();
+        imbs[imb_id]->set_gpu_diff(NULL, true);
+        ps_->PostLocalAccess(test_end_handles_.imb_diffs_to_release_fw[i]);
       }
+#endif
+      AccumulateTestOutputs(net, loss);
+      return loss;
     }
 
     /* Backward */
@@ -1147,20 +2208,47 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
       }
       LayerHandles& layer_handles = layer_info.layer_handles[batch_id];
 
-      tick_start = tbb::tick_count::now();
+      StartStage();
+      float *write_params_vals = NULL;
+      float *residual_vals = NULL;
+      bool accumulate_only = layer_info.accum_row_ids.size() &&
+          batch_id < ps_config_.batches_per_clock - 1;
       if (layer_info.param_infos.size()) {
         /* Prepare write buffers */
         if (print_) {
           LOG(INFO) << "Prepare write buffers";
         }
         CHECK(!layer_info.local_param);
-        RowData *write_buffer = NULL;
-        ps_->PreUpdate(layer_handles.prewrite_handle, &write_buffer);
-        float *write_params_vals = reinterpret_cast<float *>(write_buffer);
         size_t size = layer_info.num_vals * sizeof(float);
-        CUDA_CHECK(cudaMemsetAsync(
-            write_params_vals, 0, size, Caffe::cuda_stream()));
-        CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+        RowData *write_buffer = NULL;
+        if (!accumulate_only) {
+          ps_->PreUpdate(layer_handles.prewrite_handle, &write_buffer);
+          write_params_vals = reinterpret_cast<float *>(write_buffer);
+          CUDA_CHECK(cudaMemsetAsync(
+              write_params_vals, 0, size, Caffe::cuda_stream()));
+          /* Count this update */
+          caffe_gpu_set<float>(1, CountedUpdate(batch_id),
+              &write_params_vals[layer_info.num_vals]);
+        }
+        if (layer_info.accum_row_ids.size()) {
+          /* The backward pass adds the gradients to the sum of the
+           * previous batches of this clock */
+          RowData *accum_buffer = NULL;
+          ps_->LocalAccess(layer_handles.accum_access_handle, &accum_buffer);
+          float *accum_vals = reinterpret_cast<float *>(accum_buffer);
+          if (accumulate_only) {
+            write_params_vals = accum_vals;
+            if (batch_id == 0) {
+              CUDA_CHECK(cudaMemsetAsync(
+                  write_params_vals, 0, size, Caffe::cuda_stream()));
+            }
+          } else {
+            CUDA_CHECK(cudaMemcpyAsync(write_params_vals, accum_vals, size,
+                cudaMemcpyDeviceToDevice, Caffe::cuda_stream()));
+            WaitForStream();
+            ps_->PostLocalAccess(layer_handles.accum_postaccess_handle);
+          }
+        }
         for (int param_id = 0;
             param_id < layer_info.param_infos.size(); param_id++) {
           int param_val_offset = layer_info.param_infos[param_id].val_offset;
@@ -1176,6 +2264,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         RowData *read_buffer = NULL;
         ps_->Read(layer_handles.bw_read_handle, &read_buffer);
         float *read_params_vals = reinterpret_cast<float *>(read_buffer);
+        layer_info.bw_staleness =
+            ReadStaleness(read_params_vals, layer_info, test);
         for (int param_id = 0;
             param_id < layer_info.param_infos.size(); param_id++) {
           int param_val_offset = layer_info.param_infos[param_id].val_offset;
@@ -1187,22 +2277,25 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         RowData *history_buffer = NULL;
         ps_->LocalAccess(layer_handles.history_access_handle, &history_buffer);
         float *history_vals = reinterpret_cast<float *>(history_buffer);
-        for (int param_id = 0;
-            param_id < layer_info.param_infos.size(); param_id++) {
+        for (int i = 0;
+            i < layer_info.param_infos.size() * num_history_slots_; i++) {
+          int slot = i / layer_info.param_infos.size();
+          int param_id = i % layer_info.param_infos.size();
           int param_val_offset = layer_info.param_infos[param_id].val_offset;
-          float *history_param_vals = &history_vals[param_val_offset];
-          int global_param_id =
-              layer_info.param_infos[param_id].global_param_id;
-          shared_ptr<Blob<float> >& updates_history = history_[global_param_id];
+          float *history_param_vals = &history_vals[
+              slot * layer_info.history_slot_vals + param_val_offset];
+          int history_id = slot * net->params().size()
+              + layer_info.param_infos[param_id].global_param_id;
+          shared_ptr<Blob<float> >& updates_history = history_[history_id];
           updates_history->set_gpu_data(history_param_vals, true);
           if (do_snapshot) {
             /* Write the updates history data to solver state protobuf */
             tbb::tick_count snapshot_start;
             CHECK(!test);
             SolverState& solverstate_pb = this->snapshot_solver_state_protobuf_;
-            CHECK_LT(global_param_id, solverstate_pb.history_size());
+            CHECK_LT(history_id, solverstate_pb.history_size());
             BlobProto *history_pb =
-                solverstate_pb.mutable_history(global_param_id);
+                solverstate_pb.mutable_history(history_id);
             bool write_diff = false;
             bool write_data = true;
             updates_history->ToProto(history_pb, write_diff, write_data);
@@ -1210,6 +2303,13 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
                 (tbb::tick_count::now() - snapshot_start).seconds();
           }
         }
+        /* Access local updates residual */
+        if (layer_info.residual_row_ids.size()) {
+          RowData *residual_buffer = NULL;
+          ps_->LocalAccess(
+              layer_handles.residual_access_handle, &residual_buffer);
+          residual_vals = reinterpret_cast<float *>(residual_buffer);
+        }
       }
 #if defined(LOCAL_DATA_IN_PS)
       /* Access intermediate data blobs */
@@ -1229,6 +2329,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         CHECK(!imb->check_gpu_data())
             << "layer " << layer_names[layer_id] << " has gpu data";
         imb->set_gpu_data(reinterpret_cast<float *>(imb_buffer), true);
+        BindImbSlices(imbs, imb_data_slices_[imb_info.global_imb_id], false,
+            reinterpret_cast<float *>(imb_buffer));
       }
       /* Access intermediate diff blobs */
       if (print_) {
@@ -1247,16 +2349,11 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         CHECK(!imb->check_gpu_diff())
             << "layer " << layer_names[layer_id] << " has gpu diff";
         imb->set_gpu_diff(reinterpret_cast<float *>(imb_buffer), true);
+        BindImbSlices(imbs, imb_diff_slices_[imb_info.global_imb_id], true,
+            reinterpret_cast<float *>(imb_buffer));
       }
 #endif
-      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-      if (!test) {
-        layer_info.bw_read_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      } else {
-        layer_info.test_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      }
+      StopStage(test ? &layer_info.test_time : &layer_info.bw_read_time);
 
       if (print_) {
         vector<int>& bottom_imb_ids = this->net_->bottom_id_vecs_[layer_id];
@@ -1304,15 +2401,19 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         if (print_) {
           LOG(INFO) << "Backward calculation";
         }
-        tick_start = tbb::tick_count::now();
+        StartStage();
+        for (int i = 0; i < layer_info.layers_to_recompute.size(); i++) {
+          int recompute_id = layer_info.layers_to_recompute[i];
+          layers[recompute_id]->Forward(
+              bottom_vecs[recompute_id], top_vecs[recompute_id]);
+        }
         layer->Backward(top_vecs[layer_id], layer_info.bottom_need_backward,
             bottom_vecs[layer_id]);
-        CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-        layer_info.bw_compute_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
+        StopStage(&layer_info.bw_compute_time);
       }
 
-      tick_start = tbb::tick_count::now();
+      StartStage();
+      WaitForStream();
 #if defined(LOCAL_DATA_IN_PS)
       /* Release intermediate data blobs */
       if (print_) {
@@ -1326,6 +2427,8 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           LOG(INFO) << "Release data " << imb_info.global_imb_id;
         }
         shared_ptr<Blob<float> >& imb = imbs[imb_info.global_imb_id];
+        BindImbSlices(imbs, imb_data_slices_[imb_info.global_imb_id], false,
+            NULL);
         imb->gpu_data();
           /* Make sure everything is copied to GPU memory */
         imb->set_gpu_data(NULL, true);
@@ -1343,36 +2446,38 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
           LOG(INFO) << "Release diff " << imb_info.global_imb_id;
         }
         shared_ptr<Blob<float> >& imb = imbs[imb_info.global_imb_id];
+        BindImbSlices(imbs, imb_diff_slices_[imb_info.global_imb_id], true,
+            NULL);
         imb->gpu_diff();
           /* Make sure everything is copied to GPU memory */
         imb->set_gpu_diff(NULL, true);
         ps_->PostLocalAccess(handle);
       }
 #endif
-      CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-      if (!test) {
-        layer_info.bw_write_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      } else {
-        layer_info.test_time +=
-            (tbb::tick_count::now() - tick_start).seconds();
-      }
+      StopStage(test ? &layer_info.test_time : &layer_info.bw_write_time);
 
       if (layer_info.param_infos.size()) {
         // LOG(INFO) << "Finish writing";
-        tick_start = tbb::tick_count::now();
+        StartStage();
+        if (!test && layer_info.accum_row_ids.size() && !accumulate_only) {
+          /* Apply the mean gradient of the clock's batches, with one
+           * momentum step and one weight decay, as iter_size does */
+          caffe_gpu_scal<float>(layer_info.num_vals,
+              1.f / ps_config_.batches_per_clock, write_params_vals);
+        }
         for (int param_id = 0;
             param_id < layer_info.param_infos.size(); param_id++) {
           int global_param_id =
               layer_info.param_infos[param_id].global_param_id;
-          if (!test) {
+          if (!test && !accumulate_only) {
             /* Adjust gradient */
-            float learning_rate = GetLearningRate();
+            float staleness_scale = StalenessScale(
+                std::max(layer_info.fw_staleness, layer_info.bw_staleness));
+            float learning_rate = GetLearningRate() * staleness_scale;
+            momentum_scale_ =
+                ps_config_.staleness_momentum ? staleness_scale : 1;
             // Normalize(global_param_id);
-            Regularize(global_param_id);
-            // LOG(INFO) << "ComputeUpdateValue";
-            ComputeUpdateValue(global_param_id, learning_rate);
-            CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+            RegularizeAndComputeUpdateValue(global_param_id, learning_rate);
           }
           shared_ptr<Blob<float> >& param = layer->blobs()[param_id];
           param->gpu_diff();
@@ -1384,17 +2489,36 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
             /* Make sure everything is copied to GPU memory */
           param->set_gpu_diff(NULL, true);
         }
-        if (!test) {
-          layer_info.bw_compute_time +=
-              (tbb::tick_count::now() - tick_start).seconds();
-        } else {
-          layer_info.test_time +=
-              (tbb::tick_count::now() - tick_start).seconds();
+        if (!test && residual_vals && !accumulate_only) {
+          /* Compress the updates, keeping what is not sent
+           * in the residual for the next clocks */
+          if (!compression_scratch_.count()) {
+            compression_scratch_.Reshape(
+                vector<int>(1, COMPRESSION_SCRATCH_SIZE));
+          }
+          const float ratio = compress_update_gpu<float>(
+              layer_info.compression, layer_info.num_vals,
+              write_params_vals, residual_vals,
+              compression_scratch_.mutable_gpu_data(), sample_ps_stats_);
+          if (sample_ps_stats_) {
+            float residual_dot;
+            caffe_gpu_dot<float>(layer_info.num_vals,
+                residual_vals, residual_vals, &residual_dot);
+            layer_info.compression_ratio += ratio;
+            layer_info.residual_norm += sqrt(residual_dot);
+            layer_info.num_compressed_updates++;
+          }
         }
+        StopStage(test ? &layer_info.test_time : &layer_info.bw_compute_time);
 
-        tick_start = tbb::tick_count::now();
+        StartStage();
+        WaitForStream();
         /* Apply updates to PS */
-        ps_->Update(layer_handles.write_handle);
+        if (!accumulate_only) {
+          ps_->Update(layer_handles.write_handle);
+        } else {
+          ps_->PostLocalAccess(layer_handles.accum_postaccess_handle);
+        }
         /* Release read buffers */
         if (print_) {
           LOG(INFO) << "Release read buffers";
@@ -1406,31 +2530,157 @@ float SGDSolver<float>::ForwardBackwardUsingPs(
         }
         ps_->PostRead(layer_handles.bw_postread_handle);
         /* Release local updates history */
-        for (int param_id = 0;
-            param_id < layer_info.param_infos.size(); param_id++) {
-          int global_param_id =
-              layer_info.param_infos[param_id].global_param_id;
-          history_[global_param_id]->gpu_data();
+        for (int i = 0;
+            i < layer_info.param_infos.size() * num_history_slots_; i++) {
+          int slot = i / layer_info.param_infos.size();
+          int param_id = i % layer_info.param_infos.size();
+          int history_id = slot * net->params().size()
+              + layer_info.param_infos[param_id].global_param_id;
+          history_[history_id]->gpu_data();
             /* Make sure everything is copied to GPU memory */
-          history_[global_param_id]->set_gpu_data(NULL, true);
+          history_[history_id]->set_gpu_data(NULL, true);
         }
         ps_->PostLocalAccess(layer_handles.history_postaccess_handle);
-        CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
-        if (!test) {
-          layer_info.bw_write_time +=
-              (tbb::tick_count::now() - tick_start).seconds();
-        } else {
-          layer_info.test_time +=
-              (tbb::tick_count::now() - tick_start).seconds();
+        if (layer_info.residual_row_ids.size()) {
+          ps_->PostLocalAccess(layer_handles.residual_postaccess_handle);
         }
+        StopStage(test ? &layer_info.test_time : &layer_info.bw_write_time);
       }
     }
   }
   loss /= ps_config_.batches_per_clock;
-  ps_->Clock();
+  EndClock();
   return loss;
 }
 
+template <typename Dtype>
+void Solver<Dtype>::EndClock() {
+  const bool exchange_test_scores =
+      ps_config_.distributed_test && test_score_row_ids_.size();
+  if (exchange_test_scores) {
+    StartTestScoreExchange();
+  }
+  /* Collect the stage times of this clock */
+  WaitForStream();
+  if (exchange_test_scores) {
+    FinishTestScoreExchange();
+  }
+  ps_->Clock();
+  ps_clock_++;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::AccumulateTestOutputs(
+    const shared_ptr<Net<Dtype> >& test_net, Dtype batch_loss) {
+  const vector<Blob<Dtype>*>& result = test_net->net_output_blobs_;
+  int idx = 0;
+  for (int j = 0; j < result.size(); ++j) {
+    const Dtype* result_vec = result[j]->cpu_data();
+    for (int k = 0; k < result[j]->count(); ++k) {
+      if (num_test_batches_ == 0) {
+        test_scores_.push_back(result_vec[k]);
+      } else {
+        test_scores_[idx++] += result_vec[k];
+      }
+    }
+  }
+  test_loss_ += batch_loss;
+  num_test_batches_++;
+}
+
+template <typename Dtype>
+int Solver<Dtype>::UpdatesPerClock() const {
+  /* The update counter gets one update per worker per batch,
+   * or per clock when the gradients are accumulated */
+  return ps_config_.num_workers *
+      (ps_config_.accumulate_gradients ? 1 : ps_config_.batches_per_clock);
+}
+
+template <typename Dtype>
+float Solver<Dtype>::CountedUpdate(int batch_id) const {
+  /* A float counter that only ever grows stops counting at 2^24, so every
+   * worker takes its own count back by wrap updates each time it has sent
+   * that many. The counter then holds the number of updates modulo wrap,
+   * and its clock is exact modulo update_counter_period_. */
+  const int worker_updates = UpdatesPerClock() / ps_config_.num_workers;
+  const int wrap = update_counter_period_ * UpdatesPerClock();
+  const int update_id = ps_clock_ * worker_updates +
+      (ps_config_.accumulate_gradients ? 0 : batch_id);
+  return (update_id + 1) % wrap == 0 ? 1 - wrap : 1;
+}
+
+template <typename Dtype>
+int Solver<Dtype>::ReadStaleness(const float *params_vals,
+    const LayerInfo& layer_info, bool test) {
+  /* Without a staleness policy the staleness is only logged, so reading
+   * the counter, a round trip to the GPU, is left to the stats clocks */
+  if (ps_config_.staleness_policy == "none" && !sample_ps_stats_) {
+    return 0;
+  }
+  /* The counter is copied on its own stream, so that we do not wait for
+   * the work queued on the Caffe stream */
+  if (!counter_stream_) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(
+        &counter_stream_, cudaStreamNonBlocking));
+  }
+  float num_updates;
+  CUDA_CHECK(cudaMemcpyAsync(&num_updates, &params_vals[layer_info.num_vals],
+      sizeof(float), cudaMemcpyDefault, counter_stream_));
+  CUDA_CHECK(cudaStreamSynchronize(counter_stream_));
+  const int period = update_counter_period_;
+  const int data_clock =
+      static_cast<int>(num_updates + 0.5) / UpdatesPerClock() % period;
+  /* Data from workers that are ahead of us is not stale */
+  int staleness = ((ps_clock_ - data_clock) % period + period) % period;
+  if (staleness >= period / 2) {
+    staleness = 0;
+  }
+  if (!test) {
+    if (staleness >= staleness_counts_.size()) {
+      staleness_counts_.resize(staleness + 1, 0);
+    }
+    staleness_counts_[staleness]++;
+  }
+  return staleness;
+}
+
+template <typename Dtype>
+Dtype Solver<Dtype>::StalenessScale(int staleness) const {
+  const string& policy = ps_config_.staleness_policy;
+  if (policy == "none") {
+    return Dtype(1);
+  } else if (policy == "inverse") {
+    return Dtype(1) / (1 + staleness);
+  } else if (policy == "sqrt") {
+    return Dtype(1) / sqrt(Dtype(1 + staleness));
+  }
+  LOG(FATAL) << "Unknown staleness policy: " << policy;
+  return Dtype(1);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StartStage() {
+  stage_timer_->Start();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::StopStage(double *seconds) {
+  stage_timer_->Stop(seconds);
+  if (ps_config_.sync_mode == "stream") {
+    stage_timer_->Synchronize();
+  } else {
+    stage_timer_->Collect();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WaitForStream() {
+  /* GeePS gives no stream to wait on, so the host waits
+   * in both sync modes before a buffer is given back */
+  CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
+  stage_timer_->Collect();
+}
+
 template <typename Dtype>
 void Solver<Dtype>::InitSnapshot() {
   InitNetParameterSnapshot();
@@ -1464,11 +2714,36 @@ void Solver<double>::InitPs() {
   CHECK(0);
 }
 
+template <>
+void Solver<double>::PlanAccesses(vector<PlannedAccess> *plan) const {
+  CHECK(0);
+}
+
 template <>
 void SGDSolver<double>::InitPsValues() {
   CHECK(0);
 }
 
+template <>
+void Solver<double>::CheckTestReplay() {
+  CHECK(0);
+}
+
+template <>
+void Solver<double>::DrainClock() {
+  CHECK(0);
+}
+
+template <>
+void Solver<double>::StartTestScoreExchange() {
+  CHECK(0);
+}
+
+template <>
+void Solver<double>::FinishTestScoreExchange() {
+  CHECK(0);
+}
+
 template <>
 double SGDSolver<double>::ForwardBackwardUsingPs(
     const vector<Blob<double>* > & bottom,
@@ -1529,6 +2804,31 @@ void Solver<Dtype>::Step(int iters) {
       LOG(INFO) << "Test time: " << test_time;
       LOG(INFO) << "Snapshot time: " << snapshot_time;
       LOG(INFO) << "Total time: " << total_time;
+      for (int i = 0; i < layer_infos_.size(); i++) {
+        const LayerInfo& layer_info = layer_infos_[i];
+        if (!layer_info.num_compressed_updates) {
+          continue;
+        }
+        LOG(INFO) << "Layer " << this->net_->layer_names()[i]
+            << " encodable update size (sent dense): "
+            << layer_info.compression_ratio
+                / layer_info.num_compressed_updates
+            << ", residual norm: "
+            << layer_info.residual_norm / layer_info.num_compressed_updates;
+      }
+      int num_reads = 0;
+      for (int i = 0; i < staleness_counts_.size(); i++) {
+        num_reads += staleness_counts_[i];
+      }
+      /* Without a staleness policy, only the reads of the clocks
+       * before these logs are counted */
+      const string reads = ps_config_.staleness_policy == "none" ?
+          "Sampled reads " : "Reads ";
+      for (int i = 0; i < staleness_counts_.size(); i++) {
+        LOG(INFO) << reads << i << " clocks stale: "
+            << staleness_counts_[i] << " ("
+            << 100.0 * staleness_counts_[i] / num_reads << "%)";
+      }
       // LOG(INFO) << "Per layer forwardbackward times:";
       // for (int i = 0; i < layer_infos_.size(); i++) {
         // cerr << i << "," << layer_infos_[i].fw_read_time
@@ -1551,7 +2851,9 @@ void Solver<Dtype>::Step(int iters) {
     Dtype loss = 0;
     CHECK_EQ(param_.iter_size(), 1);
     bool test = false;
+    sample_ps_stats_ = (iter_ + 1) % 1000 == 0 || iter_ + 1 == stop_iter;
     loss = ForwardBackwardUsingPs(bottom_vec, this->net_, test, do_snapshot);
+    sample_ps_stats_ = false;
     CUDA_CHECK(cudaStreamSynchronize(Caffe::cuda_stream()));
     // average the loss across iterations for smoothed reporting
     if (losses.size() < average_loss) {
@@ -1599,6 +2901,14 @@ void Solver<Dtype>::Step(int iters) {
     // the number of times the weights have been updated.
     ++iter_;
   }
+  /* The global scores of the last tests are read slack + 1 clocks after
+   * they are sent. Every worker clocks on without training until they are
+   * logged; the workers agree on the number of clocks, as they test at the
+   * same iterations. */
+  while (ps_config_.distributed_test && test_score_row_ids_.size() &&
+      (test_score_report_clock_ >= 0 || test_score_update_.size())) {
+    DrainClock();
+  }
   string json_stats = ps_->GetStats();
   cerr << json_stats << endl;
 }
@@ -1654,40 +2964,59 @@ void Solver<Dtype>::Test(const int test_net_id) {
             << ", Testing net (#" << test_net_id << ")";
   CHECK_NOTNULL(test_nets_[test_net_id].get())->
       ShareTrainedLayersWith(net_.get());
-  vector<Dtype> test_score;
-  vector<int> test_score_output_id;
   vector<Blob<Dtype>*> bottom_vec;
   const shared_ptr<Net<Dtype> >& test_net = test_nets_[test_net_id];
-  Dtype loss = 0;
-  for (int i = 0; i < param_.test_iter(test_net_id); ++i) {
+  /* With distributed testing, every worker runs its share of test_iter
+   * on its own part of the test data */
+  int num_test_iters = param_.test_iter(test_net_id);
+  if (ps_config_.distributed_test) {
+    num_test_iters = (num_test_iters + ps_config_.num_workers - 1)
+        / ps_config_.num_workers;
+  }
+  /* Every test batch is one forward pass, outside of the clocks */
+  test_scores_.clear();
+  test_loss_ = 0;
+  num_test_batches_ = 0;
+  for (int i = 0; i < num_test_iters; ++i) {
     bool test = true;
     bool do_snapshot = false;
-    Dtype iter_loss =
-        ForwardBackwardUsingPs(bottom_vec, test_net, test, do_snapshot);
-    const vector<Blob<Dtype>*>& result = test_net->net_output_blobs_;
-    if (param_.test_compute_loss()) {
-      loss += iter_loss;
+    ForwardBackwardUsingPs(bottom_vec, test_net, test, do_snapshot);
+  }
+  LogTestScores(test_net_id, test_scores_, test_loss_, num_test_batches_);
+  if (ps_config_.distributed_test) {
+    /* Queue the sums to be added to the test score table */
+    if (test_score_update_.empty()) {
+      test_score_update_.assign(num_test_score_vals_, 0);
     }
-    if (i == 0) {
-      for (int j = 0; j < result.size(); ++j) {
-        const Dtype* result_vec = result[j]->cpu_data();
-        for (int k = 0; k < result[j]->count(); ++k) {
-          test_score.push_back(result_vec[k]);
-          test_score_output_id.push_back(j);
-        }
-      }
-    } else {
-      int idx = 0;
-      for (int j = 0; j < result.size(); ++j) {
-        const Dtype* result_vec = result[j]->cpu_data();
-        for (int k = 0; k < result[j]->count(); ++k) {
-          test_score[idx++] += result_vec[k];
-        }
-      }
+    float *vals = &test_score_update_[test_score_offsets_[test_net_id]];
+    vals[0] = num_test_batches_;
+    vals[1] = test_loss_;
+    for (int i = 0; i < test_scores_.size(); ++i) {
+      vals[2 + i] = test_scores_[i];
+    }
+    test_score_iter_ = iter_;
+    if (ps_config_.worker_id == 0) {
+      LOG(INFO) << "The global test scores of iteration " << iter_
+          << " are logged " << ps_config_.slack + 1
+          << " clocks after they are sent";
+    }
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::LogTestScores(const int test_net_id,
+    const vector<Dtype>& test_score, Dtype loss, int num_batches) {
+  const shared_ptr<Net<Dtype> >& test_net = test_nets_[test_net_id];
+  vector<int> test_score_output_id;
+  const vector<Blob<Dtype>*>& result = test_net->net_output_blobs_;
+  for (int j = 0; j < result.size(); ++j) {
+    for (int k = 0; k < result[j]->count(); ++k) {
+      test_score_output_id.push_back(j);
     }
   }
+  CHECK_EQ(test_score.size(), test_score_output_id.size());
   if (param_.test_compute_loss()) {
-    loss /= param_.test_iter(test_net_id);
+    loss /= num_batches;
     LOG(INFO) << "Test loss: " << loss;
   }
   for (int i = 0; i < test_score.size(); ++i) {
@@ -1696,7 +3025,7 @@ void Solver<Dtype>::Test(const int test_net_id) {
     const string& output_name = test_net->blob_names()[output_blob_index];
     const Dtype loss_weight = test_net->blob_loss_weights()[output_blob_index];
     ostringstream loss_msg_stream;
-    const Dtype mean_score = test_score[i] / param_.test_iter(test_net_id);
+    const Dtype mean_score = test_score[i] / num_batches;
     if (loss_weight) {
       loss_msg_stream << " (* " << loss_weight
                       << " = " << loss_weight * mean_score << " loss)";
@@ -1706,6 +3035,30 @@ void Solver<Dtype>::Test(const int test_net_id) {
   }
 }
 
+template <typename Dtype>
+void Solver<Dtype>::ReportTestScores(const vector<float>& score_sums) {
+  for (int test_net_id = 0; test_net_id < test_nets_.size(); ++test_net_id) {
+    const int offset = test_score_offsets_[test_net_id];
+    const int num_vals = (test_net_id + 1 < test_score_offsets_.size() ?
+        test_score_offsets_[test_net_id + 1] : num_test_score_vals_) - offset;
+    /* The table keeps the sums of all tests so far */
+    vector<Dtype> sums(num_vals);
+    for (int i = 0; i < num_vals; ++i) {
+      sums[i] = score_sums[offset + i] - test_score_reported_[offset + i];
+    }
+    const int num_batches = static_cast<int>(sums[0] + 0.5);
+    if (num_batches == 0) {
+      continue;
+    }
+    LOG(INFO) << "Global test net (#" << test_net_id << ") scores of "
+        << "iteration " << test_score_report_iter_ << ", logged at iteration "
+        << iter_ << ", " << num_batches << " batches from "
+        << ps_config_.num_workers << " workers";
+    vector<Dtype> test_score(sums.begin() + 2, sums.end());
+    LogTestScores(test_net_id, test_score, sums[1], num_batches);
+  }
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Snapshot() {
   CHECK(Caffe::root_solver());
@@ -1858,19 +3211,38 @@ void SGDSolver<Dtype>::PreSolve() {
   // Initialize the history
   const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
   history_.clear();
-  update_.clear();
-  temp_.clear();
+  int max_count = 0;
+  size_t param_size = 0;
   for (int i = 0; i < net_params.size(); ++i) {
     const vector<int>& shape = net_params[i]->shape();
+    /* The history data lives in the PS local store, so we don't allocate
+     * memory for it here. InitPsValues() zerofies it, unless it has been
+     * restored from a snapshot. */
     history_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
-    /* Allocate CPU memory and zerofy the data */
-    history_[history_.size()-1]->mutable_cpu_data();
-    update_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
-    update_[update_.size()-1]->mutable_cpu_data();
-    temp_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>(shape)));
-    temp_[temp_.size()-1]->mutable_cpu_data();
-  }
-  /* I assume the values will be zerofied on allocation (in SyncedMemory)*/
+    max_count = std::max(max_count, net_params[i]->count());
+    param_size += net_params[i]->count() * sizeof(Dtype);
+  }
+  /* The scratch buffers start at the largest parameter size,
+   * so that reshaping them to any parameter does not reallocate */
+  update_.reset(new Blob<Dtype>(vector<int>(1, max_count)));
+  temp_.reset(new Blob<Dtype>(vector<int>(1, max_count)));
+  const double mb = 1024.0 * 1024.0;
+  LOG(INFO) << "Solver memory: parameters " << param_size / mb
+      << " MB, solver state " << this->num_history_slots_ * param_size / mb
+      << " MB in the PS local store, scratch buffers up to "
+      << 2 * max_count * sizeof(Dtype) / mb << " MB on first use";
+}
+
+template <typename Dtype>
+Blob<Dtype>* SGDSolver<Dtype>::update_buffer(int param_id) {
+  update_->Reshape(this->net_->params()[param_id]->shape());
+  return update_.get();
+}
+
+template <typename Dtype>
+Blob<Dtype>* SGDSolver<Dtype>::temp_buffer(int param_id) {
+  temp_->Reshape(this->net_->params()[param_id]->shape());
+  return temp_.get();
 }
 
 template <typename Dtype>
@@ -1944,10 +3316,10 @@ void SGDSolver<Dtype>::Regularize(int param_id) {
       } else if (regularization_type == "L1") {
         caffe_cpu_sign(net_params[param_id]->count(),
             net_params[param_id]->cpu_data(),
-            temp_[param_id]->mutable_cpu_data());
+            temp_buffer(param_id)->mutable_cpu_data());
         caffe_axpy(net_params[param_id]->count(),
             local_decay,
-            temp_[param_id]->cpu_data(),
+            temp_buffer(param_id)->cpu_data(),
             net_params[param_id]->mutable_cpu_diff());
       } else {
         LOG(FATAL) << "Unknown regularization type: " << regularization_type;
@@ -1968,10 +3340,10 @@ void SGDSolver<Dtype>::Regularize(int param_id) {
         CHECK(0);
         caffe_gpu_sign(net_params[param_id]->count(),
             net_params[param_id]->gpu_data(),
-            temp_[param_id]->mutable_gpu_data());
+            temp_buffer(param_id)->mutable_gpu_data());
         caffe_gpu_axpy(net_params[param_id]->count(),
             local_decay,
-            temp_[param_id]->gpu_data(),
+            temp_buffer(param_id)->gpu_data(),
             net_params[param_id]->mutable_gpu_diff());
       } else {
         LOG(FATAL) << "Unknown regularization type: " << regularization_type;
@@ -1991,7 +3363,7 @@ template <typename Dtype>
 void SGDSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
   const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
   const vector<float>& net_params_lr = this->net_->params_lr();
-  Dtype momentum = this->param_.momentum();
+  Dtype momentum = this->param_.momentum() * this->momentum_scale_;
   // Cui: I made the local learning rate negative, so that the updates will be
   // added to the parameter data instead of subtracted
   // Dtype local_rate = rate * net_params_lr[param_id];
@@ -2026,6 +3398,89 @@ void SGDSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
 }
 
 
+template <typename Dtype>
+void sgd_fused_update_cpu(int N, const Dtype* w, Dtype* g, Dtype* h,
+    Dtype momentum, Dtype local_rate, Dtype l2_decay, Dtype l1_decay,
+    bool nesterov) {
+#ifdef USE_OPENMP
+#pragma omp parallel for simd
+#endif
+  for (int i = 0; i < N; ++i) {
+    const Dtype wi = w[i];
+    const Dtype gi = g[i] + l2_decay * wi
+        + l1_decay * ((Dtype(0) < wi) - (wi < Dtype(0)));
+    const Dtype hi = h[i];
+    const Dtype hi_new = h[i] = momentum * hi + local_rate * gi;
+    g[i] = nesterov ? (1 + momentum) * hi_new - momentum * hi : hi_new;
+  }
+}
+
+#ifndef CPU_ONLY
+template <typename Dtype>
+void sgd_fused_update_gpu(int N, const Dtype* w, Dtype* g, Dtype* h,
+    Dtype momentum, Dtype local_rate, Dtype l2_decay, Dtype l1_decay,
+    bool nesterov);
+#endif
+
+template <typename Dtype>
+void SGDSolver<Dtype>::RegularizeAndComputeUpdateValue(
+    int param_id, Dtype rate) {
+  if (fused_update()) {
+    FusedUpdateValue(param_id, rate, false);
+    return;
+  }
+  /* The other solvers keep their own update rules */
+  Regularize(param_id);
+  ComputeUpdateValue(param_id, rate);
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdateValue(
+    int param_id, Dtype rate, bool nesterov) {
+  const vector<shared_ptr<Blob<Dtype> > >& net_params = this->net_->params();
+  const vector<float>& net_params_lr = this->net_->params_lr();
+  const vector<float>& net_params_weight_decay =
+      this->net_->params_weight_decay();
+  Dtype momentum = this->param_.momentum() * this->momentum_scale_;
+  Dtype local_rate = -rate * net_params_lr[param_id];
+  Dtype local_decay =
+      this->param_.weight_decay() * net_params_weight_decay[param_id];
+  string regularization_type = this->param_.regularization_type();
+  Dtype l2_decay = 0;
+  Dtype l1_decay = 0;
+  if (regularization_type == "L2") {
+    l2_decay = local_decay;
+  } else if (regularization_type == "L1") {
+    l1_decay = local_decay;
+  } else {
+    LOG(FATAL) << "Unknown regularization type: " << regularization_type;
+  }
+  // Decay, momentum and the copy to the diff in one pass,
+  // reading the data, diff and history once.
+  Blob<Dtype>* param = net_params[param_id].get();
+  switch (Caffe::mode()) {
+  case Caffe::CPU: {
+    sgd_fused_update_cpu(param->count(), param->cpu_data(),
+        param->mutable_cpu_diff(), history_[param_id]->mutable_cpu_data(),
+        momentum, local_rate, l2_decay, l1_decay, nesterov);
+    break;
+  }
+  case Caffe::GPU: {
+#ifndef CPU_ONLY
+    sgd_fused_update_gpu(param->count(), param->gpu_data(),
+        param->mutable_gpu_diff(), history_[param_id]->mutable_gpu_data(),
+        momentum, local_rate, l2_decay, l1_decay, nesterov);
+#else
+    NO_GPU;
+#endif
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+  }
+}
+
+
 template <typename Dtype>
 void SGDSolver<Dtype>::SnapshotSolverState(const string& model_filename) {
   switch (this->param_.snapshot_format()) {
@@ -2063,6 +3518,7 @@ void SGDSolver<Dtype>::SnapshotSolverStateToHDF5(
   string snapshot_filename =
       Solver<Dtype>::SnapshotFilename(".solverstate.h5");
   LOG(INFO) << "Snapshotting solver state to HDF5 file " << snapshot_filename;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fcreate(snapshot_filename.c_str(), H5F_ACC_TRUNC,
       H5P_DEFAULT, H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
@@ -2112,6 +3568,7 @@ void SGDSolver<Dtype>::RestoreSolverStateFromBinaryProto(
 template <typename Dtype>
 void SGDSolver<Dtype>::RestoreSolverStateFromHDF5(const string& state_file) {
   CHECK(0);
+  boost::mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fopen(state_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
   CHECK_GE(file_hid, 0) << "Couldn't open solver state file " << state_file;
   this->iter_ = hdf5_load_int(file_hid, "iter");
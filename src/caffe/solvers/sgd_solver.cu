@@ -22,4 +22,33 @@ void sgd_update_gpu(int N, Dtype* g, Dtype* h, Dtype momentum,
 template void sgd_update_gpu<float>(int, float*, float*, float, float);
 template void sgd_update_gpu<double>(int, double*, double*, double, double);
 
+template <typename Dtype>
+__global__ void SGDFusedUpdate(int N, const Dtype* w, Dtype* g, Dtype* h,
+    Dtype momentum, Dtype local_rate, Dtype l2_decay, Dtype l1_decay,
+    bool nesterov) {
+  CUDA_KERNEL_LOOP(i, N) {
+    const Dtype wi = w[i];
+    const Dtype gi = g[i] + l2_decay * wi
+        + l1_decay * ((Dtype(0) < wi) - (wi < Dtype(0)));
+    const Dtype hi = h[i];
+    const Dtype hi_new = h[i] = momentum * hi + local_rate * gi;
+    g[i] = nesterov ? (1 + momentum) * hi_new - momentum * hi : hi_new;
+  }
+}
+template <typename Dtype>
+void sgd_fused_update_gpu(int N, const Dtype* w, Dtype* g, Dtype* h,
+    Dtype momentum, Dtype local_rate, Dtype l2_decay, Dtype l1_decay,
+    bool nesterov) {
+  /* The caller synchronizes the stream */
+  SGDFusedUpdate<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+      <<<CAFFE_GET_BLOCKS(N), CAFFE_CUDA_NUM_THREADS,
+         0, Caffe::cuda_stream()>>>(
+      N, w, g, h, momentum, local_rate, l2_decay, l1_decay, nesterov);
+  CUDA_POST_KERNEL_CHECK;
+}
+template void sgd_fused_update_gpu<float>(int, const float*, float*, float*,
+    float, float, float, float, bool);
+template void sgd_fused_update_gpu<double>(int, const double*, double*,
+    double*, double, double, double, double, bool);
+
 }  // namespace caffe
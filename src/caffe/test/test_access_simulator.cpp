@@ -0,0 +1,111 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/access_simulator.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class AccessSimulatorTest : public ::testing::Test {
+ protected:
+  /* Two layers: "a" writes a kept activation that "b" reads, the weights
+   * of both are kept across clocks, and "b" uses a scratch buffer. */
+  virtual void SetUp() {
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "w_a", 100, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "act", 50, false));
+    plan_.push_back(PlannedAccess(PlannedAccess::COMPUTE, "a"));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "w_a", 100, false, true));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "act", 50, false, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "w_b", 200, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "act", 50, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "tmp", 20, false));
+    plan_.push_back(PlannedAccess(PlannedAccess::COMPUTE, "b"));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "tmp", 20, false, false));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "act", 50, false, false));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "w_b", 200, false, true));
+  }
+
+  /* The end of a clock as the solver plans it: the test scores are read
+   * and updated, and a test pass runs both layers forward again. */
+  void AppendTestAccesses() {
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::ACCESS, "scores:read", 30, true));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::ACCESS, "scores:update", 30, false));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "scores:read", 30, false, true));
+    plan_.push_back(PlannedAccess(
+        PlannedAccess::RELEASE, "scores:update", 30, false, false));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "w_a", 100, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "act", 50, false));
+    plan_.push_back(PlannedAccess(PlannedAccess::COMPUTE, "a:test"));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "w_a", 100, false, true));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "act", 50, false, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "w_b", 200, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::ACCESS, "act", 50, true));
+    plan_.push_back(PlannedAccess(PlannedAccess::COMPUTE, "b:test"));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "w_b", 200, false, true));
+    plan_.push_back(
+        PlannedAccess(PlannedAccess::RELEASE, "act", 50, false, false));
+  }
+
+  std::vector<PlannedAccess> plan_;
+};
+
+TEST_F(AccessSimulatorTest, TestFits) {
+  AccessPlanStats stats;
+  SimulateAccessPlan(plan_, 1000, &stats);
+  EXPECT_EQ(stats.peak_live_bytes, 270);
+  EXPECT_EQ(stats.peak_resident_bytes, 370);
+  EXPECT_EQ(stats.swap_in_bytes, 0);
+  EXPECT_EQ(stats.swap_out_bytes, 0);
+  ASSERT_EQ(stats.compute_names.size(), 2);
+  EXPECT_EQ(stats.compute_names[0], "a");
+  EXPECT_EQ(stats.compute_live_bytes[0], 150);
+  EXPECT_EQ(stats.compute_names[1], "b");
+  EXPECT_EQ(stats.compute_live_bytes[1], 270);
+}
+
+TEST_F(AccessSimulatorTest, TestSwaps) {
+  AccessPlanStats stats;
+  SimulateAccessPlan(plan_, 300, &stats);
+  EXPECT_EQ(stats.peak_live_bytes, 270);
+  EXPECT_LE(stats.peak_resident_bytes, 300);
+  /* Layer "b" only fits by evicting the weights of "a", which are read
+   * back at the next clock, and the weights of "b" are evicted for them */
+  EXPECT_EQ(stats.swap_out_bytes, 300);
+  EXPECT_EQ(stats.swap_in_bytes, 300);
+  /* The test pass reads both weights again, and the test scores are
+   * evicted for them and read back at the next clock */
+  AppendTestAccesses();
+  SimulateAccessPlan(plan_, 300, &stats);
+  EXPECT_EQ(stats.peak_live_bytes, 270);
+  EXPECT_LE(stats.peak_resident_bytes, 300);
+  EXPECT_EQ(stats.swap_out_bytes, 630);
+  EXPECT_EQ(stats.swap_in_bytes, 630);
+  ASSERT_EQ(stats.compute_names.size(), 4);
+  EXPECT_EQ(stats.compute_names[3], "b:test");
+}
+
+TEST_F(AccessSimulatorTest, TestUnkeptBuffersAreNotSwapped) {
+  for (int i = 0; i < plan_.size(); ++i) {
+    plan_[i].fetch = false;
+  }
+  AccessPlanStats stats;
+  SimulateAccessPlan(plan_, 300, &stats);
+  EXPECT_EQ(stats.swap_out_bytes, 0);
+  EXPECT_EQ(stats.swap_in_bytes, 0);
+}
+
+}  // namespace caffe
@@ -7,6 +7,7 @@
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/layers/accuracy_layer.hpp"
+#include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -246,6 +247,27 @@ TYPED_TEST(AccuracyLayerTest, TestForwardCPUTopK) {
               num_correct_labels / 100.0, 1e-4);
 }
 
+TYPED_TEST(AccuracyLayerTest, TestForwardCPUTopKTies) {
+  LayerParameter layer_param;
+  AccuracyParameter* accuracy_param = layer_param.mutable_accuracy_param();
+  accuracy_param->set_top_k(2);
+  AccuracyLayer<TypeParam> layer(layer_param);
+  // Every score is equal, so ties are broken towards the higher class index:
+  // only labels 8 and 9 are within the top 2.
+  caffe_set(this->blob_bottom_data_->count(), TypeParam(1),
+      this->blob_bottom_data_->mutable_cpu_data());
+  int num_correct_labels = 0;
+  for (int i = 0; i < 100; ++i) {
+    if (this->blob_bottom_label_->data_at(i, 0, 0, 0) >= 8) {
+      ++num_correct_labels;
+    }
+  }
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_NEAR(this->blob_top_->data_at(0, 0, 0, 0),
+              num_correct_labels / 100.0, 1e-4);
+}
+
 TYPED_TEST(AccuracyLayerTest, TestForwardCPUPerClass) {
   LayerParameter layer_param;
   AccuracyLayer<TypeParam> layer(layer_param);
@@ -87,4 +87,25 @@ TYPED_TEST(BenchmarkTest, TestTimerSeconds) {
   EXPECT_TRUE(timer.has_run_at_least_once());
 }
 
+TYPED_TEST(BenchmarkTest, TestStreamStageTimer) {
+  StreamStageTimer timer;
+  double first = 0;
+  double second = 0;
+  timer.Start();
+  boost::this_thread::sleep(boost::posix_time::milliseconds(300));
+  timer.Stop(&first);
+  timer.Start();
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  timer.Stop(&second);
+  timer.Start();
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  timer.Stop(&second);
+  timer.Synchronize();
+  EXPECT_EQ(timer.num_pending(), 0);
+  EXPECT_GE(first, 0.3 - kMillisecondsThreshold / 1000.);
+  EXPECT_LE(first, 0.3 + kMillisecondsThreshold / 1000.);
+  EXPECT_GE(second, 0.2 - 2 * kMillisecondsThreshold / 1000.);
+  EXPECT_LE(second, 0.2 + 2 * kMillisecondsThreshold / 1000.);
+}
+
 }  // namespace caffe
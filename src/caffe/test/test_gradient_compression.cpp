@@ -0,0 +1,169 @@
+#include <cmath>  // for std::fabs
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/gradient_compression.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class GradientCompressionTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  GradientCompressionTest()
+      : blob_update_(new Blob<Dtype>(2, 3, 40, 50)),
+        blob_residual_(new Blob<Dtype>(2, 3, 40, 50)),
+        blob_total_(new Blob<Dtype>(2, 3, 40, 50)),
+        blob_scratch_(new Blob<Dtype>(
+            vector<int>(1, COMPRESSION_SCRATCH_SIZE))) {
+  }
+
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_update_);
+    filler_param.set_std(0.1);
+    GaussianFiller<Dtype> residual_filler(filler_param);
+    residual_filler.Fill(this->blob_residual_);
+    caffe_add(blob_total_->count(), blob_update_->cpu_data(),
+        blob_residual_->cpu_data(), blob_total_->mutable_cpu_data());
+  }
+
+  virtual ~GradientCompressionTest() {
+    delete blob_update_;
+    delete blob_residual_;
+    delete blob_total_;
+    delete blob_scratch_;
+  }
+
+  Dtype Compress(const CompressionConfig& config) {
+    const int n = blob_update_->count();
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      return compress_update_cpu<Dtype>(config, n,
+          blob_update_->mutable_cpu_data(),
+          blob_residual_->mutable_cpu_data());
+#ifndef CPU_ONLY
+    case Caffe::GPU:
+      return compress_update_gpu<Dtype>(config, n,
+          blob_update_->mutable_gpu_data(),
+          blob_residual_->mutable_gpu_data(),
+          blob_scratch_->mutable_gpu_data());
+#endif
+    default:
+      LOG(FATAL) << "Unknown mode";
+    }
+    return 0;
+  }
+
+  // Error feedback: the values sent plus the new residual must add up to
+  // the update plus the old residual.
+  void CheckFeedback() {
+    const Dtype* update = blob_update_->cpu_data();
+    const Dtype* residual = blob_residual_->cpu_data();
+    const Dtype* total = blob_total_->cpu_data();
+    for (int i = 0; i < blob_total_->count(); ++i) {
+      EXPECT_NEAR(update[i] + residual[i], total[i], 1e-5);
+    }
+  }
+
+  Blob<Dtype>* const blob_update_;
+  Blob<Dtype>* const blob_residual_;
+  Blob<Dtype>* const blob_total_;
+  Blob<Dtype>* const blob_scratch_;
+};
+
+TYPED_TEST_CASE(GradientCompressionTest, TestDtypesAndDevices);
+
+TYPED_TEST(GradientCompressionTest, TestThreshold) {
+  typedef typename TypeParam::Dtype Dtype;
+  CompressionConfig config = ParseCompressionConfig("threshold:1.5");
+  Dtype ratio = this->Compress(config);
+  this->CheckFeedback();
+  const Dtype* update = this->blob_update_->cpu_data();
+  const Dtype* total = this->blob_total_->cpu_data();
+  int num_sent = 0;
+  for (int i = 0; i < this->blob_update_->count(); ++i) {
+    if (std::fabs(total[i]) >= 1.5) {
+      EXPECT_EQ(update[i], total[i]);
+      ++num_sent;
+    } else {
+      EXPECT_EQ(update[i], 0);
+    }
+  }
+  EXPECT_NEAR(ratio, Dtype(2) * num_sent / this->blob_update_->count(),
+      1e-5);
+}
+
+TYPED_TEST(GradientCompressionTest, TestTopK) {
+  typedef typename TypeParam::Dtype Dtype;
+  CompressionConfig config = ParseCompressionConfig("topk:0.05");
+  Dtype ratio = this->Compress(config);
+  this->CheckFeedback();
+  const int n = this->blob_update_->count();
+  const Dtype* update = this->blob_update_->cpu_data();
+  Dtype min_sent = 0;
+  Dtype max_kept = 0;
+  int num_sent = 0;
+  for (int i = 0; i < n; ++i) {
+    const Dtype abs_total = std::fabs(this->blob_total_->cpu_data()[i]);
+    if (update[i] != 0) {
+      min_sent = num_sent++ ? std::min(min_sent, abs_total) : abs_total;
+    } else {
+      max_kept = std::max(max_kept, abs_total);
+    }
+  }
+  // The largest values are sent, and the sampled threshold keeps
+  // the number sent near the requested ratio.
+  EXPECT_GE(min_sent, max_kept);
+  EXPECT_NEAR(static_cast<Dtype>(num_sent) / n, 0.05, 0.02);
+  EXPECT_NEAR(ratio, Dtype(2) * num_sent / n, 1e-5);
+}
+
+TYPED_TEST(GradientCompressionTest, TestInt8) {
+  typedef typename TypeParam::Dtype Dtype;
+  CompressionConfig config = ParseCompressionConfig("int8");
+  Dtype ratio = this->Compress(config);
+  this->CheckFeedback();
+  const int n = this->blob_update_->count();
+  Dtype scale = 0;
+  for (int i = 0; i < n; ++i) {
+    scale = std::max(scale, std::fabs(this->blob_total_->cpu_data()[i]));
+  }
+  scale /= 127;
+  const Dtype* update = this->blob_update_->cpu_data();
+  const Dtype* residual = this->blob_residual_->cpu_data();
+  for (int i = 0; i < n; ++i) {
+    const Dtype level = update[i] / scale;
+    EXPECT_NEAR(level, floor(level + 0.5), 1e-3);
+    EXPECT_LE(std::fabs(level), 127 + 1e-3);
+    EXPECT_LE(std::fabs(residual[i]), scale / 2 + 1e-5);
+  }
+  EXPECT_EQ(ratio, Dtype(0.25));
+}
+
+TYPED_TEST(GradientCompressionTest, TestSign) {
+  typedef typename TypeParam::Dtype Dtype;
+  CompressionConfig config = ParseCompressionConfig("sign");
+  Dtype ratio = this->Compress(config);
+  this->CheckFeedback();
+  const int n = this->blob_update_->count();
+  const Dtype scale = caffe_cpu_asum(n, this->blob_total_->cpu_data()) / n;
+  const Dtype* update = this->blob_update_->cpu_data();
+  const Dtype* total = this->blob_total_->cpu_data();
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(update[i], total[i] >= 0 ? scale : -scale, 1e-4);
+  }
+  EXPECT_EQ(ratio, Dtype(1) / 32);
+}
+
+}  // namespace caffe
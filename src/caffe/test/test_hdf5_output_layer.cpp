@@ -118,4 +118,57 @@ TYPED_TEST(HDF5OutputLayerTest, TestForward) {
       this->output_file_name_;
 }
 
+TYPED_TEST(HDF5OutputLayerTest, TestForwardAppends) {
+  typedef typename TypeParam::Dtype Dtype;
+  hid_t file_id = H5Fopen(this->input_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->input_file_name_;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4,
+                       this->blob_data_);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4,
+                       this->blob_label_);
+  EXPECT_GE(H5Fclose(file_id), 0);
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+
+  // More batches than the queue holds, all flushed by the destructor.
+  const int kBatches = 3;
+  LayerParameter param;
+  param.mutable_hdf5_output_param()->set_file_name(this->output_file_name_);
+  param.mutable_hdf5_output_param()->set_queue_size(2);
+  {
+    HDF5OutputLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < kBatches; ++i) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    }
+  }
+  file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                    H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  Blob<Dtype> blob_data;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  Blob<Dtype> blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  EXPECT_GE(H5Fclose(file_id), 0);
+
+  const int num = this->blob_data_->num();
+  ASSERT_EQ(blob_data.num(), kBatches * num);
+  ASSERT_EQ(blob_label.num(), kBatches * num);
+  const int data_dim = this->blob_data_->count(1);
+  const int label_dim = this->blob_label_->count(1);
+  for (int i = 0; i < kBatches * num; ++i) {
+    for (int j = 0; j < data_dim; ++j) {
+      EXPECT_EQ(this->blob_data_->cpu_data()[(i % num) * data_dim + j],
+          blob_data.cpu_data()[i * data_dim + j]);
+    }
+    for (int j = 0; j < label_dim; ++j) {
+      EXPECT_EQ(this->blob_label_->cpu_data()[(i % num) * label_dim + j],
+          blob_label.cpu_data()[i * label_dim + j]);
+    }
+  }
+}
+
 }  // namespace caffe
@@ -133,4 +133,40 @@ TYPED_TEST(HDF5DataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(HDF5DataLayerTest, TestShuffleWindow) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+  param.add_top("label2");
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  const int batch_size = 5;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_source(*(this->filename));
+  hdf5_data_param->set_shuffle(true);
+  hdf5_data_param->set_shuffle_window(4);
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+
+  // One epoch reads each of the 10 rows of both files once, and the rows
+  // of all tops stay together.
+  const int data_size = 8 * 6 * 5;
+  vector<int> label_counts(10, 0);
+  for (int iter = 0; iter < 4; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < batch_size; ++i) {
+      const int label = this->blob_top_label_->cpu_data()[i];
+      ASSERT_GE(label, 1);
+      ASSERT_LE(label, 10);
+      ++label_counts[label - 1];
+      EXPECT_EQ(label + 1, this->blob_top_label2_->cpu_data()[i]);
+      const int first = this->blob_top_data_->cpu_data()[i * data_size];
+      EXPECT_EQ((label - 1) * data_size, first % 2400);
+    }
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(2, label_counts[i]);
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,149 @@
+#include <boost/thread.hpp>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/inference_nets.hpp"
+#include "caffe/net.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+static void FillInput(Net<Dtype>* net, int seed) {
+  Blob<Dtype>* input = net->input_blobs()[0];
+  Dtype* data = input->mutable_cpu_data();
+  for (int i = 0; i < input->count(); ++i) {
+    data[i] = Dtype((i * 7 + seed * 13) % 11) / 11 - 0.5;
+  }
+}
+
+template <typename Dtype>
+static void RunContext(Net<Dtype>* net, int seed, int iterations,
+    vector<Dtype>* output) {
+  for (int i = 0; i < iterations; ++i) {
+    FillInput(net, seed + i);
+    const Blob<Dtype>* prob = net->ForwardPrefilled()[0];
+    output->insert(output->end(), prob->cpu_data(),
+        prob->cpu_data() + prob->count());
+  }
+}
+
+template <typename Dtype>
+class InferenceNetsTest : public CPUDeviceTest<Dtype> {
+ protected:
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    const string proto =
+        "name: 'InferenceNetwork' "
+        "input: 'data' "
+        "input_dim: 4 "
+        "input_dim: 6 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { "
+        "  name: 'ip1' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'data' "
+        "  top: 'ip1' "
+        "  inner_product_param { "
+        "    num_output: 8 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'relu' "
+        "  type: 'ReLU' "
+        "  bottom: 'ip1' "
+        "  top: 'ip1' "
+        "} "
+        "layer { "
+        "  name: 'ip2' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'ip1' "
+        "  top: 'ip2' "
+        "  inner_product_param { "
+        "    num_output: 8 "
+        "    weight_filler { type: 'gaussian' std: 0.5 } "
+        "    bias_filler { type: 'gaussian' std: 0.5 } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'prob' "
+        "  type: 'Sigmoid' "
+        "  bottom: 'ip2' "
+        "  top: 'prob' "
+        "} ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param_));
+  }
+
+  NetParameter param_;
+};
+
+TYPED_TEST_CASE(InferenceNetsTest, TestDtypes);
+
+TYPED_TEST(InferenceNetsTest, TestSharedWeights) {
+  InferenceNets<TypeParam> nets(this->param_, "", 3);
+  ASSERT_EQ(nets.num_contexts(), 3);
+  const vector<shared_ptr<Blob<TypeParam> > >& params =
+      nets.context(0)->params();
+  for (int i = 1; i < nets.num_contexts(); ++i) {
+    ASSERT_EQ(nets.context(i)->params().size(), params.size());
+    for (int j = 0; j < params.size(); ++j) {
+      EXPECT_EQ(nets.context(i)->params()[j]->cpu_data(),
+          params[j]->cpu_data());
+    }
+    EXPECT_NE(nets.context(i)->input_blobs()[0]->cpu_data(),
+        nets.context(0)->input_blobs()[0]->cpu_data());
+  }
+}
+
+TYPED_TEST(InferenceNetsTest, TestArena) {
+  InferenceNets<TypeParam> nets(this->param_, "", 1);
+  // 'data' and 'ip2' are never live at once, nor are 'ip1' and 'prob', so
+  // the four blobs of 32 values take the room of two.
+  EXPECT_EQ(nets.activation_bytes(), 4 * 32 * sizeof(TypeParam));
+  EXPECT_EQ(nets.arena_bytes(), 2 * 32 * sizeof(TypeParam));
+  Net<TypeParam> plain(this->param_);
+  plain.ShareTrainedLayersWith(nets.context(0));
+  vector<TypeParam> expected;
+  vector<TypeParam> output;
+  RunContext(&plain, 0, 3, &expected);
+  RunContext(nets.context(0), 0, 3, &output);
+  ASSERT_EQ(output.size(), expected.size());
+  for (int i = 0; i < output.size(); ++i) {
+    EXPECT_EQ(output[i], expected[i]);
+  }
+}
+
+TYPED_TEST(InferenceNetsTest, TestConcurrentContexts) {
+  const int kContexts = 4;
+  const int kIterations = 20;
+  InferenceNets<TypeParam> nets(this->param_, "", kContexts);
+  vector<vector<TypeParam> > expected(kContexts);
+  for (int i = 0; i < kContexts; ++i) {
+    RunContext(nets.context(0), i * kIterations, kIterations, &expected[i]);
+  }
+  vector<vector<TypeParam> > outputs(kContexts);
+  boost::thread_group threads;
+  for (int i = 0; i < kContexts; ++i) {
+    threads.create_thread(boost::bind(&RunContext<TypeParam>,
+        nets.context(i), i * kIterations, kIterations, &outputs[i]));
+  }
+  threads.join_all();
+  for (int i = 0; i < kContexts; ++i) {
+    ASSERT_EQ(outputs[i].size(), expected[i].size());
+    for (int j = 0; j < outputs[i].size(); ++j) {
+      EXPECT_EQ(outputs[i][j], expected[i][j]);
+    }
+  }
+}
+
+}  // namespace caffe
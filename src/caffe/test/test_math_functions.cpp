@@ -119,6 +119,31 @@ TYPED_TEST(CPUMathFunctionsTest, TestCopy) {
   }
 }
 
+TYPED_TEST(CPUMathFunctionsTest, TestHalfRoundTrip) {
+  const int n = this->blob_bottom_->count();
+  const TypeParam* x = this->blob_bottom_->cpu_data();
+  vector<float> values(x, x + n);
+  vector<uint16_t> halves(n);
+  vector<float> restored(n);
+  caffe_cpu_float2half(n, &values[0], &halves[0]);
+  caffe_cpu_half2float(n, &halves[0], &restored[0]);
+  for (int i = 0; i < n; ++i) {
+    // 11 significant bits, plus the subnormal spacing near zero.
+    EXPECT_NEAR(restored[i], values[i], std::fabs(values[i]) / 2048 + 3e-8);
+  }
+  // Values that are exactly representable survive unchanged, and values
+  // beyond the half range saturate to infinity.
+  const float exact[] = {0.f, 1.f, -2.f, 0.099975586f, 65504.f,
+                         6.1035156e-05f, 5.9604645e-08f, -65520.f};
+  const int num_exact = sizeof(exact) / sizeof(exact[0]);
+  caffe_cpu_float2half(num_exact, exact, &halves[0]);
+  caffe_cpu_half2float(num_exact, &halves[0], &restored[0]);
+  for (int i = 0; i < num_exact - 1; ++i) {
+    EXPECT_EQ(restored[i], exact[i]);
+  }
+  EXPECT_EQ(halves[num_exact - 1], 0xfc00);
+}
+
 #ifndef CPU_ONLY
 
 template <typename Dtype>
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -2379,4 +2380,327 @@ TYPED_TEST(NetTest, TestSkipPropagateDown) {
   }
 }
 
+TYPED_TEST(NetTest, TestConcatBlobSlices) {
+  const string& proto_prefix =
+      "name: 'ConcatNetwork' "
+      "force_backward: true "
+      "input: 'data' "
+      "input_dim: ";
+  const string& proto_suffix =
+      "input_dim: 3 "
+      "input_dim: 4 "
+      "input_dim: 4 "
+      "layer { "
+      "  name: 'left' "
+      "  type: 'Convolution' "
+      "  convolution_param { num_output: 3 kernel_size: 1 } "
+      "  bottom: 'data' "
+      "  top: 'left' "
+      "} "
+      "layer { "
+      "  name: 'left_relu' "
+      "  type: 'ReLU' "
+      "  bottom: 'left' "
+      "  top: 'left' "
+      "} "
+      "layer { "
+      "  name: 'right' "
+      "  type: 'Convolution' "
+      "  convolution_param { num_output: 3 kernel_size: 1 } "
+      "  bottom: 'data' "
+      "  top: 'right' "
+      "} "
+      "layer { "
+      "  name: 'right_relu' "
+      "  type: 'ReLU' "
+      "  bottom: 'right' "
+      "  top: 'right' "
+      "} "
+      "layer { "
+      "  name: 'concat' "
+      "  type: 'Concat' "
+      "  bottom: 'left' "
+      "  bottom: 'right' "
+      "  top: 'concat' "
+      "} ";
+  // With a single image, each bottom is a contiguous slice of the top. The
+  // in-place ReLUs are part of the producers, not other readers.
+  this->InitNetFromProtoString(proto_prefix + "1 " + proto_suffix);
+  const vector<BlobSlice>& slices = this->net_->blob_slices();
+  ASSERT_EQ(2, slices.size());
+  const int concat_id = this->net_->blob_names_index_["concat"];
+  EXPECT_EQ(this->net_->blob_names_index_["left"], slices[0].blob_id);
+  EXPECT_EQ(this->net_->blob_names_index_["right"], slices[1].blob_id);
+  for (int i = 0; i < slices.size(); ++i) {
+    EXPECT_EQ(concat_id, slices[i].base_id);
+    EXPECT_EQ(48 * i, slices[i].offset);
+    EXPECT_TRUE(slices[i].data);
+    EXPECT_TRUE(slices[i].diff);
+  }
+  // With more images, they would be strided, so the layer keeps copying
+  this->InitNetFromProtoString(proto_prefix + "2 " + proto_suffix);
+  EXPECT_EQ(0, this->net_->blob_slices().size());
+}
+
+TYPED_TEST(NetTest, TestConcatBlobSlicesForward) {
+  typedef typename TypeParam::Dtype Dtype;
+  // The slices are bound the way the PS solver binds them, with 'mid'
+  // running between the producers of the two slices, as in an inception
+  // module. Only the CPU binding is done here.
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  const string& proto =
+      "name: 'ConcatNetwork' "
+      "input: 'data' "
+      "input_dim: 1 "
+      "input_dim: 3 "
+      "input_dim: 4 "
+      "input_dim: 4 "
+      "layer { "
+      "  name: 'left' "
+      "  type: 'Convolution' "
+      "  convolution_param { "
+      "    num_output: 3 kernel_size: 1 "
+      "    weight_filler { type: 'gaussian' std: 1 } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'left' "
+      "} "
+      "layer { "
+      "  name: 'left_relu' "
+      "  type: 'ReLU' "
+      "  bottom: 'left' "
+      "  top: 'left' "
+      "} "
+      "layer { "
+      "  name: 'mid' "
+      "  type: 'Convolution' "
+      "  convolution_param { "
+      "    num_output: 2 kernel_size: 1 "
+      "    weight_filler { type: 'gaussian' std: 1 } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'mid' "
+      "} "
+      "layer { "
+      "  name: 'right' "
+      "  type: 'Convolution' "
+      "  convolution_param { "
+      "    num_output: 3 kernel_size: 1 "
+      "    weight_filler { type: 'gaussian' std: 1 } "
+      "  } "
+      "  bottom: 'mid' "
+      "  top: 'right' "
+      "} "
+      "layer { "
+      "  name: 'right_relu' "
+      "  type: 'ReLU' "
+      "  bottom: 'right' "
+      "  top: 'right' "
+      "} "
+      "layer { "
+      "  name: 'concat' "
+      "  type: 'Concat' "
+      "  bottom: 'left' "
+      "  bottom: 'right' "
+      "  top: 'concat' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  Blob<Dtype>* data = this->net_->input_blobs()[0];
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(data);
+  // The output of the net with the copies of the Concat layer
+  const Blob<Dtype>& concat = *this->net_->blob_by_name("concat");
+  this->net_->ForwardPrefilled();
+  const vector<Dtype> expected(concat.cpu_data(),
+      concat.cpu_data() + concat.count());
+  // Bind the bottoms to their slices, and fill the top with garbage,
+  // which the producers have to overwrite
+  const vector<BlobSlice>& slices = this->net_->blob_slices();
+  ASSERT_EQ(2, slices.size());
+  Blob<Dtype>* top = this->net_->blobs()[slices[0].base_id].get();
+  caffe_set(top->count(), Dtype(-7), top->mutable_cpu_data());
+  for (int i = 0; i < slices.size(); ++i) {
+    ASSERT_TRUE(slices[i].data);
+    this->net_->blobs()[slices[i].blob_id]->set_cpu_data(
+        top->mutable_cpu_data() + slices[i].offset);
+  }
+  this->net_->ForwardPrefilled();
+  ASSERT_EQ(top, &concat);
+  for (int i = 0; i < slices.size(); ++i) {
+    EXPECT_EQ(concat.cpu_data() + slices[i].offset,
+        this->net_->blobs()[slices[i].blob_id]->cpu_data());
+  }
+  for (int i = 0; i < concat.count(); ++i) {
+    EXPECT_EQ(expected[i], concat.cpu_data()[i]) << "at " << i;
+  }
+}
+
+TYPED_TEST(NetTest, TestBranchThreads) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string& proto =
+      "name: 'BranchNetwork' "
+      "input: 'data' "
+      "input_dim: 2 "
+      "input_dim: 3 "
+      "input_dim: 1 "
+      "input_dim: 1 "
+      "input: 'target' "
+      "input_dim: 2 "
+      "input_dim: 9 "
+      "input_dim: 1 "
+      "input_dim: 1 "
+      "layer { "
+      "  name: 'left' "
+      "  type: 'InnerProduct' "
+      "  bottom: 'data' "
+      "  top: 'left' "
+      "  inner_product_param { "
+      "    num_output: 4 "
+      "    weight_filler { type: 'gaussian' std: 0.5 } "
+      "    bias_filler { type: 'gaussian' std: 0.5 } "
+      "  } "
+      "} "
+      "layer { "
+      "  name: 'right' "
+      "  type: 'InnerProduct' "
+      "  bottom: 'data' "
+      "  top: 'right' "
+      "  inner_product_param { "
+      "    num_output: 5 "
+      "    weight_filler { type: 'gaussian' std: 0.5 } "
+      "    bias_filler { type: 'gaussian' std: 0.5 } "
+      "  } "
+      "} "
+      "layer { "
+      "  name: 'concat' "
+      "  type: 'Concat' "
+      "  bottom: 'left' "
+      "  bottom: 'right' "
+      "  top: 'concat' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'concat' "
+      "  bottom: 'target' "
+      "  top: 'loss' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  // The branches wait for the split of the data, not for each other
+  const int left = this->net_->layer_names_index_["left"];
+  const int right = this->net_->layer_names_index_["right"];
+  const int concat = this->net_->layer_names_index_["concat"];
+  const vector<int>& right_deps = this->net_->forward_deps_[right];
+  EXPECT_TRUE(std::find(right_deps.begin(), right_deps.end(), left)
+      == right_deps.end());
+  const vector<int>& concat_deps = this->net_->forward_deps_[concat];
+  EXPECT_TRUE(std::find(concat_deps.begin(), concat_deps.end(), left)
+      != concat_deps.end());
+  EXPECT_TRUE(std::find(concat_deps.begin(), concat_deps.end(), right)
+      != concat_deps.end());
+  const vector<int>& left_bw_deps = this->net_->backward_deps_[left];
+  EXPECT_TRUE(std::find(left_bw_deps.begin(), left_bw_deps.end(), right)
+      == left_bw_deps.end());
+
+#ifdef USE_OPENMP
+  // Without OpenMP, or on the GPU, the layers run one by one, and the
+  // comparison below would check nothing.
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  for (int i = 0; i < this->net_->input_blobs().size(); ++i) {
+    filler.Fill(this->net_->input_blobs()[i]);
+  }
+  // Run serially, then on branch threads, and compare bit for bit
+  Dtype serial_loss;
+  this->net_->ClearParamDiffs();
+  this->net_->ForwardPrefilled(&serial_loss);
+  this->net_->Backward();
+  vector<shared_ptr<Blob<Dtype> > > serial_diffs;
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    const Blob<Dtype>& param = *this->net_->params()[i];
+    serial_diffs.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    serial_diffs.back()->CopyFrom(param, true, true);
+  }
+  this->net_->set_branch_threads(4);
+  ASSERT_GT(this->net_->branch_threads(), 1);
+  this->net_->set_record_timeline(true);
+  Dtype branch_loss;
+  this->net_->ClearParamDiffs();
+  this->net_->ForwardPrefilled(&branch_loss);
+  this->net_->Backward();
+  EXPECT_EQ(serial_loss, branch_loss);
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    const Blob<Dtype>& param = *this->net_->params()[i];
+    for (int j = 0; j < param.count(); ++j) {
+      EXPECT_EQ(serial_diffs[i]->cpu_diff()[j], param.cpu_diff()[j]);
+    }
+  }
+  const vector<bool>& need_backward = this->net_->layer_need_backward();
+  EXPECT_EQ(this->net_->layers().size() +
+      std::count(need_backward.begin(), need_backward.end(), true),
+      this->net_->timeline_.size());
+#endif
+}
+
+
+TYPED_TEST(NetTest, TestBranchThreadsReproducible) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Two random branches: with the same seed, a pass gives the same result
+  // whichever threads run them. Without OpenMP the pass runs serially.
+  if (Caffe::mode() != Caffe::CPU) {
+    return;
+  }
+  const string& proto =
+      "name: 'DropoutBranches' "
+      "state { phase: TRAIN } "
+      "input: 'data' "
+      "input_dim: 4 "
+      "input_dim: 8 "
+      "input_dim: 1 "
+      "input_dim: 1 "
+      "layer { "
+      "  name: 'left' "
+      "  type: 'Dropout' "
+      "  bottom: 'data' "
+      "  top: 'left' "
+      "} "
+      "layer { "
+      "  name: 'right' "
+      "  type: 'Dropout' "
+      "  bottom: 'data' "
+      "  top: 'right' "
+      "} "
+      "layer { "
+      "  name: 'concat' "
+      "  type: 'Concat' "
+      "  bottom: 'left' "
+      "  bottom: 'right' "
+      "  top: 'concat' "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  this->net_->set_branch_threads(4);
+  Blob<Dtype>* data = this->net_->input_blobs()[0];
+  caffe_set(data->count(), Dtype(1), data->mutable_cpu_data());
+  const Blob<Dtype>& concat = *this->net_->blob_by_name("concat");
+  Caffe::set_random_seed(this->seed_);
+  this->net_->ForwardPrefilled();
+  const vector<Dtype> first(concat.cpu_data(),
+      concat.cpu_data() + concat.count());
+  EXPECT_GT(std::count(first.begin(), first.end(), Dtype(0)), 0);
+  for (int run = 0; run < 3; ++run) {
+    Caffe::set_random_seed(this->seed_);
+    this->net_->ForwardPrefilled();
+    for (int i = 0; i < concat.count(); ++i) {
+      EXPECT_EQ(first[i], concat.cpu_data()[i]) << "run " << run << " at " << i;
+    }
+  }
+}
+
 }  // namespace caffe
@@ -235,6 +235,20 @@ TYPED_TEST(ReshapeLayerTest, TestForward) {
   }
 }
 
+// The solver accesses the top through the bottom, so the top must be a view
+// of the bottom's memory rather than a copy.
+TYPED_TEST(ReshapeLayerTest, TestSharesMemory) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  BlobShape* shape = layer_param.mutable_reshape_param()->mutable_shape();
+  shape->add_dim(6);
+  shape->add_dim(-1);
+  ReshapeLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->data(), this->blob_bottom_->data());
+  EXPECT_EQ(this->blob_top_->diff(), this->blob_bottom_->diff());
+}
+
 TYPED_TEST(ReshapeLayerTest, TestForwardAfterReshape) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
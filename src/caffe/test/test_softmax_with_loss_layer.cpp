@@ -84,6 +84,44 @@ TYPED_TEST(SoftmaxWithLossLayerTest, TestForwardIgnoreLabel) {
   EXPECT_NEAR(4 * full_loss, accum_loss, 1e-4);
 }
 
+TYPED_TEST(SoftmaxWithLossLayerTest, TestForwardLargeLogits) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Columns of logits near +1e4 overflow exp, and near -1e4 underflow it,
+  // unless the max is subtracted first.
+  const int num = this->blob_bottom_data_->num();
+  const int channels = this->blob_bottom_data_->channels();
+  const int spatial = this->blob_bottom_data_->count(2);
+  Dtype* data = this->blob_bottom_data_->mutable_cpu_data();
+  const Dtype* label = this->blob_bottom_label_->cpu_data();
+  double expected_loss = 0;
+  for (int i = 0; i < num; ++i) {
+    for (int j = 0; j < spatial; ++j) {
+      double max_val = -1e5;
+      for (int c = 0; c < channels; ++c) {
+        const int index = (i * channels + c) * spatial + j;
+        data[index] = ((i + j) % 2 ? 1e4 : -1e4) + c;
+        max_val = std::max(max_val, static_cast<double>(data[index]));
+      }
+      double sum = 0;
+      for (int c = 0; c < channels; ++c) {
+        sum += exp(data[(i * channels + c) * spatial + j] - max_val);
+      }
+      const int label_value = static_cast<int>(label[i * spatial + j]);
+      expected_loss += max_val + log(sum) -
+          data[(i * channels + label_value) * spatial + j];
+    }
+  }
+  expected_loss /= num * spatial;
+  LayerParameter layer_param;
+  SoftmaxWithLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  const Dtype loss = this->blob_top_loss_->cpu_data()[0];
+  EXPECT_FALSE(std::isnan(loss));
+  EXPECT_FALSE(std::isinf(loss));
+  EXPECT_NEAR(expected_loss, loss, 1e-3);
+}
+
 TYPED_TEST(SoftmaxWithLossLayerTest, TestGradientIgnoreLabel) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
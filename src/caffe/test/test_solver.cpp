@@ -1,3 +1,5 @@
+#include <limits>
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
@@ -9,6 +11,7 @@
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/sgd_solvers.hpp"
 #include "caffe/solver.hpp"
+#include "caffe/util/math_functions.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -106,4 +109,533 @@ TYPED_TEST(SolverTest, TestInitTrainTestNets) {
   EXPECT_TRUE(this->solver_->test_nets()[1]->has_layer("accuracy"));
 }
 
+class SolverPlanTest : public ::testing::Test {
+ protected:
+  // Plans the PS accesses of one clock of the net, with the cheap layers
+  // recomputed in the backward pass, freeing at most recompute_budget
+  // bytes (0 for no limit).
+  void PlanFromProtoString(const string& proto, size_t recompute_budget = 0,
+      bool distributed_test = false) {
+    SolverParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    Caffe::set_mode(Caffe::CPU);
+    PsConfig ps_config;
+    ps_config.worker_id = 0;
+    ps_config.num_workers = 1;
+    ps_config.debug = 0;
+    ps_config.plan_only = 1;
+    ps_config.recompute = "cheap";
+    ps_config.recompute_budget = recompute_budget;
+    ps_config.distributed_test = distributed_test;
+    SGDSolver<float> solver(param, &ps_config);
+    solver.PlanAccesses(&plan_);
+  }
+
+  vector<PlannedAccess> plan_;
+};
+
+TEST_F(SolverPlanTest, TestRecomputedTopKeptBetweenForwardUses) {
+  // 'relu' is read by ip1 and ip3, which are not adjacent. It must stay
+  // in GPU memory after ip1, and be dropped only after ip3.
+  const string& proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 2 dim: 3 } "
+     "      shape { dim: 2 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'ip0' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'data' "
+     "    top: 'ip0' "
+     "  } "
+     "  layer { "
+     "    name: 'relu' "
+     "    type: 'ReLU' "
+     "    bottom: 'ip0' "
+     "    top: 'relu' "
+     "  } "
+     "  layer { "
+     "    name: 'ip1' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'relu' "
+     "    top: 'ip1' "
+     "  } "
+     "  layer { "
+     "    name: 'ip2' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'ip1' "
+     "    top: 'ip2' "
+     "  } "
+     "  layer { "
+     "    name: 'ip3' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'relu' "
+     "    top: 'ip3' "
+     "  } "
+     "  layer { "
+     "    name: 'sum' "
+     "    type: 'Eltwise' "
+     "    bottom: 'ip2' "
+     "    bottom: 'ip3' "
+     "    top: 'sum' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'sum' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->PlanFromProtoString(proto);
+  vector<string> computed;
+  vector<bool> keeps;
+  for (int i = 0; i < plan_.size(); ++i) {
+    const PlannedAccess& access = plan_[i];
+    if (access.type == PlannedAccess::COMPUTE) {
+      if (access.name.find(":bw") != string::npos) {
+        break;
+      }
+      computed.push_back(access.name);
+    } else if (access.type == PlannedAccess::RELEASE &&
+        access.name == "relu:data") {
+      keeps.push_back(access.keep);
+      EXPECT_TRUE(computed.back() == "ip1:fw" || computed.back() == "ip3:fw")
+          << "relu released after " << computed.back();
+    }
+  }
+  ASSERT_EQ(2, keeps.size());
+  EXPECT_TRUE(keeps[0]);
+  EXPECT_FALSE(keeps[1]);
+}
+
+TEST_F(SolverPlanTest, TestChainedRecomputeKeepsCheckpoints) {
+  // 'pool' is the cheapest layer to recompute, and its bottom 'norm' is
+  // the top of another cheap layer. 'pool' is recomputed before the
+  // backward pass of ip, earlier than 'norm' could be, so 'norm' must be
+  // kept as its checkpoint. Every fetched blob must have been kept.
+  const string& proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 2 dim: 3 dim: 4 dim: 4 } "
+     "      shape { dim: 2 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'conv' "
+     "    type: 'Convolution' "
+     "    convolution_param { num_output: 2 kernel_size: 1 } "
+     "    bottom: 'data' "
+     "    top: 'conv' "
+     "  } "
+     "  layer { "
+     "    name: 'norm' "
+     "    type: 'LRN' "
+     "    lrn_param { local_size: 3 } "
+     "    bottom: 'conv' "
+     "    top: 'norm' "
+     "  } "
+     "  layer { "
+     "    name: 'pool' "
+     "    type: 'Pooling' "
+     "    pooling_param { pool: MAX kernel_size: 2 stride: 2 } "
+     "    bottom: 'norm' "
+     "    top: 'pool' "
+     "  } "
+     "  layer { "
+     "    name: 'ip' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'pool' "
+     "    top: 'ip' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'ip' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->PlanFromProtoString(proto);
+  std::map<string, bool> kept;
+  int num_dropped = 0;
+  for (int i = 0; i < plan_.size(); ++i) {
+    const PlannedAccess& access = plan_[i];
+    if (access.name.find(":data") == string::npos) {
+      continue;
+    }
+    if (access.type == PlannedAccess::ACCESS && access.fetch) {
+      EXPECT_TRUE(kept[access.name]) << access.name << " fetched at step "
+          << i << " but not kept";
+    } else if (access.type == PlannedAccess::RELEASE) {
+      kept[access.name] = access.keep;
+      num_dropped += !access.keep && access.name == "pool:data";
+    }
+  }
+  // 'pool' is still recomputed: it is dropped after its forward use.
+  EXPECT_GE(num_dropped, 1);
+}
+
+TEST_F(SolverPlanTest, TestRecomputeBudgetPrefersLargerTop) {
+  // 'relu0' and 'relu1' cost the same FLOPs per freed byte, but 'relu1'
+  // frees 64 bytes and 'relu0' 32. The budget fits only one of them, and
+  // the larger one must be chosen even though it comes later in the net.
+  const string& proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 2 dim: 3 } "
+     "      shape { dim: 2 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'ip0' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'data' "
+     "    top: 'ip0' "
+     "  } "
+     "  layer { "
+     "    name: 'relu0' "
+     "    type: 'ReLU' "
+     "    bottom: 'ip0' "
+     "    top: 'relu0' "
+     "  } "
+     "  layer { "
+     "    name: 'ip1' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 8 } "
+     "    bottom: 'relu0' "
+     "    top: 'ip1' "
+     "  } "
+     "  layer { "
+     "    name: 'relu1' "
+     "    type: 'ReLU' "
+     "    bottom: 'ip1' "
+     "    top: 'relu1' "
+     "  } "
+     "  layer { "
+     "    name: 'ip2' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'relu1' "
+     "    top: 'ip2' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'ip2' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->PlanFromProtoString(proto, 2 * 8 * sizeof(float));
+  // A recomputed top is dropped in the forward pass
+  std::map<string, bool> dropped;
+  for (int i = 0; i < plan_.size(); ++i) {
+    const PlannedAccess& access = plan_[i];
+    if (access.type == PlannedAccess::COMPUTE &&
+        access.name.find(":bw") != string::npos) {
+      break;
+    }
+    if (access.type == PlannedAccess::RELEASE && !access.keep) {
+      dropped[access.name] = true;
+    }
+  }
+  EXPECT_TRUE(dropped["relu1:data"]);
+  EXPECT_FALSE(dropped["relu0:data"]);
+}
+
+TEST_F(SolverPlanTest, TestPlanEndsWithTestAccesses) {
+  // After the batches of the clock, the test scores are read and updated,
+  // and one test batch runs every layer forward. The blobs that training
+  // keeps for the backward pass are released at the end, so the plan can
+  // be replayed.
+  const string& proto =
+     "test_iter: 1 "
+     "test_interval: 1 "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { dim: 2 dim: 3 } "
+     "      shape { dim: 2 } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'ip' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 4 } "
+     "    bottom: 'data' "
+     "    top: 'ip' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'ip' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->PlanFromProtoString(proto, 0, true);
+  int last_bw = -1;
+  int scores_read = -1;
+  int scores_update = -1;
+  vector<string> tested;
+  for (int i = 0; i < plan_.size(); ++i) {
+    const PlannedAccess& access = plan_[i];
+    if (access.type == PlannedAccess::COMPUTE) {
+      if (access.name.find(":bw") != string::npos) {
+        last_bw = i;
+      } else if (access.name.find(":test") != string::npos) {
+        EXPECT_GT(scores_update, last_bw);
+        tested.push_back(access.name);
+      }
+    } else if (access.type == PlannedAccess::ACCESS) {
+      if (access.name == "test_scores:read") {
+        EXPECT_TRUE(access.fetch);
+        scores_read = i;
+      } else if (access.name == "test_scores:update") {
+        EXPECT_FALSE(access.fetch);
+        scores_update = i;
+      }
+    }
+  }
+  EXPECT_GT(scores_read, last_bw);
+  EXPECT_GT(scores_update, scores_read);
+  ASSERT_EQ(3, tested.size());
+  EXPECT_EQ("data:test", tested[0]);
+  EXPECT_EQ("loss:test", tested[2]);
+  // Replaying it checks that no buffer is accessed or released twice
+  AccessPlanStats stats;
+  SimulateAccessPlan(plan_, std::numeric_limits<size_t>::max(), &stats);
+  EXPECT_EQ(8, stats.compute_names.size());
+}
+
+TEST_F(SolverPlanTest, TestConcatSliceProducersFetchTheTop) {
+  // 'left' and 'right' are written straight into their slices of
+  // 'concat'. 'mid' runs between them and does not use 'concat', which is
+  // released in between, so 'right' must fetch it to keep the slice of
+  // 'left'.
+  const string& proto =
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { shape { dim: 1 dim: 3 dim: 4 dim: 4 } } "
+     "    top: 'data' "
+     "  } "
+     "  layer { "
+     "    name: 'left' "
+     "    type: 'Convolution' "
+     "    convolution_param { num_output: 2 kernel_size: 1 } "
+     "    bottom: 'data' "
+     "    top: 'left' "
+     "  } "
+     "  layer { "
+     "    name: 'left_relu' "
+     "    type: 'ReLU' "
+     "    bottom: 'left' "
+     "    top: 'left' "
+     "  } "
+     "  layer { "
+     "    name: 'mid' "
+     "    type: 'Convolution' "
+     "    convolution_param { num_output: 2 kernel_size: 1 } "
+     "    bottom: 'data' "
+     "    top: 'mid' "
+     "  } "
+     "  layer { "
+     "    name: 'right' "
+     "    type: 'Convolution' "
+     "    convolution_param { num_output: 2 kernel_size: 1 } "
+     "    bottom: 'mid' "
+     "    top: 'right' "
+     "  } "
+     "  layer { "
+     "    name: 'concat' "
+     "    type: 'Concat' "
+     "    bottom: 'left' "
+     "    bottom: 'right' "
+     "    top: 'concat' "
+     "  } "
+     "  layer { "
+     "    name: 'ip' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { num_output: 2 } "
+     "    bottom: 'concat' "
+     "    top: 'ip' "
+     "  } "
+     "} ";
+  this->PlanFromProtoString(proto);
+  int num_accesses = 0;
+  bool released = false;
+  for (int i = 0; i < plan_.size(); ++i) {
+    const PlannedAccess& access = plan_[i];
+    if (access.name != "concat:data") {
+      continue;
+    }
+    if (access.type == PlannedAccess::ACCESS) {
+      if (num_accesses++) {
+        EXPECT_TRUE(access.fetch) << "access at step " << i;
+      }
+    } else if (access.type == PlannedAccess::RELEASE && num_accesses == 1) {
+      EXPECT_TRUE(access.keep) << "release at step " << i;
+      released = true;
+    }
+  }
+  EXPECT_TRUE(released);
+  EXPECT_GE(num_accesses, 2);
+}
+
+// Exposes the update steps of a solver, to compare the fused update
+// with Regularize followed by ComputeUpdateValue.
+template <typename SolverType>
+class UpdateValueSolver : public SolverType {
+ public:
+  UpdateValueSolver(const SolverParameter& param, const PsConfig *ps_config)
+      : SolverType(param, ps_config) {}
+  using SolverType::Regularize;
+  using SolverType::ComputeUpdateValue;
+  using SolverType::RegularizeAndComputeUpdateValue;
+  using SolverType::FusedUpdateValue;
+  using SolverType::fused_update;
+};
+
+class FusedUpdateTest : public ::testing::Test {
+ protected:
+  void InitParam(const string& regularization_type) {
+    const string& proto =
+       "base_lr: 0.01 "
+       "momentum: 0.9 "
+       "weight_decay: 0.1 "
+       "random_seed: 1701 "
+       "net_param { "
+       "  name: 'TestNetwork' "
+       "  layer { "
+       "    name: 'data' "
+       "    type: 'DummyData' "
+       "    dummy_data_param { shape { dim: 2 dim: 5 } } "
+       "    top: 'data' "
+       "  } "
+       "  layer { "
+       "    name: 'ip' "
+       "    type: 'InnerProduct' "
+       "    inner_product_param { "
+       "      num_output: 7 "
+       "      weight_filler { type: 'gaussian' std: 1 } "
+       "      bias_filler { type: 'gaussian' std: 1 } "
+       "    } "
+       "    bottom: 'data' "
+       "    top: 'ip' "
+       "  } "
+       "} ";
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param_));
+    param_.set_regularization_type(regularization_type);
+    Caffe::set_mode(Caffe::CPU);
+    ps_config_.worker_id = 0;
+    ps_config_.num_workers = 1;
+    ps_config_.debug = 0;
+    ps_config_.plan_only = 1;
+  }
+
+  // Runs the reference and the fused update from the same random diff and
+  // history, for every parameter, and compares the diffs and histories.
+  template <typename SolverType>
+  void CheckFusedUpdate(bool nesterov) {
+    UpdateValueSolver<SolverType> solver(param_, &ps_config_);
+    const vector<shared_ptr<Blob<float> > >& params = solver.net()->params();
+    const float rate = 0.01;
+    for (int param_id = 0; param_id < params.size(); ++param_id) {
+      Blob<float>* param = params[param_id].get();
+      Blob<float>* history = solver.history()[param_id].get();
+      const int count = param->count();
+      vector<float> diff(count), hist(count);
+      caffe_rng_gaussian<float>(count, 0, 1, &diff[0]);
+      caffe_rng_gaussian<float>(count, 0, 1, &hist[0]);
+      caffe_copy(count, &diff[0], param->mutable_cpu_diff());
+      caffe_copy(count, &hist[0], history->mutable_cpu_data());
+      solver.Regularize(param_id);
+      solver.ComputeUpdateValue(param_id, rate);
+      vector<float> expected_diff(param->cpu_diff(), param->cpu_diff() + count);
+      vector<float> expected_hist(
+          history->cpu_data(), history->cpu_data() + count);
+      caffe_copy(count, &diff[0], param->mutable_cpu_diff());
+      caffe_copy(count, &hist[0], history->mutable_cpu_data());
+      solver.FusedUpdateValue(param_id, rate, nesterov);
+      for (int i = 0; i < count; ++i) {
+        EXPECT_NEAR(expected_diff[i], param->cpu_diff()[i], 1e-5);
+        EXPECT_NEAR(expected_hist[i], history->cpu_data()[i], 1e-5);
+      }
+      /* The virtual entry point takes the fused path and agrees too */
+      caffe_copy(count, &diff[0], param->mutable_cpu_diff());
+      caffe_copy(count, &hist[0], history->mutable_cpu_data());
+      solver.RegularizeAndComputeUpdateValue(param_id, rate);
+      for (int i = 0; i < count; ++i) {
+        EXPECT_NEAR(expected_diff[i], param->cpu_diff()[i], 1e-5);
+        EXPECT_NEAR(expected_hist[i], history->cpu_data()[i], 1e-5);
+      }
+    }
+  }
+
+  SolverParameter param_;
+  PsConfig ps_config_;
+};
+
+TEST_F(FusedUpdateTest, TestSGDTakesFusedPath) {
+  InitParam("L2");
+  UpdateValueSolver<SGDSolver<float> > solver(param_, &ps_config_);
+  EXPECT_STREQ("SGD", solver.type());
+  EXPECT_TRUE(solver.fused_update());
+  param_.set_momentum(0);
+  UpdateValueSolver<AdaGradSolver<float> > adagrad_solver(
+      param_, &ps_config_);
+  EXPECT_FALSE(adagrad_solver.fused_update());
+}
+
+TEST_F(FusedUpdateTest, TestSGDL2) {
+  InitParam("L2");
+  CheckFusedUpdate<SGDSolver<float> >(false);
+}
+
+TEST_F(FusedUpdateTest, TestSGDL1) {
+  InitParam("L1");
+  CheckFusedUpdate<SGDSolver<float> >(false);
+}
+
+TEST_F(FusedUpdateTest, TestNesterovL2) {
+  InitParam("L2");
+  CheckFusedUpdate<NesterovSolver<float> >(true);
+}
+
+TEST_F(FusedUpdateTest, TestNesterovL1) {
+  InitParam("L1");
+  CheckFusedUpdate<NesterovSolver<float> >(true);
+}
+
 }  // namespace caffe
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/access_simulator.hpp"
+
+namespace caffe {
+
+struct SimulatedBuffer {
+  size_t bytes;
+  bool live;
+  bool cached;
+  bool valid;
+  SimulatedBuffer() : bytes(0), live(false), cached(false), valid(false) {}
+};
+
+/* Returns the distance to the next access of the buffer after step t,
+ * wrapping to the next clock, and whether that access reads it */
+static size_t NextAccess(const std::vector<PlannedAccess>& plan,
+    const std::vector<int>& buffer_ids, int buffer_id, size_t t,
+    bool* fetch) {
+  const size_t n = plan.size();
+  for (size_t d = 1; d <= n; ++d) {
+    const size_t i = (t + d) % n;
+    if (plan[i].type == PlannedAccess::ACCESS && buffer_ids[i] == buffer_id) {
+      *fetch = plan[i].fetch;
+      return d;
+    }
+  }
+  *fetch = false;
+  return n + 1;
+}
+
+void SimulateAccessPlan(const std::vector<PlannedAccess>& plan,
+    size_t capacity, AccessPlanStats* stats) {
+  *stats = AccessPlanStats();
+  const size_t n = plan.size();
+  std::map<std::string, int> buffer_index;
+  std::vector<SimulatedBuffer> buffers;
+  std::vector<int> buffer_ids(n, -1);
+  for (size_t i = 0; i < n; ++i) {
+    if (plan[i].type == PlannedAccess::COMPUTE) {
+      continue;
+    }
+    std::map<std::string, int>::iterator it = buffer_index.find(plan[i].name);
+    if (it == buffer_index.end()) {
+      it = buffer_index.insert(
+          std::make_pair(plan[i].name, buffers.size())).first;
+      buffers.push_back(SimulatedBuffer());
+      buffers.back().bytes = plan[i].bytes;
+    }
+    CHECK_EQ(buffers[it->second].bytes, plan[i].bytes)
+        << "Buffer " << plan[i].name << " changes size";
+    buffer_ids[i] = it->second;
+  }
+
+  size_t live_bytes = 0;
+  size_t cached_bytes = 0;
+  for (size_t t = 0; t < 2 * n; ++t) {
+    const PlannedAccess& step = plan[t % n];
+    const bool counted = t >= n;
+    if (step.type == PlannedAccess::COMPUTE) {
+      if (counted) {
+        stats->compute_names.push_back(step.name);
+        stats->compute_live_bytes.push_back(live_bytes);
+      }
+      continue;
+    }
+    SimulatedBuffer& buffer = buffers[buffer_ids[t % n]];
+    if (step.type == PlannedAccess::ACCESS) {
+      CHECK(!buffer.live) << "Buffer " << step.name << " accessed twice";
+      if (buffer.cached) {
+        buffer.cached = false;
+        cached_bytes -= buffer.bytes;
+      } else if (step.fetch && buffer.valid && counted) {
+        stats->swap_in_bytes += buffer.bytes;
+      }
+      buffer.live = true;
+      live_bytes += buffer.bytes;
+      /* Make room by evicting the cached buffers used last */
+      while (live_bytes + cached_bytes > capacity && cached_bytes) {
+        int victim = -1;
+        size_t victim_distance = 0;
+        bool victim_fetch = false;
+        for (int i = 0; i < buffers.size(); ++i) {
+          if (!buffers[i].cached) {
+            continue;
+          }
+          bool fetch;
+          size_t distance = NextAccess(plan, buffer_ids, i, t % n, &fetch);
+          if (victim < 0 || distance > victim_distance) {
+            victim = i;
+            victim_distance = distance;
+            victim_fetch = fetch;
+          }
+        }
+        buffers[victim].cached = false;
+        cached_bytes -= buffers[victim].bytes;
+        if (victim_fetch && counted) {
+          stats->swap_out_bytes += buffers[victim].bytes;
+        }
+      }
+    } else {
+      CHECK(buffer.live) << "Buffer " << step.name << " released twice";
+      buffer.live = false;
+      live_bytes -= buffer.bytes;
+      buffer.valid = step.keep;
+      if (step.keep) {
+        buffer.cached = true;
+        cached_bytes += buffer.bytes;
+      }
+    }
+    stats->peak_live_bytes = std::max(stats->peak_live_bytes, live_bytes);
+    stats->peak_resident_bytes =
+        std::max(stats->peak_resident_bytes, live_bytes + cached_bytes);
+  }
+}
+
+}  // namespace caffe
@@ -165,4 +165,106 @@ float CPUTimer::MicroSeconds() {
   return this->elapsed_microseconds_;
 }
 
+StreamStageTimer::StreamStageTimer()
+    : gpu_(Caffe::mode() == Caffe::GPU), running_(false) {
+}
+
+StreamStageTimer::~StreamStageTimer() {
+  Synchronize();
+  if (gpu_) {
+#ifndef CPU_ONLY
+    for (int i = 0; i < free_.size(); ++i) {
+      CUDA_CHECK(cudaEventDestroy(free_[i].start_gpu));
+      CUDA_CHECK(cudaEventDestroy(free_[i].stop_gpu));
+    }
+#endif
+  }
+}
+
+void StreamStageTimer::Start() {
+  if (running_) {
+    LOG(WARNING) << "Stage started twice, timing it from the first start.";
+    return;
+  }
+  if (free_.size()) {
+    current_ = free_.back();
+    free_.pop_back();
+  } else if (gpu_) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaEventCreate(&current_.start_gpu));
+    CUDA_CHECK(cudaEventCreate(&current_.stop_gpu));
+#else
+    NO_GPU;
+#endif
+  }
+  if (gpu_) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaEventRecord(current_.start_gpu, Caffe::cuda_stream()));
+#else
+    NO_GPU;
+#endif
+  } else {
+    current_.start_cpu = boost::posix_time::microsec_clock::local_time();
+  }
+  running_ = true;
+}
+
+void StreamStageTimer::Stop(double* seconds) {
+  CHECK(running_) << "Stage stopped before it was started.";
+  current_.seconds = seconds;
+  running_ = false;
+  if (gpu_) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaEventRecord(current_.stop_gpu, Caffe::cuda_stream()));
+    pending_.push_back(current_);
+#else
+    NO_GPU;
+#endif
+  } else {
+    current_.stop_cpu = boost::posix_time::microsec_clock::local_time();
+    Retire(&current_);
+  }
+}
+
+void StreamStageTimer::Collect() {
+  /* The stages were recorded on one stream, so they complete in order */
+  while (pending_.size()) {
+#ifndef CPU_ONLY
+    cudaError_t status = cudaEventQuery(pending_.front().stop_gpu);
+    if (status == cudaErrorNotReady) {
+      break;
+    }
+    CUDA_CHECK(status);
+#endif
+    Retire(&pending_.front());
+    pending_.pop_front();
+  }
+}
+
+void StreamStageTimer::Synchronize() {
+  if (pending_.size()) {
+#ifndef CPU_ONLY
+    CUDA_CHECK(cudaEventSynchronize(pending_.back().stop_gpu));
+#endif
+  }
+  Collect();
+}
+
+void StreamStageTimer::Retire(Stage* stage) {
+  if (gpu_) {
+#ifndef CPU_ONLY
+    float milliseconds;
+    CUDA_CHECK(cudaEventElapsedTime(&milliseconds, stage->start_gpu,
+                                    stage->stop_gpu));
+    *stage->seconds += milliseconds / 1000.;
+#else
+    NO_GPU;
+#endif
+  } else {
+    *stage->seconds +=
+        (stage->stop_cpu - stage->start_cpu).total_microseconds() / 1e6;
+  }
+  free_.push_back(*stage);
+}
+
 }  // namespace caffe
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/gradient_compression.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+CompressionConfig ParseCompressionConfig(const std::string& spec) {
+  CompressionConfig config;
+  const size_t colon = spec.find(':');
+  const std::string method = spec.substr(0, colon);
+  const std::string arg =
+      colon == std::string::npos ? "" : spec.substr(colon + 1);
+  if (method == "" || method == "none") {
+    config.method = COMPRESSION_NONE;
+  } else if (method == "threshold") {
+    CHECK(arg.size()) << "Compression \"threshold\" needs a threshold";
+    config.method = COMPRESSION_THRESHOLD;
+    config.threshold = atof(arg.c_str());
+    CHECK_GE(config.threshold, 0);
+  } else if (method == "topk") {
+    config.method = COMPRESSION_TOPK;
+    if (arg.size()) {
+      config.ratio = atof(arg.c_str());
+    }
+    CHECK_GT(config.ratio, 0);
+    CHECK_LE(config.ratio, 1);
+  } else if (method == "int8") {
+    config.method = COMPRESSION_INT8;
+  } else if (method == "sign") {
+    config.method = COMPRESSION_SIGN;
+  } else {
+    LOG(FATAL) << "Unknown compression method: " << spec;
+  }
+  return config;
+}
+
+void ParseLayerCompressionConfigs(const std::string& default_spec,
+    const std::string& layer_specs,
+    const std::vector<std::string>& layer_names,
+    std::vector<CompressionConfig>* configs) {
+  std::map<std::string, CompressionConfig> overrides;
+  size_t start = 0;
+  while (start < layer_specs.size()) {
+    size_t end = layer_specs.find(',', start);
+    if (end == std::string::npos) {
+      end = layer_specs.size();
+    }
+    const std::string entry = layer_specs.substr(start, end - start);
+    const size_t equal = entry.find('=');
+    CHECK_NE(equal, std::string::npos)
+        << "Bad layer compression entry: " << entry;
+    overrides[entry.substr(0, equal)] =
+        ParseCompressionConfig(entry.substr(equal + 1));
+    start = end + 1;
+  }
+  const CompressionConfig default_config =
+      ParseCompressionConfig(default_spec);
+  configs->assign(layer_names.size(), default_config);
+  for (int i = 0; i < layer_names.size(); ++i) {
+    std::map<std::string, CompressionConfig>::iterator it =
+        overrides.find(layer_names[i]);
+    if (it != overrides.end()) {
+      (*configs)[i] = it->second;
+      overrides.erase(it);
+    }
+  }
+  for (std::map<std::string, CompressionConfig>::iterator it =
+      overrides.begin(); it != overrides.end(); ++it) {
+    LOG(WARNING) << "Compression set for unknown layer " << it->first;
+  }
+}
+
+template <typename Dtype>
+Dtype compression_topk_threshold(std::vector<Dtype>* abs_sample,
+    const float ratio) {
+  CHECK(abs_sample->size());
+  int k = static_cast<int>(ratio * abs_sample->size());
+  k = std::min(std::max(k, 1), static_cast<int>(abs_sample->size()));
+  typename std::vector<Dtype>::iterator kth =
+      abs_sample->begin() + (abs_sample->size() - k);
+  std::nth_element(abs_sample->begin(), kth, abs_sample->end());
+  return *kth;
+}
+
+template float compression_topk_threshold<float>(std::vector<float>*,
+    const float);
+template double compression_topk_threshold<double>(std::vector<double>*,
+    const float);
+
+template <typename Dtype>
+Dtype compress_update_cpu(const CompressionConfig& config, const int n,
+    Dtype* update, Dtype* residual) {
+  if (config.method == COMPRESSION_NONE || n == 0) {
+    return Dtype(1);
+  }
+  caffe_axpy<Dtype>(n, Dtype(1), residual, update);
+  Dtype threshold = config.threshold;
+  if (config.method == COMPRESSION_TOPK) {
+    const int stride = std::max(1, n / 4096);
+    std::vector<Dtype> abs_sample;
+    for (int i = 0; i < n; i += stride) {
+      abs_sample.push_back(std::fabs(update[i]));
+    }
+    threshold = compression_topk_threshold(&abs_sample, config.ratio);
+  }
+  switch (config.method) {
+  case COMPRESSION_THRESHOLD:
+  case COMPRESSION_TOPK: {
+    int num_sent = 0;
+    for (int i = 0; i < n; ++i) {
+      if (std::fabs(update[i]) >= threshold && update[i] != 0) {
+        residual[i] = 0;
+        ++num_sent;
+      } else {
+        residual[i] = update[i];
+        update[i] = 0;
+      }
+    }
+    return std::min(Dtype(1), Dtype(2) * num_sent / n);
+  }
+  case COMPRESSION_INT8: {
+    Dtype max_abs = 0;
+    for (int i = 0; i < n; ++i) {
+      max_abs = std::max(max_abs, static_cast<Dtype>(std::fabs(update[i])));
+    }
+    const Dtype scale = max_abs / 127;
+    for (int i = 0; i < n; ++i) {
+      const Dtype sent = scale > 0 ?
+          scale * std::floor(update[i] / scale + Dtype(0.5)) : 0;
+      residual[i] = update[i] - sent;
+      update[i] = sent;
+    }
+    return Dtype(0.25);
+  }
+  case COMPRESSION_SIGN: {
+    const Dtype scale = caffe_cpu_asum<Dtype>(n, update) / n;
+    for (int i = 0; i < n; ++i) {
+      const Dtype sent = update[i] >= 0 ? scale : -scale;
+      residual[i] = update[i] - sent;
+      update[i] = sent;
+    }
+    return Dtype(1) / 32;
+  }
+  default:
+    LOG(FATAL) << "Unknown compression method: " << config.method;
+  }
+  return Dtype(1);
+}
+
+template float compress_update_cpu<float>(const CompressionConfig&,
+    const int, float*, float*);
+template double compress_update_cpu<double>(const CompressionConfig&,
+    const int, double*, double*);
+
+}  // namespace caffe
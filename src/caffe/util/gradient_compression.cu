@@ -0,0 +1,231 @@
+#include <thrust/count.h>
+#include <thrust/device_ptr.h>
+#include <thrust/system/cuda/execution_policy.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "caffe/common.hpp"
+#include "caffe/util/gradient_compression.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+struct is_nonzero {
+  __host__ __device__ bool operator()(const Dtype x) const {
+    return x != 0;
+  }
+};
+
+/* The bit pattern of |x|, which orders non-negative values like the values */
+template <typename Dtype> struct AbsBits;
+
+template <> struct AbsBits<float> {
+  typedef unsigned int Type;
+  static __device__ Type get(const float x) {
+    return __float_as_uint(x) & 0x7fffffffu;
+  }
+  static __device__ float value(const Type bits) {
+    return __uint_as_float(bits);
+  }
+};
+
+template <> struct AbsBits<double> {
+  typedef unsigned long long Type;  // NOLINT(runtime/int)
+  static __device__ Type get(const double x) {
+    return static_cast<Type>(__double_as_longlong(x)) & 0x7fffffffffffffffull;
+  }
+  static __device__ double value(const Type bits) {
+    return __longlong_as_double(static_cast<long long>(bits));  // NOLINT
+  }
+};
+
+/* The max (or the sum) of |x| over the values of each block, written to
+ * partial[blockIdx.x] */
+template <typename Dtype>
+__global__ void abs_reduce_kernel(const int n, const Dtype* x, const bool sum,
+    Dtype* partial) {
+  __shared__ Dtype buffer[CAFFE_CUDA_NUM_THREADS];
+  Dtype acc = 0;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+       i += blockDim.x * gridDim.x) {
+    const Dtype a = x[i] < 0 ? -x[i] : x[i];
+    acc = sum ? acc + a : (a > acc ? a : acc);
+  }
+  buffer[threadIdx.x] = acc;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      const Dtype other = buffer[threadIdx.x + s];
+      buffer[threadIdx.x] = sum ? buffer[threadIdx.x] + other :
+          (other > buffer[threadIdx.x] ? other : buffer[threadIdx.x]);
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    partial[blockIdx.x] = buffer[0];
+  }
+}
+
+/* Reduces |x| into result[0] in two launches, with the partial results of
+ * the first one in the rest of the scratch memory. The order of the
+ * additions is fixed, so the result does not change between runs. */
+template <typename Dtype>
+static void abs_reduce_gpu(const int n, const Dtype* x, const bool sum,
+    Dtype* result) {
+  cudaStream_t stream = Caffe::cuda_stream();
+  const int num_blocks =
+      std::min(CAFFE_GET_BLOCKS(n), COMPRESSION_SCRATCH_SIZE - 1);
+  abs_reduce_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+      <<<num_blocks, CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+      n, x, sum, result + 1);
+  abs_reduce_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+      <<<1, CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+      num_blocks, result + 1, sum, result);
+  CUDA_POST_KERNEL_CHECK;
+}
+
+/* Chooses the top-k threshold from the same strided sample as
+ * compression_topk_threshold, and with the same result: the k-th largest
+ * |u| of the sample, found one bit at a time as the largest value that
+ * at least k sampled values reach. Runs as a single block. */
+template <typename Dtype>
+__global__ void topk_threshold_kernel(const int num_samples, const int stride,
+    const int k, const Dtype* update, Dtype* threshold) {
+  typedef typename AbsBits<Dtype>::Type Bits;
+  __shared__ int counts[CAFFE_CUDA_NUM_THREADS];
+  Bits result = 0;
+  for (int bit = sizeof(Bits) * 8 - 2; bit >= 0; --bit) {
+    const Bits candidate = result | (Bits(1) << bit);
+    int count = 0;
+    for (int i = threadIdx.x; i < num_samples; i += blockDim.x) {
+      count += AbsBits<Dtype>::get(update[i * stride]) >= candidate;
+    }
+    counts[threadIdx.x] = count;
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+      if (threadIdx.x < s) {
+        counts[threadIdx.x] += counts[threadIdx.x + s];
+      }
+      __syncthreads();
+    }
+    if (counts[0] >= k) {
+      result = candidate;
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    threshold[0] = AbsBits<Dtype>::value(result);
+  }
+}
+
+template <typename Dtype>
+__global__ void threshold_compress_kernel(const int n,
+    const Dtype* threshold_ptr, Dtype* update, Dtype* residual) {
+  const Dtype threshold = *threshold_ptr;
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype u = update[index];
+    if ((u >= threshold || -u >= threshold) && u != 0) {
+      residual[index] = 0;
+    } else {
+      residual[index] = u;
+      update[index] = 0;
+    }
+  }
+}
+
+template <typename Dtype>
+__global__ void int8_compress_kernel(const int n, const Dtype* max_abs,
+    Dtype* update, Dtype* residual) {
+  const Dtype scale = *max_abs / 127;
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype u = update[index];
+    const Dtype sent = scale > 0 ? scale * floor(u / scale + Dtype(0.5)) : 0;
+    residual[index] = u - sent;
+    update[index] = sent;
+  }
+}
+
+template <typename Dtype>
+__global__ void sign_compress_kernel(const int n, const Dtype* asum,
+    Dtype* update, Dtype* residual) {
+  const Dtype scale = *asum / n;
+  CUDA_KERNEL_LOOP(index, n) {
+    const Dtype u = update[index];
+    const Dtype sent = u >= 0 ? scale : -scale;
+    residual[index] = u - sent;
+    update[index] = sent;
+  }
+}
+
+template <typename Dtype>
+Dtype compress_update_gpu(const CompressionConfig& config, const int n,
+    Dtype* update, Dtype* residual, Dtype* scratch, bool measure) {
+  if (config.method == COMPRESSION_NONE || n == 0) {
+    return Dtype(1);
+  }
+  cudaStream_t stream = Caffe::cuda_stream();
+  thrust::device_ptr<Dtype> update_ptr(update);
+  caffe_gpu_axpy<Dtype>(n, Dtype(1), residual, update);
+  /* The threshold or scale is computed into scratch[0] and read from
+   * there by the kernels, so the host never waits for it */
+  Dtype ratio = 1;
+  switch (config.method) {
+  case COMPRESSION_THRESHOLD:
+  case COMPRESSION_TOPK: {
+    if (config.method == COMPRESSION_TOPK) {
+      const int stride = std::max(1, n / 4096);
+      const int num_samples = (n + stride - 1) / stride;
+      int k = static_cast<int>(config.ratio * num_samples);
+      k = std::min(std::max(k, 1), num_samples);
+      topk_threshold_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+          <<<1, CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+          num_samples, stride, k, update, scratch);
+      CUDA_POST_KERNEL_CHECK;
+    } else {
+      caffe_gpu_set<Dtype>(1, config.threshold, scratch);
+    }
+    threshold_compress_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+        <<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+        n, scratch, update, residual);
+    CUDA_POST_KERNEL_CHECK;
+    if (measure) {
+      const int num_sent = thrust::count_if(thrust::cuda::par.on(stream),
+          update_ptr, update_ptr + n, is_nonzero<Dtype>());
+      ratio = std::min(Dtype(1), Dtype(2) * num_sent / n);
+    } else {
+      ratio = 0;
+    }
+    break;
+  }
+  case COMPRESSION_INT8: {
+    abs_reduce_gpu<Dtype>(n, update, false, scratch);
+    int8_compress_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+        <<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+        n, scratch, update, residual);
+    CUDA_POST_KERNEL_CHECK;
+    ratio = Dtype(0.25);
+    break;
+  }
+  case COMPRESSION_SIGN: {
+    abs_reduce_gpu<Dtype>(n, update, true, scratch);
+    sign_compress_kernel<Dtype>  // NOLINT_NEXT_LINE(whitespace/operators)
+        <<<CAFFE_GET_BLOCKS(n), CAFFE_CUDA_NUM_THREADS, 0, stream>>>(
+        n, scratch, update, residual);
+    CUDA_POST_KERNEL_CHECK;
+    ratio = Dtype(1) / 32;
+    break;
+  }
+  default:
+    LOG(FATAL) << "Unknown compression method: " << config.method;
+  }
+  return ratio;
+}
+
+template float compress_update_gpu<float>(const CompressionConfig&,
+    const int, float*, float*, float*, bool);
+template double compress_update_gpu<double>(const CompressionConfig&,
+    const int, double*, double*, double*, bool);
+
+}  // namespace caffe
@@ -1,10 +1,18 @@
 #include "caffe/util/hdf5.hpp"
 
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 namespace caffe {
 
+static boost::mutex hdf5_mutex_;
+
+boost::mutex& hdf5_mutex() {
+  return hdf5_mutex_;
+}
+
 // Verifies format of data stored in HDF5 file and reshapes blob accordingly.
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
@@ -81,6 +89,133 @@ void hdf5_load_nd_dataset<double>(hid_t file_id, const char* dataset_name_,
   CHECK_GE(status, 0) << "Failed to read double dataset " << dataset_name_;
 }
 
+std::vector<hsize_t> hdf5_get_dataset_dims(hid_t file_id,
+    const char* dataset_name_, int min_dim, int max_dim) {
+  CHECK(H5LTfind_dataset(file_id, dataset_name_))
+      << "Failed to find HDF5 dataset " << dataset_name_;
+  int ndims;
+  herr_t status = H5LTget_dataset_ndims(file_id, dataset_name_, &ndims);
+  CHECK_GE(status, 0) << "Failed to get dataset ndims for " << dataset_name_;
+  CHECK_GE(ndims, min_dim);
+  CHECK_LE(ndims, max_dim);
+  std::vector<hsize_t> dims(ndims);
+  H5T_class_t class_;
+  status = H5LTget_dataset_info(
+      file_id, dataset_name_, dims.data(), &class_, NULL);
+  CHECK_GE(status, 0) << "Failed to get dataset info for " << dataset_name_;
+  return dims;
+}
+
+// Selects the rows as a hyperslab of the file space and reads them into a
+// contiguous memory space, converting to mem_type_id.
+static void hdf5_load_rows_helper(hid_t file_id, const char* dataset_name_,
+    hsize_t first_row, hsize_t num_rows, hid_t mem_type_id, void* data) {
+  hid_t dataset_id = H5Dopen2(file_id, dataset_name_, H5P_DEFAULT);
+  CHECK_GE(dataset_id, 0) << "Failed to open HDF5 dataset " << dataset_name_;
+  hid_t file_space = H5Dget_space(dataset_id);
+  const int ndims = H5Sget_simple_extent_ndims(file_space);
+  CHECK_GE(ndims, 1);
+  std::vector<hsize_t> dims(ndims);
+  H5Sget_simple_extent_dims(file_space, dims.data(), NULL);
+  CHECK_LE(first_row + num_rows, dims[0])
+      << "Rows out of range of HDF5 dataset " << dataset_name_;
+  std::vector<hsize_t> start(ndims, 0);
+  start[0] = first_row;
+  dims[0] = num_rows;
+  herr_t status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET,
+      start.data(), NULL, dims.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows of " << dataset_name_;
+  hid_t mem_space = H5Screate_simple(ndims, dims.data(), NULL);
+  status = H5Dread(dataset_id, mem_type_id, mem_space, file_space,
+      H5P_DEFAULT, data);
+  CHECK_GE(status, 0) << "Failed to read rows of " << dataset_name_;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset_id);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<float>(hid_t file_id,
+    const char* dataset_name_, hsize_t first_row, hsize_t num_rows,
+    float* data) {
+  hdf5_load_rows_helper(file_id, dataset_name_, first_row, num_rows,
+      H5T_NATIVE_FLOAT, data);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<double>(hid_t file_id,
+    const char* dataset_name_, hsize_t first_row, hsize_t num_rows,
+    double* data) {
+  hdf5_load_rows_helper(file_id, dataset_name_, first_row, num_rows,
+      H5T_NATIVE_DOUBLE, data);
+}
+
+static void hdf5_append_helper(hid_t file_id, const string& dataset_name,
+    const vector<int>& shape, hid_t mem_type_id, const void* data) {
+  const int ndims = shape.size();
+  CHECK_GE(ndims, 1);
+  std::vector<hsize_t> rows(shape.begin(), shape.end());
+  hid_t dataset_id;
+  if (H5LTfind_dataset(file_id, dataset_name.c_str())) {
+    dataset_id = H5Dopen2(file_id, dataset_name.c_str(), H5P_DEFAULT);
+  } else {
+    std::vector<hsize_t> dims(rows);
+    std::vector<hsize_t> max_dims(rows);
+    dims[0] = 0;
+    max_dims[0] = H5S_UNLIMITED;
+    hid_t space = H5Screate_simple(ndims, dims.data(), max_dims.data());
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+    std::vector<hsize_t> chunk(rows);
+    chunk[0] = std::max<hsize_t>(rows[0], 1);
+    H5Pset_chunk(plist, ndims, chunk.data());
+    dataset_id = H5Dcreate2(file_id, dataset_name.c_str(), mem_type_id, space,
+        H5P_DEFAULT, plist, H5P_DEFAULT);
+    H5Pclose(plist);
+    H5Sclose(space);
+  }
+  CHECK_GE(dataset_id, 0) << "Failed to open dataset " << dataset_name;
+  hid_t file_space = H5Dget_space(dataset_id);
+  CHECK_EQ(H5Sget_simple_extent_ndims(file_space), ndims)
+      << "Rows of another rank appended to " << dataset_name;
+  std::vector<hsize_t> dims(ndims);
+  H5Sget_simple_extent_dims(file_space, dims.data(), NULL);
+  H5Sclose(file_space);
+  for (int i = 1; i < ndims; ++i) {
+    CHECK_EQ(dims[i], rows[i])
+        << "Rows of another shape appended to " << dataset_name;
+  }
+  std::vector<hsize_t> start(ndims, 0);
+  start[0] = dims[0];
+  dims[0] += rows[0];
+  herr_t status = H5Dset_extent(dataset_id, dims.data());
+  CHECK_GE(status, 0) << "Failed to extend dataset " << dataset_name;
+  file_space = H5Dget_space(dataset_id);
+  status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, start.data(),
+      NULL, rows.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows of " << dataset_name;
+  hid_t mem_space = H5Screate_simple(ndims, rows.data(), NULL);
+  status = H5Dwrite(dataset_id, mem_type_id, mem_space, file_space,
+      H5P_DEFAULT, data);
+  CHECK_GE(status, 0) << "Failed to append to dataset " << dataset_name;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset_id);
+}
+
+template <>
+void hdf5_append_nd_dataset<float>(hid_t file_id, const string& dataset_name,
+    const Blob<float>& blob) {
+  hdf5_append_helper(file_id, dataset_name, blob.shape(), H5T_NATIVE_FLOAT,
+      blob.cpu_data());
+}
+
+template <>
+void hdf5_append_nd_dataset<double>(hid_t file_id, const string& dataset_name,
+    const Blob<double>& blob) {
+  hdf5_append_helper(file_id, dataset_name, blob.shape(), H5T_NATIVE_DOUBLE,
+      blob.cpu_data());
+}
+
 template <>
 void hdf5_save_nd_dataset<float>(
     const hid_t file_id, const string& dataset_name, const Blob<float>& blob,
@@ -1,8 +1,13 @@
 #include <boost/math/special_functions/next.hpp>
 #include <boost/random.hpp>
 
+#include <cstring>
 #include <limits>
 
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
 #include "caffe/common.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -372,4 +377,93 @@ void caffe_cpu_scale<double>(const int n, const double alpha, const double *x,
   cblas_dscal(n, alpha, y, 1);
 }
 
+static inline uint16_t float2half(const float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000) {
+    // Inf stays inf, NaN stays a (quiet) NaN.
+    return sign | 0x7c00 | (x > 0x7f800000 ? 0x0200 : 0);
+  }
+  if (x >= 0x477ff000) {
+    // Rounds to a value above 65504, the largest finite half.
+    return sign | 0x7c00;
+  }
+  if (x < 0x38800000) {
+    // Below 2^-14: the result is a half subnormal (or zero).
+    if (x < 0x33000000) {
+      return sign;
+    }
+    const int shift = 126 - (x >> 23);
+    const uint32_t mantissa = (x & 0x007fffff) | 0x00800000;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+  // Normal range: rebias the exponent and round the mantissa; a carry out of
+  // the mantissa correctly bumps the exponent.
+  uint32_t half = (x >> 13) - (112 << 10);
+  const uint32_t rest = x & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    ++half;
+  }
+  return sign | half;
+}
+
+static inline float half2float(const uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x03ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // Half subnormal: normalize it, fp32 has the range for it.
+    exponent = 113;
+    while (!(mantissa & 0x0400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x03ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+void caffe_cpu_float2half(const int n, const float* x, uint16_t* y) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = float2half(x[i]);
+  }
+}
+
+void caffe_cpu_half2float(const int n, const uint16_t* x, float* y) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = half2float(x[i]);
+  }
+}
+
 }  // namespace caffe
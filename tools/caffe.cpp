@@ -41,6 +41,12 @@ DEFINE_string(weights, "",
     "separated by ','. Cannot be set simultaneously with snapshot.");
 DEFINE_int32(iterations, 50,
     "The number of iterations to run.");
+DEFINE_int32(branch_threads, 1,
+    "Optional; the number of threads to run independent layers on, "
+    "in CPU mode.");
+DEFINE_string(timeline, "",
+    "Optional; the file to write the layer timeline of the last timed "
+    "iteration to, as a Chrome trace.");
 DEFINE_string(sigint_effect, "stop",
              "Optional; action to take when a SIGINT signal is received: "
               "snapshot, stop or none.");
@@ -315,6 +321,7 @@ int time() {
   }
   // Instantiate the caffe net.
   Net<float> caffe_net(FLAGS_model, caffe::TRAIN);
+  caffe_net.set_branch_threads(FLAGS_branch_threads);
 
   // Do a clean forward and backward pass, so that memory allocation are done
   // and future iterations will be more stable.
@@ -343,22 +350,36 @@ int time() {
   std::vector<double> backward_time_per_layer(layers.size(), 0.0);
   double forward_time = 0.0;
   double backward_time = 0.0;
+  // The net runs whole passes to overlap layers or record them; the layers
+  // are then timed in the timeline only
+  const bool whole_passes =
+      caffe_net.branch_threads() > 1 || FLAGS_timeline.size();
   for (int j = 0; j < FLAGS_iterations; ++j) {
     Timer iter_timer;
     iter_timer.Start();
+    caffe_net.set_record_timeline(FLAGS_timeline.size() &&
+        j == FLAGS_iterations - 1);
     forward_timer.Start();
-    for (int i = 0; i < layers.size(); ++i) {
-      timer.Start();
-      layers[i]->Forward(bottom_vecs[i], top_vecs[i]);
-      forward_time_per_layer[i] += timer.MicroSeconds();
+    if (whole_passes) {
+      caffe_net.ForwardFromTo(0, layers.size() - 1);
+    } else {
+      for (int i = 0; i < layers.size(); ++i) {
+        timer.Start();
+        layers[i]->Forward(bottom_vecs[i], top_vecs[i]);
+        forward_time_per_layer[i] += timer.MicroSeconds();
+      }
     }
     forward_time += forward_timer.MicroSeconds();
     backward_timer.Start();
-    for (int i = layers.size() - 1; i >= 0; --i) {
-      timer.Start();
-      layers[i]->Backward(top_vecs[i], bottom_need_backward[i],
-                          bottom_vecs[i]);
-      backward_time_per_layer[i] += timer.MicroSeconds();
+    if (whole_passes) {
+      caffe_net.BackwardFromTo(layers.size() - 1, 0);
+    } else {
+      for (int i = layers.size() - 1; i >= 0; --i) {
+        timer.Start();
+        layers[i]->Backward(top_vecs[i], bottom_need_backward[i],
+                            bottom_vecs[i]);
+        backward_time_per_layer[i] += timer.MicroSeconds();
+      }
     }
     backward_time += backward_timer.MicroSeconds();
     LOG(INFO) << "Iteration: " << j + 1 << " forward-backward time: "
@@ -383,6 +404,10 @@ int time() {
     FLAGS_iterations << " ms.";
   LOG(INFO) << "Total Time: " << total_timer.MilliSeconds() << " ms.";
   LOG(INFO) << "*** Benchmark ends ***";
+  if (FLAGS_timeline.size()) {
+    caffe_net.WriteTimeline(FLAGS_timeline);
+    LOG(INFO) << "Layer timeline written to " << FLAGS_timeline;
+  }
   return 0;
 }
 RegisterBrewFunction(time);
@@ -3,7 +3,9 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstring>
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
@@ -165,6 +167,61 @@ void parse_config_file(caffe::PsConfig& ps_config) {
      po::value<int>(&(ps_config.debug))
      ->default_value(0),
      "")
+    ("compression",
+     po::value<string>(&(ps_config.compression))
+     ->default_value("none"),
+     "lossy update encoding, sent dense: none, threshold:<t>, topk:<ratio>, "
+     "int8 or sign")
+    ("layer_compression",
+     po::value<string>(&(ps_config.layer_compression))
+     ->default_value(""),
+     "per-layer overrides, <layer>=<method>[,<layer>=<method>...]")
+    ("staleness_policy",
+     po::value<string>(&(ps_config.staleness_policy))
+     ->default_value("none"),
+     "learning rate scale for stale reads: none, inverse or sqrt")
+    ("staleness_momentum",
+     po::value<int>(&(ps_config.staleness_momentum))
+     ->default_value(0),
+     "also scale the momentum by the staleness policy")
+    ("distributed_test",
+     po::value<int>(&(ps_config.distributed_test))
+     ->default_value(0),
+     "split test_iter across the workers and report global test scores")
+    ("table_partition",
+     po::value<string>(&(ps_config.table_partition))
+     ->default_value("layers"),
+     "layers: layers_per_table layers per table, "
+     "bytes: balance the parameter bytes across num_ps_tables tables")
+    ("num_ps_tables",
+     po::value<int>(&(ps_config.num_ps_tables))
+     ->default_value(0),
+     "number of tables for table_partition=bytes, 0 for num_channels")
+    ("table_layout_file",
+     po::value<string>(&(ps_config.table_layout_file))
+     ->default_value(""),
+     "write the layer to table layout to this CSV file")
+    ("accumulate_gradients",
+     po::value<int>(&(ps_config.accumulate_gradients))
+     ->default_value(0),
+     "sum the gradients of the batches of a clock locally "
+     "and send one update per layer per clock")
+    ("sync_mode",
+     po::value<string>(&(ps_config.sync_mode))
+     ->default_value("stream"),
+     "stream: synchronize after every stage of a layer, "
+     "events: time the stages with events and only synchronize "
+     "before giving buffers back to GeePS; both modes wait for the "
+     "layer's work before every release, so only the timing changes")
+    ("recompute",
+     po::value<string>(&(ps_config.recompute))
+     ->default_value("none"),
+     "none, or cheap: recompute the tops of cheap layers in the backward "
+     "pass instead of keeping them")
+    ("recompute_budget",
+     po::value<size_t>(&(ps_config.recompute_budget))
+     ->default_value(0),
+     "bytes of activations to stop keeping, 0 for all the cheap layers")
     ("log_interval",
      po::value<int>(&(ps_config.geeps_config.log_interval))
      ->default_value(0),
@@ -306,6 +363,55 @@ int test() {
 RegisterBrewFunction(test);
 
 
+// Plan: simulate the GPU memory use of the PS access plan of a model,
+// without starting GeePS.
+int plan() {
+  CHECK_GT(FLAGS_solver.size(), 0) << "Need a solver definition to plan.";
+  caffe::SolverParameter solver_param;
+  caffe::ReadProtoFromTextFileOrDie(FLAGS_solver, &solver_param);
+  /* The nets are only built to get the blob shapes */
+  Caffe::set_mode(Caffe::CPU);
+
+  caffe::PsConfig ps_config;
+  parse_config_file(ps_config);
+  if (FLAGS_machinefile.size()) {
+    parse_hostfile(FLAGS_machinefile, ps_config.geeps_config.host_list);
+  }
+  ps_config.num_workers =
+      std::max(static_cast<int>(ps_config.geeps_config.host_list.size()), 1);
+  ps_config.worker_id = 0;
+  ps_config.plan_only = 1;
+  shared_ptr<caffe::Solver<float> >
+    solver(caffe::SolverRegistry<float>::CreateSolver(
+        solver_param, &ps_config));
+
+  vector<caffe::PlannedAccess> plan;
+  solver->PlanAccesses(&plan);
+  const size_t capacity = ps_config.geeps_config.gpu_memory_capacity;
+  caffe::AccessPlanStats stats;
+  caffe::SimulateAccessPlan(plan, capacity, &stats);
+
+  const double mb = 1 << 20;
+  for (int i = 0; i < stats.compute_names.size(); ++i) {
+    LOG(INFO) << stats.compute_names[i] << ": "
+        << stats.compute_live_bytes[i] / mb << " MB live";
+  }
+  if (capacity != std::numeric_limits<size_t>::max()) {
+    LOG(INFO) << "GPU memory capacity: " << capacity / mb << " MB";
+  }
+  LOG(INFO) << "Peak live: " << stats.peak_live_bytes / mb << " MB";
+  LOG(INFO) << "Peak resident: " << stats.peak_resident_bytes / mb << " MB";
+  LOG(INFO) << "Swapped in per clock: " << stats.swap_in_bytes / mb << " MB";
+  LOG(INFO) << "Swapped out per clock: "
+      << stats.swap_out_bytes / mb << " MB";
+  if (stats.peak_live_bytes > capacity) {
+    LOG(ERROR) << "The buffers used at once do not fit in the capacity";
+    return 1;
+  }
+  return 0;
+}
+RegisterBrewFunction(plan);
+
 // Time: benchmark the execution time of a model.
 int time() {
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to time.";
@@ -405,6 +511,7 @@ int main(int argc, char** argv) {
       "  train           train or finetune a model\n"
       "  test            score a model\n"
       "  device_query    show GPU diagnostic information\n"
+      "  plan            simulate the PS memory use of a solver's nets\n"
       "  time            benchmark model execution time");
   // Run tool or show usage.
   caffe::GlobalInit(&argc, &argv);
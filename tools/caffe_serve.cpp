@@ -0,0 +1,479 @@
+// This program serves a trained classifier. It reads requests, one image
+// path per line, from stdin or from the clients of a Unix socket, and
+// answers each with a line holding the path and its top-k predictions:
+//   path label:score label:score ...
+// or "path ERROR reason" when the image cannot be read.
+// Usage:
+//   caffe_serve -model deploy.prototxt -weights net.caffemodel [FLAGS]
+//
+// The images are decoded and preprocessed on a pool of threads. Requests
+// that are ready are grouped in batches of up to -max_batch, waiting at most
+// -max_delay_ms after the first one arrived, and each batch takes a single
+// Net::Forward. Latency percentiles and throughput are logged every
+// -report_every requests and when stdin ends.
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#endif  // USE_OPENCV
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/caffe.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/io.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using boost::posix_time::ptime;
+
+DEFINE_string(model, "",
+    "The deploy model definition protocol buffer text file.");
+DEFINE_string(weights, "",
+    "The trained weights.");
+DEFINE_int32(gpu, -1,
+    "Run in GPU mode on given device ID.");
+DEFINE_string(labels, "",
+    "Optional; a file with one label per output, in order.");
+DEFINE_string(mean_file, "",
+    "Optional; the binaryproto mean of the input, of the input size.");
+DEFINE_string(mean_value, "",
+    "Optional; the mean of each channel, separated by ','.");
+DEFINE_double(scale, 1,
+    "The factor the input is multiplied by after removing the mean.");
+DEFINE_int32(top_k, 5,
+    "The number of predictions returned per request.");
+DEFINE_int32(max_batch, 16,
+    "The largest number of requests run in one Forward.");
+DEFINE_int32(max_delay_ms, 5,
+    "How long a request may wait for others to join its batch.");
+DEFINE_int32(preprocess_threads, 4,
+    "The number of threads that decode and preprocess images.");
+DEFINE_string(socket, "",
+    "Optional; serve the clients of this Unix socket instead of stdin.");
+DEFINE_int32(report_every, 1000,
+    "Log the latency and throughput every that many requests.");
+
+static ptime Now() {
+  return boost::posix_time::microsec_clock::universal_time();
+}
+
+// The stream of one client; requests are read from in_fd and answered on
+// out_fd. An owned socket is closed once its last request is answered.
+class Connection {
+ public:
+  Connection(int in_fd, int out_fd, bool owned)
+      : in_fd_(in_fd), out_fd_(out_fd), owned_(owned) {}
+  ~Connection() {
+    if (owned_) {
+      close(in_fd_);
+    }
+  }
+
+  // Reads the next line without its '\n'; false at the end of the stream.
+  bool ReadLine(string* line) {
+    for (;;) {
+      size_t end = buffer_.find('\n');
+      if (end != string::npos) {
+        line->assign(buffer_, 0, end);
+        buffer_.erase(0, end + 1);
+        return true;
+      }
+      char chunk[4096];
+      ssize_t n = read(in_fd_, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        line->swap(buffer_);
+        buffer_.clear();
+        return !line->empty();
+      }
+      buffer_.append(chunk, n);
+    }
+  }
+
+  void WriteLine(const string& line) {
+    boost::mutex::scoped_lock lock(write_mutex_);
+    const string data = line + "\n";
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n = write(out_fd_, data.data() + done, data.size() - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        LOG(WARNING) << "Dropping a response: " << strerror(errno);
+        return;
+      }
+      done += n;
+    }
+  }
+
+ private:
+  int in_fd_;
+  int out_fd_;
+  bool owned_;
+  string buffer_;
+  boost::mutex write_mutex_;
+};
+
+struct Request {
+  shared_ptr<Connection> connection;
+  string path;
+  ptime arrival;
+  vector<float> input;
+};
+
+// A queue of requests that consumers can wait on until a deadline, and that
+// producers close once they are done.
+class RequestQueue {
+ public:
+  explicit RequestQueue(int num_producers) : producers_(num_producers) {}
+
+  void Push(Request* request) {
+    boost::mutex::scoped_lock lock(mutex_);
+    queue_.push_back(request);
+    lock.unlock();
+    condition_.notify_one();
+  }
+
+  // Called once by each producer; wakes all consumers after the last one.
+  void Close() {
+    boost::mutex::scoped_lock lock(mutex_);
+    CHECK_GT(producers_, 0);
+    --producers_;
+    lock.unlock();
+    condition_.notify_all();
+  }
+
+  // Pops the next request, waiting until the deadline if given. Returns
+  // false on timeout, or when the queue is closed and empty.
+  bool Pop(Request** request, const ptime* deadline) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (queue_.empty()) {
+      if (!producers_) {
+        return false;
+      }
+      if (deadline == NULL) {
+        condition_.wait(lock);
+      } else if (!condition_.timed_wait(lock, *deadline) && queue_.empty()) {
+        return false;
+      }
+    }
+    *request = queue_.front();
+    queue_.pop_front();
+    return true;
+  }
+
+ private:
+  std::deque<Request*> queue_;
+  int producers_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+};
+
+// Latency percentiles and throughput, over the last window and overall.
+// The window keeps its latencies, at most -report_every of them. The
+// overall percentiles come from a histogram with buckets 1% apart, so the
+// memory stays bounded however long the server runs.
+class ServeStats {
+ public:
+  ServeStats() : start_(Now()), window_start_(start_),
+      all_buckets_(kNumBuckets, 0), all_count_(0), requests_(0),
+      batches_(0) {}
+
+  void AddBatch(const vector<Request*>& batch, const ptime& done) {
+    for (int i = 0; i < batch.size(); ++i) {
+      double ms = (done - batch[i]->arrival).total_microseconds() / 1000.;
+      if (FLAGS_report_every > 0) {
+        window_.push_back(ms);
+      }
+      ++all_buckets_[Bucket(ms)];
+      ++all_count_;
+    }
+    requests_ += batch.size();
+    ++batches_;
+    if (FLAGS_report_every > 0 && window_.size() >= FLAGS_report_every) {
+      std::sort(window_.begin(), window_.end());
+      Report("last " + format_int(window_.size()), window_.size(),
+          window_[window_.size() / 2], window_[window_.size() * 99 / 100],
+          window_start_);
+      window_.clear();
+      window_start_ = Now();
+    }
+  }
+
+  void ReportAll() {
+    Report("all", all_count_, Percentile(all_count_ / 2),
+        Percentile(all_count_ * 99 / 100), start_);
+  }
+
+ private:
+  static const int kNumBuckets = 2048;
+  static const double kMinMs;
+  static const double kGrowth;
+
+  // The bucket of a latency; bucket i holds the latencies up to
+  // kMinMs * kGrowth^i ms, and the last one everything above.
+  static int Bucket(double ms) {
+    if (ms <= kMinMs) {
+      return 0;
+    }
+    double bucket = std::ceil(std::log(ms / kMinMs) / std::log(kGrowth));
+    return static_cast<int>(std::min(bucket, kNumBuckets - 1.));
+  }
+
+  // The upper bound of the bucket of the rank-th smallest latency.
+  double Percentile(int64_t rank) const {
+    int64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      seen += all_buckets_[i];
+      if (seen > rank) {
+        return kMinMs * std::pow(kGrowth, i);
+      }
+    }
+    return kMinMs * std::pow(kGrowth, kNumBuckets - 1);
+  }
+
+  void Report(const string& name, int64_t count, double p50, double p99,
+      const ptime& since) {
+    if (!count) {
+      return;
+    }
+    const double seconds =
+        std::max((Now() - since).total_microseconds() / 1e6, 1e-6);
+    LOG(INFO) << "Requests (" << name << "): "
+        << count / seconds << " req/s, latency p50 "
+        << p50 << " ms, p99 " << p99 << " ms; "
+        << static_cast<double>(requests_) / std::max<int64_t>(batches_, 1)
+        << " requests per batch";
+  }
+
+  ptime start_;
+  ptime window_start_;
+  vector<double> window_;
+  vector<int64_t> all_buckets_;
+  int64_t all_count_;
+  int64_t requests_;
+  int64_t batches_;
+};
+
+const double ServeStats::kMinMs = 0.01;
+const double ServeStats::kGrowth = 1.01;
+
+// Queues the requests of a client; the stdin reader then closes the queue.
+static void ReadRequests(shared_ptr<Connection> connection,
+    RequestQueue* raw, bool close_at_end) {
+  string line;
+  while (connection->ReadLine(&line)) {
+    boost::trim(line);
+    if (line.empty()) {
+      continue;
+    }
+    Request* request = new Request();
+    request->connection = connection;
+    request->path = line;
+    request->arrival = Now();
+    raw->Push(request);
+  }
+  if (close_at_end) {
+    raw->Close();
+  }
+}
+
+static void AcceptClients(int listen_fd, RequestQueue* raw) {
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      LOG_IF(WARNING, errno != EINTR) << "accept: " << strerror(errno);
+      continue;
+    }
+    shared_ptr<Connection> connection(new Connection(fd, fd, true));
+    boost::thread(boost::bind(&ReadRequests, connection, raw, false)).detach();
+  }
+}
+
+static void Preprocess(const TransformationParameter& param,
+    const vector<int>& shape, RequestQueue* raw, RequestQueue* ready) {
+  DataTransformer<float> transformer(param, TEST);
+  Blob<float> blob(shape);
+  Request* request;
+  while (raw->Pop(&request, NULL)) {
+#ifdef USE_OPENCV
+    cv::Mat image = ReadImageToCVMat(request->path, shape[2], shape[3],
+        shape[1] == 3);
+    if (!image.data) {
+      request->connection->WriteLine(request->path + " ERROR cannot read");
+      delete request;
+      continue;
+    }
+    transformer.Transform(image, &blob);
+    request->input.assign(blob.cpu_data(), blob.cpu_data() + blob.count());
+#endif  // USE_OPENCV
+    ready->Push(request);
+  }
+  ready->Close();
+}
+
+static void Respond(const vector<Request*>& batch, const Blob<float>& output,
+    const vector<string>& labels) {
+  const int dim = output.count(1);
+  const int k = std::min(FLAGS_top_k, dim);
+  for (int i = 0; i < batch.size(); ++i) {
+    const float* scores = output.cpu_data() + i * dim;
+    vector<std::pair<float, int> > pairs(dim);
+    for (int j = 0; j < dim; ++j) {
+      pairs[j] = std::make_pair(-scores[j], j);
+    }
+    std::partial_sort(pairs.begin(), pairs.begin() + k, pairs.end());
+    std::ostringstream response;
+    response << batch[i]->path;
+    for (int j = 0; j < k; ++j) {
+      const int label = pairs[j].second;
+      response << " " << (labels.empty() ? format_int(label) : labels[label])
+          << ":" << scores[label];
+    }
+    batch[i]->connection->WriteLine(response.str());
+  }
+}
+
+int main(int argc, char** argv) {
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Serve a trained classifier with dynamic batching.\n"
+      "Usage:\n"
+      "    caffe_serve -model deploy.prototxt -weights net.caffemodel "
+      "[FLAGS] < image_list\n");
+  caffe::GlobalInit(&argc, &argv);
+  if (FLAGS_model.empty() || FLAGS_weights.empty()) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/caffe_serve");
+    return 1;
+  }
+#ifndef USE_OPENCV
+  LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
+#endif  // USE_OPENCV
+  CHECK_GT(FLAGS_max_batch, 0);
+  CHECK_GT(FLAGS_preprocess_threads, 0);
+  if (FLAGS_gpu >= 0) {
+    LOG(INFO) << "Use GPU with device ID " << FLAGS_gpu;
+    Caffe::SetDevice(FLAGS_gpu);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(INFO) << "Use CPU.";
+    Caffe::set_mode(Caffe::CPU);
+  }
+
+  Net<float> net(FLAGS_model, TEST);
+  net.CopyTrainedLayersFrom(FLAGS_weights);
+  CHECK_EQ(net.num_inputs(), 1) << "Network should have exactly one input.";
+  CHECK_EQ(net.num_outputs(), 1) << "Network should have exactly one output.";
+  Blob<float>* input = net.input_blobs()[0];
+  CHECK_EQ(input->num_axes(), 4) << "Input should be N x C x H x W.";
+  vector<int> shape = input->shape();
+  shape[0] = 1;
+
+  vector<string> labels;
+  if (!FLAGS_labels.empty()) {
+    std::ifstream file(FLAGS_labels.c_str());
+    CHECK(file) << "Unable to open labels file " << FLAGS_labels;
+    string line;
+    while (std::getline(file, line)) {
+      labels.push_back(line);
+    }
+    CHECK_EQ(labels.size(), net.output_blobs()[0]->count(1))
+        << "Number of labels is different from the output dimension.";
+  }
+
+  TransformationParameter transform_param;
+  transform_param.set_scale(FLAGS_scale);
+  if (!FLAGS_mean_file.empty()) {
+    transform_param.set_mean_file(FLAGS_mean_file);
+  }
+  vector<string> mean_values;
+  boost::split(mean_values, FLAGS_mean_value, boost::is_any_of(","));
+  for (int i = 0; i < mean_values.size(); ++i) {
+    if (!mean_values[i].empty()) {
+      transform_param.add_mean_value(atof(mean_values[i].c_str()));
+    }
+  }
+
+  // Requests flow from the readers to the preprocessing pool, and from the
+  // pool to this thread, which batches them.
+  RequestQueue raw(1);
+  RequestQueue ready(FLAGS_preprocess_threads);
+  boost::thread_group threads;
+  for (int i = 0; i < FLAGS_preprocess_threads; ++i) {
+    threads.create_thread(boost::bind(&Preprocess, transform_param, shape,
+        &raw, &ready));
+  }
+  if (FLAGS_socket.empty()) {
+    shared_ptr<Connection> connection(
+        new Connection(STDIN_FILENO, STDOUT_FILENO, false));
+    threads.create_thread(boost::bind(&ReadRequests, connection, &raw,
+        true));
+  } else {
+    signal(SIGPIPE, SIG_IGN);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    CHECK_LT(FLAGS_socket.size(), sizeof(address.sun_path))
+        << "Socket path too long: " << FLAGS_socket;
+    strncpy(address.sun_path, FLAGS_socket.c_str(),
+        sizeof(address.sun_path) - 1);
+    unlink(FLAGS_socket.c_str());
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    PCHECK(listen_fd >= 0) << "socket";
+    PCHECK(bind(listen_fd, reinterpret_cast<sockaddr*>(&address),
+        sizeof(address)) == 0) << "bind " << FLAGS_socket;
+    PCHECK(listen(listen_fd, 64) == 0) << "listen " << FLAGS_socket;
+    LOG(INFO) << "Listening on " << FLAGS_socket;
+    boost::thread(boost::bind(&AcceptClients, listen_fd, &raw)).detach();
+  }
+
+  ServeStats stats;
+  const boost::posix_time::milliseconds max_delay(FLAGS_max_delay_ms);
+  vector<Request*> batch;
+  Request* request;
+  while (ready.Pop(&request, NULL)) {
+    batch.assign(1, request);
+    const ptime deadline = request->arrival + max_delay;
+    while (batch.size() < FLAGS_max_batch && ready.Pop(&request, &deadline)) {
+      batch.push_back(request);
+    }
+    shape[0] = batch.size();
+    input->Reshape(shape);
+    net.Reshape();
+    float* data = input->mutable_cpu_data();
+    for (int i = 0; i < batch.size(); ++i) {
+      std::copy(batch[i]->input.begin(), batch[i]->input.end(),
+          data + i * batch[i]->input.size());
+    }
+    const Blob<float>& output = *net.ForwardPrefilled()[0];
+    Respond(batch, output, labels);
+    stats.AddBatch(batch, Now());
+    for (int i = 0; i < batch.size(); ++i) {
+      delete batch[i];
+    }
+  }
+  // Only stdin ends; the reader closes the raw queue at its end.
+  threads.join_all();
+  stats.ReportAll();
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <stdint.h>
+#include <boost/thread.hpp>
 #include <algorithm>
+#include <cmath>
 #include <string>
 #include <utility>
 #include <vector>
@@ -9,6 +11,7 @@
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
@@ -20,6 +23,101 @@ using boost::scoped_ptr;
 
 DEFINE_string(backend, "lmdb",
         "The backend {leveldb, lmdb} containing the images");
+DEFINE_int32(threads, 0,
+        "The number of threads that read the db; 0 uses one per core");
+DEFINE_bool(channel_std, false,
+        "Also compute the standard deviation of each channel");
+
+#ifdef USE_OPENCV
+// The records of the db are dealt to the threads in chunks of this many.
+static const int kChunk = 64;
+// Byte images are summed in 32 bits, and flushed to the 64 bit sums before
+// 255 * kFlushEvery could overflow.
+static const int kFlushEvery = 1 << 24;
+
+// The sums of one thread, reduced by the main thread at the end.
+struct MeanAccumulator {
+  MeanAccumulator(int data_size, int channels)
+      : sums(data_size, 0), partial(data_size, 0), float_sums(data_size, 0),
+        squares(channels, 0), float_squares(channels, 0), pending(0),
+        count(0) {}
+
+  void Flush() {
+    for (int i = 0; i < partial.size(); ++i) {
+      sums[i] += partial[i];
+      partial[i] = 0;
+    }
+    pending = 0;
+  }
+
+  std::vector<uint64_t> sums;
+  std::vector<uint32_t> partial;
+  std::vector<double> float_sums;
+  std::vector<uint64_t> squares;
+  std::vector<double> float_squares;
+  int pending;
+  int count;
+};
+
+// Sums the records of every num_threads-th chunk of the db, starting at
+// chunk thread_id, walking a cursor of its own.
+static void AccumulateRecords(db::DB* db, int thread_id, int num_threads,
+    int data_size, MeanAccumulator* acc) {
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  const int channels = acc->squares.size();
+  const int dim = data_size / channels;
+  Datum datum;
+  for (int index = 0; cursor->valid(); cursor->Next(), ++index) {
+    if ((index / kChunk) % num_threads != thread_id) {
+      continue;
+    }
+    datum.ParseFromString(cursor->value());
+    DecodeDatumNative(&datum);
+
+    const std::string& data = datum.data();
+    const int size_in_datum = std::max<int>(datum.data().size(),
+        datum.float_data_size());
+    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
+        size_in_datum;
+    if (data.size() != 0) {
+      // Plain integer loops, which the compiler vectorizes.
+      const uint8_t* pixels = reinterpret_cast<const uint8_t*>(data.data());
+      uint32_t* partial = &acc->partial[0];
+      for (int i = 0; i < data_size; ++i) {
+        partial[i] += pixels[i];
+      }
+      if (FLAGS_channel_std) {
+        for (int c = 0; c < channels; ++c) {
+          const uint8_t* channel = pixels + c * dim;
+          uint64_t square = 0;
+          for (int i = 0; i < dim; ++i) {
+            square += static_cast<uint32_t>(channel[i]) * channel[i];
+          }
+          acc->squares[c] += square;
+        }
+      }
+      if (++acc->pending == kFlushEvery) {
+        acc->Flush();
+      }
+    } else {
+      CHECK_EQ(datum.float_data_size(), data_size);
+      const float* values = datum.float_data().data();
+      for (int i = 0; i < data_size; ++i) {
+        acc->float_sums[i] += values[i];
+      }
+      if (FLAGS_channel_std) {
+        for (int c = 0; c < channels; ++c) {
+          for (int i = c * dim; i < (c + 1) * dim; ++i) {
+            acc->float_squares[c] += static_cast<double>(values[i]) * values[i];
+          }
+        }
+      }
+    }
+    ++acc->count;
+  }
+  acc->Flush();
+}
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -44,9 +142,9 @@ int main(int argc, char** argv) {
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[1], db::READ);
   scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  CHECK(cursor->valid()) << "The db " << argv[1] << " is empty";
 
   BlobProto sum_blob;
-  int count = 0;
   // load first datum
   Datum datum;
   datum.ParseFromString(cursor->value());
@@ -54,6 +152,7 @@ int main(int argc, char** argv) {
   if (DecodeDatumNative(&datum)) {
     LOG(INFO) << "Decoding Datum";
   }
+  cursor.reset();
 
   sum_blob.set_num(1);
   sum_blob.set_channels(datum.channels());
@@ -65,41 +164,41 @@ int main(int argc, char** argv) {
   for (int i = 0; i < size_in_datum; ++i) {
     sum_blob.add_data(0.);
   }
-  LOG(INFO) << "Starting Iteration";
-  while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
-
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
-      }
+  const int num_threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  LOG(INFO) << "Starting Iteration on " << num_threads << " threads";
+  CPUTimer timer;
+  timer.Start();
+  std::vector<MeanAccumulator*> accumulators;
+  boost::thread_group threads;
+  for (int t = 0; t < num_threads; ++t) {
+    accumulators.push_back(new MeanAccumulator(data_size, datum.channels()));
+    threads.create_thread(boost::bind(&AccumulateRecords, db.get(), t,
+        num_threads, data_size, accumulators[t]));
+  }
+  threads.join_all();
+
+  // Reduce the sums of the threads
+  MeanAccumulator total(data_size, datum.channels());
+  for (int t = 0; t < num_threads; ++t) {
+    const MeanAccumulator& acc = *accumulators[t];
+    for (int i = 0; i < data_size; ++i) {
+      total.sums[i] += acc.sums[i];
+      total.float_sums[i] += acc.float_sums[i];
     }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
+    for (int c = 0; c < datum.channels(); ++c) {
+      total.squares[c] += acc.squares[c];
+      total.float_squares[c] += acc.float_squares[c];
     }
-    cursor->Next();
-  }
-
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+    total.count += acc.count;
+    delete accumulators[t];
   }
+  const int count = total.count;
+  const double seconds = timer.MicroSeconds() / 1e6;
+  LOG(INFO) << "Processed " << count << " files in " << seconds << " s, "
+      << count / std::max(seconds, 1e-6) << " files/s.";
   for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+    sum_blob.set_data(i, (total.sums[i] + total.float_sums[i]) / count);
   }
   // Write to disk
   if (argc == 3) {
@@ -116,6 +215,16 @@ int main(int argc, char** argv) {
     }
     LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c] / dim;
   }
+  if (FLAGS_channel_std) {
+    // Over all the pixels of a channel: var = E[x^2] - E[x]^2
+    for (int c = 0; c < channels; ++c) {
+      const double mean = mean_values[c] / dim;
+      const double square = (total.squares[c] + total.float_squares[c]) /
+          (static_cast<double>(count) * dim);
+      LOG(INFO) << "std channel [" << c << "]:"
+          << std::sqrt(std::max(square - mean * mean, 0.));
+    }
+  }
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -8,8 +8,10 @@
 //   subfolder1/file1.JPEG 7
 //   ....
 
+#include <boost/thread.hpp>
 #include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
@@ -19,6 +21,7 @@
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
@@ -45,6 +48,143 @@ DEFINE_string(encode_type, "",
 DEFINE_int32(newdb, 1, "");
 DEFINE_int32(start, 0, "");
 DEFINE_int32(count, -1, "");
+DEFINE_int32(threads, 0,
+    "The number of threads that decode, resize and encode the images; "
+    "0 uses one per core");
+DEFINE_int32(commit_every, 1000,
+    "The number of images written in each db transaction");
+
+#ifdef USE_OPENCV
+struct ConvertedImage {
+  bool status;
+  int shape_size;
+  int data_size;
+  string record;
+};
+
+// Converts the images of a list on a pool of threads, and hands the
+// serialized Datums back in list order through a reorder buffer, which
+// holds at most kWindow images per thread ahead of the writer.
+class ConvertQueue {
+ public:
+  ConvertQueue(const std::vector<std::pair<std::string, int> >& lines,
+      const string& root_folder, int resize_height, int resize_width,
+      bool is_color, bool encoded, const string& encode_type)
+      : lines_(lines), root_folder_(root_folder),
+        resize_height_(resize_height), resize_width_(resize_width),
+        is_color_(is_color), encoded_(encoded), encode_type_(encode_type),
+        decode_time_(0), serialize_time_(0) {}
+
+  void Start(int first_line, int end_line, int num_threads) {
+    next_line_ = first_line;
+    end_line_ = end_line;
+    write_line_ = first_line;
+    window_ = kWindow * num_threads;
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.create_thread(boost::bind(&ConvertQueue::Run, this));
+    }
+  }
+
+  // Waits for the image of line_id, which must be the next line in order.
+  ConvertedImage Pop(int line_id) {
+    boost::mutex::scoped_lock lock(mutex_);
+    CHECK_EQ(line_id, write_line_);
+    std::map<int, ConvertedImage>::iterator it;
+    while ((it = ready_.find(line_id)) == ready_.end()) {
+      ready_condition_.wait(lock);
+    }
+    ConvertedImage image;
+    std::swap(image, it->second);
+    ready_.erase(it);
+    ++write_line_;
+    space_condition_.notify_all();
+    return image;
+  }
+
+  void Join() {
+    threads_.join_all();
+  }
+
+  // Microseconds spent over all threads
+  double decode_time() const { return decode_time_; }
+  double serialize_time() const { return serialize_time_; }
+
+ private:
+  static const int kWindow = 64;
+
+  void Run() {
+    Datum datum;
+    caffe::CPUTimer timer;
+    double decode_time = 0;
+    double serialize_time = 0;
+    for (;;) {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (next_line_ < end_line_ && next_line_ >= write_line_ + window_) {
+        space_condition_.wait(lock);
+      }
+      if (next_line_ >= end_line_) {
+        break;
+      }
+      const int line_id = next_line_++;
+      lock.unlock();
+
+      ConvertedImage image;
+      timer.Start();
+      std::string enc = encode_type_;
+      if (encoded_ && !enc.size()) {
+        // Guess the encoding type from the file name
+        string fn = lines_[line_id].first;
+        size_t p = fn.rfind('.');
+        if ( p == fn.npos )
+          LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+        enc = fn.substr(p);
+        std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+      }
+      image.status = ReadImageToDatum(root_folder_ + lines_[line_id].first,
+          lines_[line_id].second, resize_height_, resize_width_, is_color_,
+          enc, &datum);
+      decode_time += timer.MicroSeconds();
+      if (image.status) {
+        // CHECK(status) << " #" << line_id << " failed";
+        if (datum.height() != 256 || datum.width() != 256) {
+          LOG(ERROR) <<lines_[line_id].first;
+        }
+        timer.Start();
+        image.shape_size = datum.channels() * datum.height() * datum.width();
+        image.data_size = datum.data().size();
+        CHECK(datum.SerializeToString(&image.record));
+        serialize_time += timer.MicroSeconds();
+      }
+
+      lock.lock();
+      std::swap(ready_[line_id], image);
+      ready_condition_.notify_all();
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    decode_time_ += decode_time;
+    serialize_time_ += serialize_time;
+  }
+
+  const std::vector<std::pair<std::string, int> >& lines_;
+  const string root_folder_;
+  const int resize_height_;
+  const int resize_width_;
+  const bool is_color_;
+  const bool encoded_;
+  const string encode_type_;
+  int next_line_;
+  int end_line_;
+  int write_line_;
+  int window_;
+  std::map<int, ConvertedImage> ready_;
+  double decode_time_;
+  double serialize_time_;
+  boost::mutex mutex_;
+  boost::condition_variable ready_condition_;
+  boost::condition_variable space_condition_;
+  boost::thread_group threads_;
+};
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
 #ifdef USE_OPENCV
@@ -100,68 +240,69 @@ int main(int argc, char** argv) {
   scoped_ptr<db::Transaction> txn(db->NewTransaction());
 
   // Storing to db
-  std::string root_folder(argv[1]);
-  Datum datum;
-  int line_id;
+  ConvertQueue queue(lines, string(argv[1]), resize_height, resize_width,
+      is_color, encoded, encode_type);
+  const int first_line = std::min<int>(FLAGS_start, lines.size());
+  const int end_line = FLAGS_count >= 0 ?
+      std::min<int>(first_line + FLAGS_count, lines.size()) : lines.size();
+  CHECK_GT(FLAGS_commit_every, 0);
+  const int num_threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  LOG(INFO) << "Converting with " << num_threads << " threads";
+  queue.Start(first_line, end_line, num_threads);
+
+  // The records are written in list order as they become ready.
   int data_size = 0;
   bool data_size_initialized = false;
-
-  for (line_id = 0; line_id < lines.size(); ++line_id) {
-    if (line_id < FLAGS_start) {
-      continue;
-    }
-    if (FLAGS_count >= 0 && line_id >= FLAGS_start + FLAGS_count) {
-      continue;
-    }
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
-    }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
-    // CHECK(status) << " #" << line_id << " failed";
-    if (datum.height() != 256 || datum.width() != 256) {
-      LOG(ERROR) <<lines[line_id].first;
-    }
+  int num_written = 0;
+  double write_time = 0;
+  caffe::CPUTimer timer;
+  caffe::CPUTimer total_timer;
+  total_timer.Start();
+  for (int line_id = first_line; line_id < end_line; ++line_id) {
+    ConvertedImage image = queue.Pop(line_id);
+    if (!image.status) continue;
+    timer.Start();
     if (check_size) {
       if (!data_size_initialized) {
-        data_size = datum.channels() * datum.height() * datum.width();
+        data_size = image.shape_size;
         data_size_initialized = true;
       } else {
-        const std::string& data = datum.data();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
+        CHECK_EQ(image.data_size, data_size) << "Incorrect data field size "
+            << image.data_size;
       }
     }
     // sequential
     string key_str = caffe::format_int(line_id, 8) + "_" + lines[line_id].first;
 
     // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(key_str, out);
+    txn->Put(key_str, image.record);
+    ++num_written;
 
-    if ((line_id + 1) % 1000 == 0) {
+    if (num_written % FLAGS_commit_every == 0) {
       // Commit db
       txn->Commit();
       txn.reset(db->NewTransaction());
       LOG(ERROR) << "Processed " << line_id + 1 << " files.";
     }
+    write_time += timer.MicroSeconds();
   }
   // write the last batch
-  if ((line_id + 1) % 1000 != 0) {
+  if (num_written % FLAGS_commit_every != 0) {
+    timer.Start();
     txn->Commit();
-    LOG(ERROR) << "Processed " << line_id + 1 << " files.";
+    write_time += timer.MicroSeconds();
   }
+  queue.Join();
+  const double seconds = total_timer.MicroSeconds() / 1e6;
+  LOG(ERROR) << "Processed " << end_line << " files.";
+  LOG(ERROR) << "Wrote " << num_written << " images in " << seconds << " s, "
+      << num_written / std::max(seconds, 1e-6) << " images/s";
+  LOG(ERROR) << "Per image: decode " << queue.decode_time() / 1000 /
+      std::max(end_line - first_line, 1) << " ms and serialize "
+      << queue.serialize_time() / 1000 / std::max(end_line - first_line, 1)
+      << " ms on " << num_threads << " threads, write "
+      << write_time / 1000 / std::max(num_written, 1) << " ms";
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
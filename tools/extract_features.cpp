@@ -1,3 +1,11 @@
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
 
@@ -8,9 +16,11 @@
 #include "caffe/common.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 
 using caffe::Blob;
 using caffe::Caffe;
@@ -19,6 +29,183 @@ using caffe::Net;
 using std::string;
 namespace db = caffe::db;
 
+// Stores the features of one blob on its own thread, into a db of Datum
+// or, for the raw_float32 and raw_fp16 types, into a flat file of rows that
+// can be memory mapped: row i starts at byte i * dim * element size, and
+// NAME.index records the element type and the shape.
+template<typename Dtype>
+class FeatureWriter {
+ public:
+  FeatureWriter(const string& name, const string& db_type,
+      const string& blob_name)
+      : name_(name), blob_name_(blob_name), raw_(db_type.find("raw_") == 0),
+        fp16_(db_type == "raw_fp16"), file_(NULL), num_rows_(0), pending_(0),
+        free_(kBuffers), done_(false) {
+    if (raw_) {
+      CHECK(fp16_ || db_type == "raw_float32")
+          << "Unknown raw format " << db_type;
+      file_ = fopen(name.c_str(), "wb");
+      CHECK(file_) << "Failed to open " << name;
+    } else {
+      db_.reset(db::GetDB(db_type));
+      db_->Open(name, db::NEW);
+      txn_.reset(db_->NewTransaction());
+    }
+    thread_.reset(new boost::thread(&FeatureWriter::Run, this));
+  }
+
+  // Copies the batch, waiting while the writer still holds kBuffers batches.
+  void Push(const Blob<Dtype>& blob) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!free_) {
+      condition_.wait(lock);
+    }
+    --free_;
+    lock.unlock();
+    Buffer& buffer = buffers_[pending_++ % kBuffers];
+    buffer.shape = blob.shape();
+    buffer.data.assign(blob.cpu_data(), blob.cpu_data() + blob.count());
+    lock.lock();
+    queue_.push_back(&buffer);
+    condition_.notify_all();
+  }
+
+  // Writes the queued batches, closes the output and joins the thread.
+  void Finish() {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      condition_.notify_all();
+    }
+    thread_->join();
+    if (raw_) {
+      CHECK_EQ(fclose(file_), 0) << "Failed to write " << name_;
+      std::ofstream index((name_ + ".index").c_str());
+      index << "type " << (fp16_ ? "float16" : "float32") << "\n"
+          << "rows " << num_rows_ << "\n" << "shape";
+      for (int i = 1; i < shape_.size(); ++i) {
+        index << " " << shape_[i];
+      }
+      index << "\n";
+      CHECK(index.good()) << "Failed to write " << name_ << ".index";
+    } else {
+      if (num_rows_ % 1000 != 0) {
+        txn_->Commit();
+      }
+      db_->Close();
+    }
+    LOG(ERROR)<< "Extracted features of " << num_rows_ <<
+        " query images for feature blob " << blob_name_;
+  }
+
+ private:
+  static const int kBuffers = 2;
+
+  struct Buffer {
+    std::vector<int> shape;
+    std::vector<Dtype> data;
+  };
+
+  void Run() {
+    for (;;) {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.empty() && !done_) {
+        condition_.wait(lock);
+      }
+      if (queue_.empty()) {
+        return;
+      }
+      Buffer* buffer = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+      Write(*buffer);
+      lock.lock();
+      ++free_;
+      condition_.notify_all();
+    }
+  }
+
+  // The features as floats, converted into *floats only if they are not.
+  static const float* AsFloats(const std::vector<float>& data,
+      std::vector<float>* floats) {
+    return data.data();
+  }
+  static const float* AsFloats(const std::vector<double>& data,
+      std::vector<float>* floats) {
+    floats->assign(data.begin(), data.end());
+    return floats->data();
+  }
+
+  void Write(const Buffer& buffer) {
+    const int num = buffer.shape[0];
+    const int dim = buffer.data.size() / num;
+    if (shape_.empty()) {
+      shape_ = buffer.shape;
+    }
+    CHECK(shape_.size() == buffer.shape.size() &&
+        std::equal(shape_.begin() + 1, shape_.end(), buffer.shape.begin() + 1))
+        << "Feature shape changed";
+    if (raw_) {
+      size_t written;
+      const size_t count = buffer.data.size();
+      const float* floats = AsFloats(buffer.data, &floats_);
+      if (fp16_) {
+        halfs_.resize(count);
+        caffe::caffe_cpu_float2half(count, floats, halfs_.data());
+        written = fwrite(halfs_.data(), sizeof(uint16_t), count, file_);
+      } else {
+        written = fwrite(floats, sizeof(float), count, file_);
+      }
+      CHECK_EQ(written, buffer.data.size()) << "Failed to write " << name_;
+      num_rows_ += num;
+      return;
+    }
+    Datum datum;
+    Blob<Dtype> shape_blob;
+    shape_blob.Reshape(buffer.shape);
+    datum.set_channels(shape_blob.channels());
+    datum.set_height(shape_blob.height());
+    datum.set_width(shape_blob.width());
+    google::protobuf::RepeatedField<float>* values =
+        datum.mutable_float_data();
+    values->Resize(dim, 0);
+    string out;
+    for (int n = 0; n < num; ++n) {
+      std::copy(buffer.data.begin() + n * dim,
+          buffer.data.begin() + (n + 1) * dim, values->mutable_data());
+      CHECK(datum.SerializeToString(&out));
+      txn_->Put(caffe::format_int(num_rows_, 10), out);
+      ++num_rows_;
+      if (num_rows_ % 1000 == 0) {
+        txn_->Commit();
+        txn_.reset(db_->NewTransaction());
+        LOG(ERROR)<< "Extracted features of " << num_rows_ <<
+            " query images for feature blob " << blob_name_;
+      }
+    }
+  }
+
+  string name_;
+  string blob_name_;
+  bool raw_;
+  bool fp16_;
+  FILE* file_;
+  boost::shared_ptr<db::DB> db_;
+  boost::shared_ptr<db::Transaction> txn_;
+  std::vector<int> shape_;
+  std::vector<float> floats_;
+  std::vector<uint16_t> halfs_;
+  size_t num_rows_;
+  Buffer buffers_[kBuffers];
+  int pending_;
+  int free_;
+  std::deque<Buffer*> queue_;
+  bool done_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  boost::shared_ptr<boost::thread> thread_;
+};
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -39,6 +226,8 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "  feature_extraction_proto_file  extract_feature_blob_name1[,name2,...]"
     "  save_feature_dataset_name1[,name2,...]  num_mini_batches  db_type"
     "  [CPU/GPU] [DEVICE_ID=0]\n"
+    "db_type is lmdb, leveldb, or raw_float32 or raw_fp16 to write a flat"
+    " file of feature rows and a .index file describing it.\n"
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names separated by ','."
     " The names cannot contain white space characters and the number of blobs"
@@ -118,66 +307,36 @@ int feature_extraction_pipeline(int argc, char** argv) {
 
   int num_mini_batches = atoi(argv[++arg_pos]);
 
-  std::vector<boost::shared_ptr<db::DB> > feature_dbs;
-  std::vector<boost::shared_ptr<db::Transaction> > txns;
-  const char* db_type = argv[++arg_pos];
+  const string db_type(argv[++arg_pos]);
+  std::vector<boost::shared_ptr<FeatureWriter<Dtype> > > writers;
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
-    boost::shared_ptr<db::DB> db(db::GetDB(db_type));
-    db->Open(dataset_names.at(i), db::NEW);
-    feature_dbs.push_back(db);
-    boost::shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
+    writers.push_back(boost::shared_ptr<FeatureWriter<Dtype> >(
+        new FeatureWriter<Dtype>(dataset_names[i], db_type, blob_names[i])));
   }
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
+  // The writers serialize and store batch k while the net runs batch k+1.
+  caffe::Timer timer;
+  timer.Start();
+  size_t num_extracted = 0;
   std::vector<Blob<float>*> input_vec;
-  std::vector<int> image_indices(num_features, 0);
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
     feature_extraction_net->Forward(input_vec);
     for (int i = 0; i < num_features; ++i) {
-      const boost::shared_ptr<Blob<Dtype> > feature_blob =
-        feature_extraction_net->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
-      for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
-        }
-        string key_str = caffe::format_int(image_indices[i], 10);
-
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(key_str, out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
-    }  // for (int i = 0; i < num_features; ++i)
+      writers[i]->Push(*feature_extraction_net->blob_by_name(blob_names[i]));
+    }
+    num_extracted += feature_extraction_net->blob_by_name(blob_names[0])->num();
   }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
   // write the last batch
   for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
-    }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-        " query images for feature blob " << blob_names[i];
-    feature_dbs.at(i)->Close();
+    writers[i]->Finish();
   }
+  const double seconds = timer.Seconds();
+  LOG(ERROR)<< "Extracted features of " << num_extracted << " images in "
+      << seconds << " s, " << num_extracted / std::max(seconds, 1e-6)
+      << " images/s";
 
   LOG(ERROR)<< "Successfully extracted the features!";
   return 0;